@@ -32,6 +32,7 @@ extern "C"
 
 typedef struct ctf_file ctf_file_t;
 typedef struct ctf_archive ctf_archive_t;
+typedef struct ctf_link ctf_link_t;
 typedef long ctf_id_t;
 
 /* If the debugger needs to provide the CTF library with a set of raw buffers
@@ -80,6 +81,23 @@ typedef struct ctf_funcinfo
   uint32_t ctc_flags;		/* Function attributes (see below).  */
 } ctf_funcinfo_t;
 
+/* Members and enumerators to add with ctf_add_members() and
+   ctf_add_enumerators().  A ctmd_offset of -1 places the member as
+   ctf_add_member() would.  */
+
+typedef struct ctf_membdef
+{
+  const char *ctmd_name;	/* Name of member, or NULL.  */
+  ctf_id_t ctmd_type;		/* Type of member.  */
+  unsigned long ctmd_offset;	/* Offset of member in bits, or -1.  */
+} ctf_membdef_t;
+
+typedef struct ctf_enumdef
+{
+  const char *cted_name;	/* Name of enumerator.  */
+  int cted_value;		/* Value of enumerator.  */
+} ctf_enumdef_t;
+
 typedef struct ctf_lblinfo
 {
   ctf_id_t ctb_typeidx;		/* Last type associated with the label.  */
@@ -167,6 +185,38 @@ enum
 #define	CTF_ADD_NONROOT	0	/* Type only visible in nested scope.  */
 #define	CTF_ADD_ROOT	1	/* Type visible at top-level scope.  */
 
+/* Flags for ctf_create_flags(), which apply to later additions to the given
+   container.  With CTF_CREATE_SHARE_REFS, ctf_add_pointer(), ctf_add_const(),
+   ctf_add_volatile(), ctf_add_restrict(), ctf_add_typedef() and ctf_add_array()
+   return the type already in the container, committed or not, with the same
+   kind, flag, reference (or array info) and name, rather than adding another
+   identical one.  */
+
+#define	CTF_CREATE_SHARE_REFS 0x1 /* Share identical reference types.  */
+
+/* Flags for ctf_open_flags(), which apply to all containers opened after it is
+   called.  With CTF_OPEN_LAZY_HASH, the hashes of type names are not built
+   until ctf_lookup_by_name() first needs them, which saves time and memory
+   for callers that only deal in type IDs.  */
+
+#define	CTF_OPEN_LAZY_HASH 0x1	/* Build name hashes on first lookup.  */
+
+/* Compression codecs for ctf_compression(), which selects the codec used by
+   ctf_compress_write() and ctf_arc_write() from then on.  The default is zlib;
+   the others are only available if libctf was built with them.  Containers
+   are inflated with whichever codec they were written with.  */
+
+#define	CTF_COMPRESS_ZLIB 1	/* zlib deflate: smallest, slowest to open.  */
+#define	CTF_COMPRESS_ZSTD 2	/* zstd: close to zlib in size, faster.  */
+#define	CTF_COMPRESS_LZ4  3	/* lz4: largest, fastest to open.  */
+
+/* ORed into the codec, CTF_COMPRESS_SEEKABLE compresses containers in
+   independent chunks, which are only inflated when first used.  This costs a
+   little space, but together with the index written by ctf_update() lets
+   consumers that only look at a few types avoid inflating the rest.  */
+
+#define	CTF_COMPRESS_SEEKABLE 0x100
+
 /* These typedefs are used to define the signature for callback functions
    that can be used with the iteration and visit functions below.  */
 
@@ -195,6 +245,19 @@ extern void ctf_arc_close (ctf_archive_t *);
 extern ctf_file_t *ctf_arc_open_by_name (const ctf_archive_t *,
 					 const char *, int *);
 
+/* A link deduplicates the types of many standalone containers: ctf_link()
+   turns its inputs into one parent container holding the types they share,
+   and one child per input that imports the parent.  The ctf_link_*() functions
+   returning int return zero or an error code.  */
+
+extern ctf_link_t *ctf_link_create (int *);
+extern int ctf_link_add (ctf_link_t *, ctf_file_t *, const char *);
+extern int ctf_link (ctf_link_t *, const char *);
+extern ctf_file_t *ctf_link_parent (ctf_link_t *);
+extern ctf_file_t *ctf_link_child (ctf_link_t *, const char *);
+extern int ctf_link_write (ctf_link_t *, const char *, size_t);
+extern void ctf_link_close (ctf_link_t *);
+
 extern ctf_file_t *ctf_parent_file (ctf_file_t *);
 extern const char *ctf_parent_name (ctf_file_t *);
 extern void ctf_parent_name_set (ctf_file_t *, const char *);
@@ -204,6 +267,7 @@ extern int ctf_type_ischild (ctf_file_t *, ctf_id_t);
 extern int ctf_import (ctf_file_t *, ctf_file_t *);
 extern int ctf_setmodel (ctf_file_t *, int);
 extern int ctf_getmodel (ctf_file_t *);
+extern int ctf_create_flags (ctf_file_t *, int);
 
 extern void ctf_setspecific (ctf_file_t *, void *);
 extern void *ctf_getspecific (ctf_file_t *);
@@ -211,6 +275,14 @@ extern void *ctf_getspecific (ctf_file_t *);
 extern int ctf_errno (ctf_file_t *);
 extern const char *ctf_errmsg (int);
 extern int ctf_version (int);
+extern int ctf_open_flags (int);
+
+/* ctf_threads() sets the number of threads libctf may use to speed up work on
+   very large containers.  The default is one, which uses no extra threads.
+   Results do not depend on the number of threads.  */
+extern int ctf_threads (int);
+
+extern int ctf_compression (int);
 
 extern int ctf_func_info (ctf_file_t *, unsigned long, ctf_funcinfo_t *);
 extern int ctf_func_args (ctf_file_t *, unsigned long, uint32_t, ctf_id_t *);
@@ -284,6 +356,10 @@ extern int ctf_add_enumerator (ctf_file_t *, ctf_id_t, const char *, int);
 extern int ctf_add_member (ctf_file_t *, ctf_id_t, const char *, ctf_id_t);
 extern int ctf_add_member_offset (ctf_file_t *, ctf_id_t, const char *,
 				  ctf_id_t, unsigned long);
+extern int ctf_add_members (ctf_file_t *, ctf_id_t, const ctf_membdef_t *,
+			    size_t);
+extern int ctf_add_enumerators (ctf_file_t *, ctf_id_t, const ctf_enumdef_t *,
+				size_t);
 
 extern int ctf_add_variable (ctf_file_t *, const char *, ctf_id_t);
 
@@ -296,6 +372,9 @@ extern int ctf_discard (ctf_file_t *);
 extern int ctf_write (ctf_file_t *, int);
 extern int ctf_gzwrite (ctf_file_t * fp, gzFile fd);
 extern int ctf_compress_write (ctf_file_t * fp, int fd);
+extern int ctf_write_dynamic (ctf_file_t *, int);
+extern int ctf_gzwrite_dynamic (ctf_file_t *, gzFile);
+extern int ctf_compress_write_dynamic (ctf_file_t *, int);
 
 #ifdef	__cplusplus
 }
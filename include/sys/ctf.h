@@ -39,7 +39,7 @@ extern "C"
    they are 32-bit or 64-bit programs.  CTF assumes that a standard ELF symbol
    table is available for use in the debugger, and uses the structure and data
    of the symbol table to avoid storing redundant information.  The CTF data
-   may be compressed on disk or in memory, indicated by a bit in the header.
+   may be compressed on disk or in memory, indicated by bits in the header.
    CTF may be interpreted in a raw disk file, or it may be stored in an ELF
    section, typically named .ctf.  Data structures are aligned so that a raw
    CTF file or CTF ELF section may be manipulated using mmap(2).
@@ -84,6 +84,10 @@ extern "C"
    already in the symbol table, and the CTF string table does not contain any
    duplicated strings.
 
+   The string table may be followed by an index of type names (see
+   ctf_index_t, below), which is counted as part of the string table so that
+   consumers that do not understand it can simply ignore it.
+
    If the CTF data has been merged with another parent CTF object, some outgoing
    edges may refer to type nodes that exist in another CTF object.  The debugger
    and libctf library are responsible for connecting the appropriate objects
@@ -157,6 +161,28 @@ typedef struct ctf_header
 #define CTF_VERSION CTF_VERSION_2 /* Current version.  */
 
 #define CTF_F_COMPRESS	0x1	/* Data buffer is compressed by libctf.  */
+#define CTF_F_INDEX	0x2	/* String table ends with a ctf_index_t.  */
+#define CTF_F_ZSTD	0x4	/* Compressed with zstd rather than zlib.  */
+#define CTF_F_LZ4	0x8	/* Compressed with lz4 rather than zlib.  */
+#define CTF_F_CHUNKED	0x10	/* Compressed in independent chunks.  */
+
+/* The codec and chunk bits are only meaningful alongside CTF_F_COMPRESS, so
+   that older consumers fail to inflate the data rather than misreading it.  */
+
+#define CTF_F_CODEC	(CTF_F_ZSTD | CTF_F_LZ4)
+
+/* If CTF_F_CHUNKED is set, the data after the header is split into chunks of
+   ctc_chunksize bytes (the last may be shorter), each compressed on its own
+   so that consumers can inflate only the parts they use.  The header is
+   followed by a ctf_chunkhdr_t, then ctc_nchunks + 1 uint32_t offsets of the
+   start of each compressed chunk and of the end of the last one, relative to
+   the end of the offsets, and then the compressed chunks.  */
+
+typedef struct ctf_chunkhdr
+{
+  uint32_t ctc_chunksize;	/* Uncompressed chunk size (a power of 2).  */
+  uint32_t ctc_nchunks;		/* Number of chunks.  */
+} ctf_chunkhdr_t;
 
 typedef struct ctf_lblent
 {
@@ -170,6 +196,64 @@ typedef struct ctf_varent
   uint32_t ctv_typeidx;		/* Index of type of this variable.  */
 } ctf_varent_t;
 
+/* The index, present if CTF_F_INDEX is set, lets consumers find types by ID
+   and look up type names without walking the type section or hashing every
+   name in the container when it is opened.  It follows the last string in the
+   string table, aligned to a 4-byte boundary, and ends with a ctf_index_t at
+   the very end of the string table.  All offsets in it are relative to the
+   start of the string table.
+
+   The index holds two tables of cti_ntypes + 1 uint32_t values, indexed by
+   type index: the offset of each type record from the end of the CTF header,
+   and the index of a pointer to each type, or zero if there is none.  (A
+   pointer to an anonymous typedef also counts as a pointer to the type it
+   refers to.)  These tables are absent if cti_typeoff is zero.
+
+   Names are indexed by four hashes, one per namespace: structs, unions,
+   enums, and all other names.  Each is an open-addressed, linearly-probed
+   array of cih_nbuckets slots (a power of 2) holding indices into an array of
+   cih_nelems ctf_idxelem_t.  Index zero marks an empty slot, and there is
+   always at least one empty slot.  The hash function is the libctf name hash
+   for CTF_INDEX_VERSION, seeded with cti_seed.  Consumers must ignore indexes
+   with an unknown version.  */
+
+#define CTF_INDEX_MAGIC	0x1dec		/* Magic number identifying index.  */
+#define CTF_INDEX_VERSION 1		/* Index format and hash version.  */
+
+#define CTF_INDEX_STRUCTS 0		/* Index of struct hash.  */
+#define CTF_INDEX_UNIONS 1		/* Index of union hash.  */
+#define CTF_INDEX_ENUMS 2		/* Index of enum hash.  */
+#define CTF_INDEX_NAMES 3		/* Index of hash of all other names.  */
+#define CTF_INDEX_MAX 4			/* Number of hashes.  */
+
+typedef struct ctf_idxelem
+{
+  uint32_t cie_name;		/* Reference to name in string table.  */
+  uint32_t cie_type;		/* Type ID of this name.  */
+  uint32_t cie_hash;		/* Hash value of the name.  */
+} ctf_idxelem_t;
+
+typedef struct ctf_idxhash
+{
+  uint32_t cih_nbuckets;	/* Number of slots (a power of 2).  */
+  uint32_t cih_nelems;		/* Number of elements, including element 0.  */
+  uint32_t cih_bucketoff;	/* Offset of slot array.  */
+  uint32_t cih_elemoff;		/* Offset of element array.  */
+} ctf_idxhash_t;
+
+typedef struct ctf_index
+{
+  unsigned short cti_magic;	/* Magic number (CTF_INDEX_MAGIC).  */
+  unsigned short cti_version;	/* Index version (CTF_INDEX_VERSION).  */
+  uint32_t cti_strlen;		/* Length of the strings proper.  */
+  uint32_t cti_seedlo;		/* Low 32 bits of hash seed.  */
+  uint32_t cti_seedhi;		/* High 32 bits of hash seed.  */
+  uint32_t cti_ntypes;		/* Number of types.  */
+  uint32_t cti_typeoff;		/* Offset of type offset table.  */
+  uint32_t cti_ptroff;		/* Offset of pointer table.  */
+  ctf_idxhash_t cti_hash[CTF_INDEX_MAX]; /* Per-namespace hashes.  */
+} ctf_index_t;
+
 /* In format v2, type sizes, measured in bytes, come in type flavours.  Nearly
    all of them fit into a (UINT_MAX - 1), and thus can be stored in the ctt_size
    member of a ctf_stype_t.  The maximum value for these sizes is CTF_MAX_SIZE.
@@ -20,7 +20,29 @@
 
 #include <ctf-impl.h>
 
-static off_t arc_write_one_ctf (ctf_file_t * f, int fd, size_t threshold);
+/* A member of an archive being written, compressed in advance if it is
+   larger than the threshold.  */
+typedef struct arc_member
+{
+  void *am_buf;			/* Compressed data, or NULL.  */
+  size_t am_bufsize;		/* Size of am_buf.  */
+  size_t am_len;		/* Length of compressed data.  */
+  int am_flags;			/* Compression flags for the header.  */
+  int am_err;			/* Error compressing, if any.  */
+} arc_member_t;
+
+typedef struct arc_compress_arg
+{
+  ctf_file_t **aca_files;	/* Members to compress.  */
+  arc_member_t *aca_members;	/* Where to put them.  */
+  size_t aca_threshold;		/* Size above which to compress.  */
+} arc_compress_arg_t;
+
+static int arc_compress_members (void *arg, unsigned long start,
+				 unsigned long end);
+static void arc_free_members (arc_member_t *members, size_t n);
+static off_t arc_write_one_ctf (ctf_file_t * f, int fd,
+				const arc_member_t *member);
 static ctf_file_t *ctf_arc_open_by_offset (const ctf_archive_t * arc,
 					   size_t offset, int *errp);
 static int sort_modent_by_name (const void *one, const void *two, void *n);
@@ -48,6 +70,8 @@ ctf_arc_write (const char *file, ctf_file_t ** ctf_files, size_t ctf_file_cnt,
   char *np;
   off_t nameoffs;
   struct ctf_archive_modent *modent;
+  arc_member_t *members = NULL;
+  arc_compress_arg_t aca;
 
   ctf_dprintf ("Writing archive %s with %zi files\n", file, ctf_file_cnt);
 
@@ -122,6 +146,36 @@ ctf_arc_write (const char *file, ctf_file_t ** ctf_files, size_t ctf_file_cnt,
       goto err_unmap;
     }
 
+  /* Members last updated by appending to them are indexed before any of them
+     is compressed, since that changes them.  */
+
+  for (i = 0; i < ctf_file_cnt; i++)
+    {
+      int err;
+
+      if ((err = ctf_refresh_index (ctf_files[i])) != 0)
+	{
+	  errno = err;
+	  errmsg = "Error writing named CTF to %s: %s\n";
+	  goto err_free;
+	}
+    }
+
+  /* Compress the members concurrently, so that only the writing is done in
+     order.  */
+
+  members = calloc (ctf_file_cnt, sizeof (arc_member_t));
+  if (members == NULL && ctf_file_cnt > 0)
+    {
+      errmsg = "Error writing named CTF to %s: %s\n";
+      goto err_free;
+    }
+
+  aca.aca_files = ctf_files;
+  aca.aca_members = members;
+  aca.aca_threshold = threshold;
+  (void) ctf_parallel (ctf_file_cnt, 1, arc_compress_members, &aca);
+
   for (i = 0, namesz = 0,
        modent = (ctf_archive_modent_t *) ((char *) archdr
 					  + sizeof (struct ctf_archive));
@@ -131,7 +185,7 @@ ctf_arc_write (const char *file, ctf_file_t ** ctf_files, size_t ctf_file_cnt,
 
       strcpy (&nametbl[namesz], names[i]);
 
-      off = arc_write_one_ctf (ctf_files[i], fd, threshold);
+      off = arc_write_one_ctf (ctf_files[i], fd, &members[i]);
       ctf_dprintf ("Written %s, offset now %zi\n", names[i], off);
       if ((off < 0) && (off > -ECTF_BASE))
 	{
@@ -179,6 +233,7 @@ ctf_arc_write (const char *file, ctf_file_t ** ctf_files, size_t ctf_file_cnt,
       np += len;
     }
   free (nametbl);
+  arc_free_members (members, ctf_file_cnt);
 
   if (msync (archdr, headersz, MS_ASYNC) < 0)
     {
@@ -196,6 +251,7 @@ ctf_arc_write (const char *file, ctf_file_t ** ctf_files, size_t ctf_file_cnt,
 
 err_free:
   free (nametbl);
+  arc_free_members (members, ctf_file_cnt);
 err_unmap:
   munmap (archdr, headersz);
 err_close:
@@ -208,27 +264,69 @@ err:
   return errno;
 }
 
-/* Write one CTF file out.  Return the file position of the written file (or
-   rather, of the file-size uint64_t that precedes it): negative return is a
-   negative errno or ctf_errno value.  On error, the file position may no longer
-   be at the end of the file.  */
+/* Compress the archive members from START up to END that are larger than the
+   threshold.  Errors are left for arc_write_one_ctf() to report.  */
+static int
+arc_compress_members (void *arg, unsigned long start, unsigned long end)
+{
+  arc_compress_arg_t *aca = arg;
+  unsigned long i;
+
+  for (i = start; i < end; i++)
+    {
+      ctf_file_t *f = aca->aca_files[i];
+      arc_member_t *am = &aca->aca_members[i];
+
+      if (f->ctf_size <= aca->aca_threshold)
+	continue;
+
+      LCTF_CHUNK (f, f->ctf_buf, f->ctf_size - sizeof (ctf_header_t));
+      am->am_err = ctf_compress (f->ctf_base + sizeof (ctf_header_t),
+				 f->ctf_size - sizeof (ctf_header_t),
+				 &am->am_flags, &am->am_buf, &am->am_bufsize,
+				 &am->am_len);
+    }
+
+  return 0;
+}
+
+static void
+arc_free_members (arc_member_t *members, size_t n)
+{
+  size_t i;
+
+  if (members == NULL)
+    return;
+
+  for (i = 0; i < n; i++)
+    if (members[i].am_buf != NULL)
+      ctf_data_free (members[i].am_buf, members[i].am_bufsize);
+
+  free (members);
+}
+
+/* Write one CTF file out, using its compressed data if it has any.  Return the
+   file position of the written file (or rather, of the file-size uint64_t that
+   precedes it): negative return is a negative errno or ctf_errno value.  On
+   error, the file position may no longer be at the end of the file.  */
 static off_t
-arc_write_one_ctf (ctf_file_t * f, int fd, size_t threshold)
+arc_write_one_ctf (ctf_file_t * f, int fd, const arc_member_t *member)
 {
   off_t off, end_off;
   uint64_t ctfsz = 0;
   char *ctfszp;
   size_t ctfsz_len;
-  int (*writefn) (ctf_file_t * fp, int fd);
+  int err;
+
+  if (member->am_err != 0)
+    {
+      ctf_set_errno (f, member->am_err);
+      return member->am_err * -1;
+    }
 
   if ((off = lseek (fd, 0, SEEK_CUR)) < 0)
     return errno * -1;
 
-  if (f->ctf_size > threshold)
-    writefn = ctf_compress_write;
-  else
-    writefn = ctf_write;
-
   /* This zero-write turns into the size in a moment. */
   ctfsz_len = sizeof (ctfsz);
   ctfszp = (char *) &ctfsz;
@@ -241,7 +339,16 @@ arc_write_one_ctf (ctf_file_t * f, int fd, size_t threshold)
       ctfszp += writelen;
     }
 
-  if (writefn (f, fd) != 0)
+  if (member->am_buf != NULL)
+    {
+      if ((err = ctf_write_compressed (f, fd, member->am_buf, member->am_len,
+				       member->am_flags)) != 0)
+	{
+	  ctf_set_errno (f, err);
+	  return err * -1;
+	}
+    }
+  else if (ctf_write (f, fd) != 0)
     return f->ctf_errno * -1;
 
   if ((end_off = lseek (fd, 0, SEEK_CUR)) < 0)
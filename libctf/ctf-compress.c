@@ -0,0 +1,661 @@
+/* Compression codecs.
+   Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+
+   Licensed under the Universal Permissive License v 1.0 as shown at
+   http://oss.oracle.com/licenses/upl.
+
+   Licensed under the GNU General Public License (GPL), version 2. See the file
+   COPYING in the top level of this tree.  */
+
+#include <config.h>
+#include <ctf-impl.h>
+#include <errno.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+int _libctf_compression = CTF_COMPRESS_ZLIB;	/* Codec for new writes.  */
+
+/* Data larger than one block is deflated a block at a time, in parallel, in
+   the manner of pigz.  Each block but the last ends with a sync flush, so the
+   blocks concatenate into one deflate stream, and each is primed with the
+   window of data before it, so little is lost in compression.  The block size
+   is fixed, so the output does not depend on the number of threads.  */
+
+#define ZLIB_BLOCK (128 * 1024)		/* Uncompressed size of each block.  */
+#define ZLIB_WINDOW 32768		/* Size of the deflate window.  */
+#define ZLIB_SLOT (compressBound (ZLIB_BLOCK) + 16) /* Space for a block.  */
+
+typedef struct zlib_blocks
+{
+  const unsigned char *zb_src;	/* Data to compress.  */
+  size_t zb_len;		/* Its length.  */
+  unsigned char *zb_dst;	/* Slots of ZLIB_SLOT bytes for each block.  */
+  size_t *zb_outlen;		/* Compressed length of each block.  */
+  uLong *zb_adler;		/* Adler-32 of each uncompressed block.  */
+} zlib_blocks_t;
+
+static size_t
+zlib_bound (size_t len)
+{
+  if (len <= ZLIB_BLOCK)
+    return compressBound (len);
+
+  return 2 + ((len + ZLIB_BLOCK - 1) / ZLIB_BLOCK) * ZLIB_SLOT + 4;
+}
+
+static int
+zlib_deflate_blocks (void *arg, unsigned long start, unsigned long end)
+{
+  zlib_blocks_t *zb = arg;
+  unsigned long i;
+
+  for (i = start; i < end; i++)
+    {
+      size_t off = i * ZLIB_BLOCK;
+      size_t len = zb->zb_len - off < ZLIB_BLOCK ? zb->zb_len - off
+	: ZLIB_BLOCK;
+      int last = off + len == zb->zb_len;
+      z_stream zs;
+      int rc;
+
+      memset (&zs, 0, sizeof (z_stream));
+      if ((rc = deflateInit2 (&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8,
+			      Z_DEFAULT_STRATEGY)) != Z_OK)
+	{
+	  ctf_dprintf ("zlib deflate err: %s\n", zError (rc));
+	  return ECTF_COMPRESS;
+	}
+
+      if (i > 0)
+	deflateSetDictionary (&zs, zb->zb_src + off - ZLIB_WINDOW, ZLIB_WINDOW);
+
+      zs.next_in = (unsigned char *) zb->zb_src + off;
+      zs.avail_in = len;
+      zs.next_out = zb->zb_dst + i * ZLIB_SLOT;
+      zs.avail_out = ZLIB_SLOT;
+
+      rc = deflate (&zs, last ? Z_FINISH : Z_SYNC_FLUSH);
+      zb->zb_outlen[i] = ZLIB_SLOT - zs.avail_out;
+      deflateEnd (&zs);
+
+      if (rc != (last ? Z_STREAM_END : Z_OK) || zs.avail_in != 0
+	  || zs.avail_out == 0)
+	{
+	  ctf_dprintf ("zlib deflate err: %s\n", zError (rc));
+	  return ECTF_COMPRESS;
+	}
+
+      zb->zb_adler[i] = adler32 (adler32 (0, NULL, 0), zb->zb_src + off, len);
+    }
+
+  return 0;
+}
+
+static int
+zlib_compress (void *dst, size_t *dstlen, const void *src, size_t srclen)
+{
+  unsigned char *out = dst;
+  zlib_blocks_t zb;
+  size_t nblocks, i, pos;
+  uLong adler;
+  uLongf len = *dstlen;
+  int rc;
+
+  if (srclen <= ZLIB_BLOCK)
+    {
+      if ((rc = compress (dst, &len, src, srclen)) != Z_OK)
+	{
+	  ctf_dprintf ("zlib deflate err: %s\n", zError (rc));
+	  return ECTF_COMPRESS;
+	}
+      *dstlen = len;
+      return 0;
+    }
+
+  if (*dstlen < zlib_bound (srclen))
+    return ECTF_COMPRESS;
+
+  nblocks = (srclen + ZLIB_BLOCK - 1) / ZLIB_BLOCK;
+  zb.zb_src = src;
+  zb.zb_len = srclen;
+  zb.zb_dst = out + 2;
+  zb.zb_outlen = ctf_alloc (nblocks * sizeof (size_t));
+  zb.zb_adler = ctf_alloc (nblocks * sizeof (uLong));
+
+  if (zb.zb_outlen == NULL || zb.zb_adler == NULL)
+    rc = ENOMEM;
+  else
+    rc = ctf_parallel (nblocks, 1, zlib_deflate_blocks, &zb);
+
+  if (rc == 0)
+    {
+      /* The zlib header that compress() would write, then the blocks moved
+	 down to follow one another, and the Adler-32 of all the data.  */
+
+      out[0] = 0x78;
+      out[1] = 0x9c;
+
+      adler = zb.zb_adler[0];
+      for (i = 0, pos = 2; i < nblocks; i++)
+	{
+	  memmove (out + pos, zb.zb_dst + i * ZLIB_SLOT, zb.zb_outlen[i]);
+	  pos += zb.zb_outlen[i];
+	  if (i > 0)
+	    adler = adler32_combine (adler, zb.zb_adler[i],
+				     i < nblocks - 1 ? ZLIB_BLOCK
+				     : srclen - i * ZLIB_BLOCK);
+	}
+
+      out[pos++] = adler >> 24;
+      out[pos++] = adler >> 16;
+      out[pos++] = adler >> 8;
+      out[pos++] = adler;
+      *dstlen = pos;
+    }
+
+  if (zb.zb_outlen != NULL)
+    ctf_free (zb.zb_outlen, nblocks * sizeof (size_t));
+  if (zb.zb_adler != NULL)
+    ctf_free (zb.zb_adler, nblocks * sizeof (uLong));
+  return rc;
+}
+
+static int
+zlib_decompress (void *dst, size_t *dstlen, const void *src, size_t srclen)
+{
+  uLongf len = *dstlen;
+  int rc;
+
+  if ((rc = uncompress (dst, &len, src, srclen)) != Z_OK)
+    {
+      ctf_dprintf ("zlib inflate err: %s\n", zError (rc));
+      return ECTF_DECOMPRESS;
+    }
+  *dstlen = len;
+  return 0;
+}
+
+#ifdef HAVE_ZSTD
+static size_t
+zstd_bound (size_t len)
+{
+  return ZSTD_compressBound (len);
+}
+
+static int
+zstd_compress (void *dst, size_t *dstlen, const void *src, size_t srclen)
+{
+  size_t rc;
+
+  rc = ZSTD_compress (dst, *dstlen, src, srclen, ZSTD_CLEVEL_DEFAULT);
+  if (ZSTD_isError (rc))
+    {
+      ctf_dprintf ("zstd compress err: %s\n", ZSTD_getErrorName (rc));
+      return ECTF_COMPRESS;
+    }
+  *dstlen = rc;
+  return 0;
+}
+
+static int
+zstd_decompress (void *dst, size_t *dstlen, const void *src, size_t srclen)
+{
+  size_t rc;
+
+  rc = ZSTD_decompress (dst, *dstlen, src, srclen);
+  if (ZSTD_isError (rc))
+    {
+      ctf_dprintf ("zstd decompress err: %s\n", ZSTD_getErrorName (rc));
+      return ECTF_DECOMPRESS;
+    }
+  *dstlen = rc;
+  return 0;
+}
+#endif /* HAVE_ZSTD */
+
+#ifdef HAVE_LZ4
+/* The lz4 block format is limited to LZ4_MAX_INPUT_SIZE bytes, which is well
+   beyond any realistic CTF container.  */
+
+static size_t
+lz4_bound (size_t len)
+{
+  if (len > LZ4_MAX_INPUT_SIZE)
+    return 0;
+  return LZ4_compressBound ((int) len);
+}
+
+static int
+lz4_compress (void *dst, size_t *dstlen, const void *src, size_t srclen)
+{
+  int rc;
+
+  if (srclen > LZ4_MAX_INPUT_SIZE)
+    return ECTF_COMPRESS;
+
+  rc = LZ4_compress_default (src, dst, (int) srclen,
+			     *dstlen > INT_MAX ? INT_MAX : (int) *dstlen);
+  if (rc <= 0)
+    {
+      ctf_dprintf ("lz4 compress failed\n");
+      return ECTF_COMPRESS;
+    }
+  *dstlen = rc;
+  return 0;
+}
+
+static int
+lz4_decompress (void *dst, size_t *dstlen, const void *src, size_t srclen)
+{
+  int rc;
+
+  if (srclen > INT_MAX)
+    return ECTF_DECOMPRESS;
+
+  rc = LZ4_decompress_safe (src, dst, (int) srclen,
+			    *dstlen > INT_MAX ? INT_MAX : (int) *dstlen);
+  if (rc < 0)
+    {
+      ctf_dprintf ("lz4 decompress err: %i\n", rc);
+      return ECTF_DECOMPRESS;
+    }
+  *dstlen = rc;
+  return 0;
+}
+#endif /* HAVE_LZ4 */
+
+static const ctf_codec_t _libctf_codecs[] =
+  {
+   { "zlib", CTF_COMPRESS_ZLIB, CTF_F_COMPRESS,
+     zlib_bound, zlib_compress, zlib_decompress },
+#ifdef HAVE_ZSTD
+   { "zstd", CTF_COMPRESS_ZSTD, CTF_F_COMPRESS | CTF_F_ZSTD,
+     zstd_bound, zstd_compress, zstd_decompress },
+#endif
+#ifdef HAVE_LZ4
+   { "lz4", CTF_COMPRESS_LZ4, CTF_F_COMPRESS | CTF_F_LZ4,
+     lz4_bound, lz4_compress, lz4_decompress },
+#endif
+   { NULL, 0, 0, NULL, NULL, NULL }
+  };
+
+/* Return the codec with the given CTF_COMPRESS_* ID, or NULL if libctf was
+   built without it.  */
+
+const ctf_codec_t *
+ctf_codec (int id)
+{
+  const ctf_codec_t *cc;
+
+  for (cc = _libctf_codecs; cc->cc_name != NULL; cc++)
+    if (cc->cc_id == id)
+      return cc;
+
+  return NULL;
+}
+
+/* Return the codec a container with the given header flags was compressed
+   with, or NULL if the flags name no codec that libctf was built with.  */
+
+const ctf_codec_t *
+ctf_codec_flags (int flags)
+{
+  const ctf_codec_t *cc;
+
+  flags &= CTF_F_COMPRESS | CTF_F_CODEC;
+
+  for (cc = _libctf_codecs; cc->cc_name != NULL; cc++)
+    if (cc->cc_flags == flags)
+      return cc;
+
+  return NULL;
+}
+
+/* Chunks being compressed by ctf_compress(), each into a slot of cc_bound()
+   of the chunk size.  */
+
+typedef struct ctf_compress_chunks
+{
+  const ctf_codec_t *ccc_codec;	/* Codec to compress with.  */
+  const unsigned char *ccc_src;	/* Data to compress.  */
+  size_t ccc_len;		/* Its length.  */
+  unsigned char *ccc_dst;	/* Slots for each compressed chunk.  */
+  size_t ccc_slot;		/* Size of each slot.  */
+  size_t *ccc_outlen;		/* Compressed length of each chunk.  */
+} ctf_compress_chunks_t;
+
+static int
+ctf_compress_chunk (void *arg, unsigned long start, unsigned long end)
+{
+  ctf_compress_chunks_t *ccc = arg;
+  unsigned long i;
+  int err;
+
+  for (i = start; i < end; i++)
+    {
+      size_t off = i * LCTF_CHUNK_SIZE;
+      size_t len = ccc->ccc_len - off < LCTF_CHUNK_SIZE ? ccc->ccc_len - off
+	: LCTF_CHUNK_SIZE;
+
+      ccc->ccc_outlen[i] = ccc->ccc_slot;
+      if ((err = ccc->ccc_codec->cc_compress (ccc->ccc_dst + i * ccc->ccc_slot,
+					      &ccc->ccc_outlen[i],
+					      ccc->ccc_src + off, len)) != 0)
+	return err;
+    }
+
+  return 0;
+}
+
+/* Compress LEN bytes at SRC with the codec selected by ctf_compression() into
+   a new buffer allocated with ctf_data_alloc(), returning it in *BUFP, its size
+   in *BUFSIZEP and the length of the compressed data in *LENP, and ORing the
+   header flags describing it into *FLAGSP.  */
+
+int
+ctf_compress (const void *src, size_t len, int *flagsp, void **bufp,
+	      size_t *bufsizep, size_t *lenp)
+{
+  const ctf_codec_t *codec = ctf_codec (_libctf_compression
+					& ~CTF_COMPRESS_SEEKABLE);
+  ctf_compress_chunks_t ccc;
+  ctf_chunkhdr_t *cch;
+  unsigned char *buf;
+  uint32_t *offs;
+  size_t bufsize, hdrsize, bound, nchunks, i;
+  int err;
+
+  if (!(_libctf_compression & CTF_COMPRESS_SEEKABLE))
+    {
+      if ((bufsize = codec->cc_bound (len)) == 0)
+	return ECTF_COMPRESS;
+
+      if ((buf = ctf_data_alloc (bufsize)) == MAP_FAILED)
+	return ECTF_ZALLOC;
+
+      *lenp = bufsize;
+      if ((err = codec->cc_compress (buf, lenp, src, len)) != 0)
+	{
+	  ctf_data_free (buf, bufsize);
+	  return err;
+	}
+
+      *flagsp |= codec->cc_flags;
+      *bufp = buf;
+      *bufsizep = bufsize;
+      return 0;
+    }
+
+  nchunks = (len + LCTF_CHUNK_SIZE - 1) / LCTF_CHUNK_SIZE;
+  hdrsize = sizeof (ctf_chunkhdr_t) + (nchunks + 1) * sizeof (uint32_t);
+
+  if ((bound = codec->cc_bound (LCTF_CHUNK_SIZE)) == 0)
+    return ECTF_COMPRESS;
+  bufsize = hdrsize + nchunks * bound;
+
+  if ((buf = ctf_data_alloc (bufsize)) == MAP_FAILED)
+    return ECTF_ZALLOC;
+
+  cch = (ctf_chunkhdr_t *) buf;
+  cch->ctc_chunksize = LCTF_CHUNK_SIZE;
+  cch->ctc_nchunks = nchunks;
+  offs = (uint32_t *) (buf + sizeof (ctf_chunkhdr_t));
+  offs[0] = 0;
+
+  /* Compress the chunks in parallel, each into its own slot, and then move
+     them down to follow one another.  */
+
+  ccc.ccc_codec = codec;
+  ccc.ccc_src = src;
+  ccc.ccc_len = len;
+  ccc.ccc_dst = buf + hdrsize;
+  ccc.ccc_slot = bound;
+  if ((ccc.ccc_outlen = ctf_alloc (nchunks * sizeof (size_t))) == NULL)
+    {
+      ctf_data_free (buf, bufsize);
+      return ENOMEM;
+    }
+
+  err = ctf_parallel (nchunks, 1, ctf_compress_chunk, &ccc);
+
+  for (i = 0; i < nchunks && err == 0; i++)
+    {
+      if (offs[i] + ccc.ccc_outlen[i] > UINT32_MAX)
+	{
+	  err = ECTF_COMPRESS;
+	  break;
+	}
+      memmove (buf + hdrsize + offs[i], buf + hdrsize + i * bound,
+	       ccc.ccc_outlen[i]);
+      offs[i + 1] = offs[i] + ccc.ccc_outlen[i];
+    }
+
+  ctf_free (ccc.ccc_outlen, nchunks * sizeof (size_t));
+  if (err != 0)
+    {
+      ctf_data_free (buf, bufsize);
+      return err;
+    }
+
+  *flagsp |= codec->cc_flags | CTF_F_CHUNKED;
+  *bufp = buf;
+  *bufsizep = bufsize;
+  *lenp = hdrsize + offs[nchunks];
+  return 0;
+}
+
+/* Check the chunk table at the start of the DATALEN bytes of chunked data at
+   DATA, and set up lazy inflation of the chunks into the LEN-byte BUF.  */
+
+int
+ctf_chunk_open (const ctf_codec_t *codec, const void *data, size_t datalen,
+		void *buf, size_t len, ctf_chunks_t **ckp)
+{
+  const ctf_chunkhdr_t *cch = data;
+  const uint32_t *offs;
+  ctf_chunks_t *ck;
+  size_t hdrsize, i;
+
+  if (datalen < sizeof (ctf_chunkhdr_t))
+    return ECTF_CORRUPT;
+
+  if (cch->ctc_chunksize < 4096 || cch->ctc_chunksize > (1 << 24)
+      || (cch->ctc_chunksize & (cch->ctc_chunksize - 1)) != 0
+      || cch->ctc_nchunks != (len + cch->ctc_chunksize - 1)
+	 / cch->ctc_chunksize)
+    return ECTF_CORRUPT;
+
+  hdrsize = sizeof (ctf_chunkhdr_t)
+    + ((size_t) cch->ctc_nchunks + 1) * sizeof (uint32_t);
+  if (hdrsize > datalen)
+    return ECTF_CORRUPT;
+
+  offs = (const uint32_t *) ((const unsigned char *) data
+			     + sizeof (ctf_chunkhdr_t));
+  if (offs[0] != 0 || offs[cch->ctc_nchunks] > datalen - hdrsize)
+    return ECTF_CORRUPT;
+
+  for (i = 0; i < cch->ctc_nchunks; i++)
+    if (offs[i + 1] < offs[i])
+      return ECTF_CORRUPT;
+
+  if ((ck = ctf_alloc (sizeof (ctf_chunks_t))) == NULL)
+    return ENOMEM;
+
+  if ((ck->ck_state = ctf_alloc (cch->ctc_nchunks)) == NULL)
+    {
+      ctf_free (ck, sizeof (ctf_chunks_t));
+      return ENOMEM;
+    }
+  memset (ck->ck_state, LCTF_CHUNK_NONE, cch->ctc_nchunks);
+
+  ck->ck_codec = codec;
+  ck->ck_data = (const unsigned char *) data + hdrsize;
+  ck->ck_offs = offs;
+  ck->ck_buf = buf;
+  ck->ck_len = len;
+  ck->ck_size = cch->ctc_chunksize;
+  ck->ck_nchunks = cch->ctc_nchunks;
+
+  ctf_dprintf ("%lu %s chunks of %lu bytes\n", (unsigned long) ck->ck_nchunks,
+	       codec->cc_name, (unsigned long) ck->ck_size);
+  *ckp = ck;
+  return 0;
+}
+
+void
+ctf_chunk_close (ctf_chunks_t *ck)
+{
+  if (ck == NULL)
+    return;
+
+  ctf_free (ck->ck_state, ck->ck_nchunks);
+  ctf_free (ck, sizeof (ctf_chunks_t));
+}
+
+/* Inflate chunk I, unless that has already been done.  Only one thread
+   inflates each chunk: others wait for it.  A chunk that cannot be inflated
+   is left zeroed, which reads as empty strings and unknown types.  */
+
+static void
+ctf_chunk_inflate (ctf_chunks_t *ck, size_t i)
+{
+  unsigned char state;
+
+  while ((state = __atomic_load_n (&ck->ck_state[i], __ATOMIC_ACQUIRE))
+	 != LCTF_CHUNK_READY)
+    {
+      if (state == LCTF_CHUNK_NONE
+	  && __atomic_compare_exchange_n (&ck->ck_state[i], &state,
+					  LCTF_CHUNK_BUSY, 0, __ATOMIC_ACQUIRE,
+					  __ATOMIC_RELAXED))
+	{
+	  unsigned char *dst = ck->ck_buf + i * ck->ck_size;
+	  size_t len = ck->ck_len - i * ck->ck_size;
+	  size_t dstlen;
+
+	  if (len > ck->ck_size)
+	    len = ck->ck_size;
+	  dstlen = len;
+
+	  if (ck->ck_codec->cc_decompress (dst, &dstlen,
+					   ck->ck_data + ck->ck_offs[i],
+					   ck->ck_offs[i + 1] - ck->ck_offs[i])
+	      != 0 || dstlen != len)
+	    {
+	      ctf_dprintf ("Chunk %lu of CTF data is corrupt\n",
+			   (unsigned long) i);
+	      memset (dst, 0, len);
+	    }
+
+	  __atomic_store_n (&ck->ck_state[i], LCTF_CHUNK_READY,
+			    __ATOMIC_RELEASE);
+	  return;
+	}
+
+      sched_yield ();
+    }
+}
+
+/* Inflate every chunk overlapping the LEN bytes at P in the CTF data buffer.
+   Bytes outside the buffer are ignored.  */
+
+void
+ctf_chunk_ptr (const ctf_file_t *fp, const void *p, size_t len)
+{
+  ctf_chunks_t *ck = fp->ctf_chunks;
+  size_t off, i;
+
+  if ((const unsigned char *) p < ck->ck_buf || len == 0)
+    return;
+
+  off = (const unsigned char *) p - ck->ck_buf;
+  if (off >= ck->ck_len)
+    return;
+  if (len > ck->ck_len - off)
+    len = ck->ck_len - off;
+
+  for (i = off / ck->ck_size; i <= (off + len - 1) / ck->ck_size; i++)
+    ctf_chunk_inflate (ck, i);
+}
+
+/* Inflate every chunk holding part of the string at S in the CTF data
+   buffer.  */
+
+void
+ctf_chunk_str (const ctf_file_t *fp, const char *s)
+{
+  ctf_chunks_t *ck = fp->ctf_chunks;
+  size_t off, end;
+
+  if ((const unsigned char *) s < ck->ck_buf)
+    return;
+
+  for (off = (const unsigned char *) s - ck->ck_buf; off < ck->ck_len;
+       off = end)
+    {
+      ctf_chunk_inflate (ck, off / ck->ck_size);
+
+      end = (off / ck->ck_size + 1) * ck->ck_size;
+      if (end > ck->ck_len)
+	end = ck->ck_len;
+
+      if (memchr (ck->ck_buf + off, '\0', end - off) != NULL)
+	break;
+    }
+}
+
+/* Return a pointer to the type with index I, inflating all of its chunks.  The
+   type extends to the start of the next one, or to the end of the type
+   section.  */
+
+ctf_type_t *
+ctf_chunk_type (const ctf_file_t *fp, unsigned long i)
+{
+  const unsigned char *tp = fp->ctf_buf + fp->ctf_txlate[i];
+  const unsigned char *end;
+
+  if (i < fp->ctf_typemax)
+    end = fp->ctf_buf + fp->ctf_txlate[i + 1];
+  else
+    end = (const unsigned char *) fp->ctf_str[CTF_STRTAB_0].cts_strs;
+
+  ctf_chunk_ptr (fp, tp, end > tp ? (size_t) (end - tp) : sizeof (ctf_stype_t));
+  return (ctf_type_t *) tp;
+}
+
+/* Set the codec used to compress containers written from now on, returning the
+   previous one.  Zero returns the current codec without changing it.  The
+   CTF_COMPRESS_SEEKABLE flag may be ORed in.  */
+
+int
+ctf_compression (int codec)
+{
+  int old = _libctf_compression;
+
+  if (codec < 0 || (codec & ~(CTF_COMPRESS_SEEKABLE | 0xff)) != 0)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  if (codec == 0)
+    return old;
+
+  if (ctf_codec (codec & ~CTF_COMPRESS_SEEKABLE) == NULL)
+    {
+      errno = ECTF_NOTSUP;
+      return -1;
+    }
+
+  _libctf_compression = codec;
+  return old;
+}
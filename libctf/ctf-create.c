@@ -14,31 +14,83 @@
 #include <string.h>
 #include <ctf-impl.h>
 
+/* Named members of dynamic structs, unions and enums are hashed by the type
+   they belong to and their name, so that duplicates can be found without
+   walking every member.  The keys are the ctf_dmdef_ts themselves.  */
+
+static unsigned int
+ctf_dmd_hash (const void *ptr)
+{
+  const ctf_dmdef_t *dmd = ptr;
+
+  return ((unsigned int) ctf_hash_compute (dmd->dmd_name,
+					   strlen (dmd->dmd_name))
+	  ^ ctf_hash_integer ((void *) (uintptr_t) dmd->dmd_owner));
+}
+
+static int
+ctf_dmd_eq (const void *a, const void *b)
+{
+  const ctf_dmdef_t *one = a;
+  const ctf_dmdef_t *two = b;
+
+  return (one->dmd_owner == two->dmd_owner
+	  && strcmp (one->dmd_name, two->dmd_name) == 0);
+}
+
+/* With CTF_CREATE_SHARE_REFS, pointers, cv-qualifiers, typedefs and arrays are
+   hashed by their info word, reference, array info and name, so that adding
+   one that is already there returns the existing type.  The keys are the
+   ctf_dtdef_ts themselves: only arrays have array info, and only arrays lack a
+   reference, so the fields that do not apply are always zero.  */
+
+static unsigned int
+ctf_dtd_ref_hash (const void *ptr)
+{
+  const ctf_dtdef_t *dtd = ptr;
+  uint64_t key[3];
+  unsigned int h;
+
+  key[0] = ((uint64_t) dtd->dtd_data.ctt_info << 32) | dtd->dtd_data.ctt_type;
+  key[1] = ((uint64_t) dtd->dtd_u.dtu_arr.ctr_contents << 32)
+    | (uint32_t) dtd->dtd_u.dtu_arr.ctr_index;
+  key[2] = dtd->dtd_u.dtu_arr.ctr_nelems;
+
+  h = (unsigned int) ctf_hash_compute ((const char *) key, sizeof (key));
+  if (dtd->dtd_name != NULL && dtd->dtd_name[0] != '\0')
+    h ^= ctf_hash_string (dtd->dtd_name);
+
+  return h;
+}
+
+static int
+ctf_dtd_ref_eq (const void *a, const void *b)
+{
+  const ctf_dtdef_t *one = a;
+  const ctf_dtdef_t *two = b;
+
+  return (one->dtd_data.ctt_info == two->dtd_data.ctt_info
+	  && one->dtd_data.ctt_type == two->dtd_data.ctt_type
+	  && one->dtd_u.dtu_arr.ctr_contents == two->dtd_u.dtu_arr.ctr_contents
+	  && one->dtd_u.dtu_arr.ctr_index == two->dtd_u.dtu_arr.ctr_index
+	  && one->dtd_u.dtu_arr.ctr_nelems == two->dtd_u.dtu_arr.ctr_nelems
+	  && strcmp (one->dtd_name != NULL ? one->dtd_name : "",
+		     two->dtd_name != NULL ? two->dtd_name : "") == 0);
+}
+
 /* To create an empty CTF container, we just declare a zeroed header and call
    ctf_bufopen() on it.  If ctf_bufopen succeeds, we mark the new container r/w
-   and initialize the dynamic members.  We set dtvstrlen to 1 to reserve the
-   first byte of the string table for a \0 byte, and we start assigning type
-   IDs at 1 because type ID 0 is used as a sentinel.  */
+   and initialize the dynamic members.  We start assigning type IDs at 1
+   because type ID 0 is used as a sentinel.  */
 
 ctf_file_t *
 ctf_create (int *errp)
 {
   static const ctf_header_t hdr = { .cth_preamble = {CTF_MAGIC, CTF_VERSION } };
 
-  const unsigned long hashlen = 1024;
-  ctf_dtdef_t **dthash = ctf_alloc (hashlen * sizeof (ctf_dtdef_t *));
-  ctf_dvdef_t **dvhash = ctf_alloc (hashlen * sizeof (ctf_dvdef_t *));
   ctf_sect_t cts;
   ctf_file_t *fp;
-
-  if (dthash == NULL)
-    return (ctf_set_open_errno (errp, EAGAIN));
-
-  if (dvhash == NULL)
-    {
-      ctf_free (dthash, hashlen * sizeof (ctf_dtdef_t *));
-      return (ctf_set_open_errno (errp, EAGAIN));
-    }
+  int i, err;
 
   cts.cts_name = _CTF_SECTION;
   cts.cts_type = SHT_PROGBITS;
@@ -49,20 +101,35 @@ ctf_create (int *errp)
   cts.cts_offset = 0;
 
   if ((fp = ctf_bufopen (&cts, NULL, NULL, errp)) == NULL)
+    return NULL;
+
+  /* Writable containers look up names on every addition, so their hashes are
+     never deferred.  */
+
+  if ((err = ctf_init_hashes (fp)) != 0)
     {
-      ctf_free (dthash, hashlen * sizeof (ctf_dtdef_t *));
-      ctf_free (dvhash, hashlen * sizeof (ctf_dvdef_t *));
-      return NULL;
+      ctf_close (fp);
+      return (ctf_set_open_errno (errp, err));
+    }
+
+  fp->ctf_dvhash = ctf_dynhash_create (ctf_hash_string, ctf_hash_eq_string);
+  fp->ctf_dmhash = ctf_dynhash_create (ctf_dmd_hash, ctf_dmd_eq);
+  err = (fp->ctf_dvhash == NULL || fp->ctf_dmhash == NULL);
+
+  for (i = 0; i < CTF_INDEX_MAX; i++)
+    {
+      fp->ctf_dtnames[i] = ctf_dynhash_create (ctf_hash_string,
+					       ctf_hash_eq_string);
+      err |= (fp->ctf_dtnames[i] == NULL);
+    }
+
+  if (err)
+    {
+      ctf_close (fp);
+      return (ctf_set_open_errno (errp, EAGAIN));
     }
 
   fp->ctf_flags |= LCTF_RDWR;
-  fp->ctf_dthashlen = hashlen;
-  fp->ctf_dvhashlen = hashlen;
-  memset (dthash, 0, hashlen * sizeof (ctf_dtdef_t *));
-  memset (dvhash, 0, hashlen * sizeof (ctf_dvdef_t *));
-  fp->ctf_dthash = dthash;
-  fp->ctf_dvhash = dvhash;
-  fp->ctf_dtvstrlen = 1;
   fp->ctf_dtnextid = 1;
   fp->ctf_dtoldid = 0;
   fp->ctf_snapshots = 0;
@@ -71,22 +138,83 @@ ctf_create (int *errp)
   return fp;
 }
 
+/* Return whether DTD is of a kind ctf_refhash holds.  */
+
+static int
+ctf_dtd_ref_kind (ctf_file_t *fp, const ctf_dtdef_t *dtd)
+{
+  switch (LCTF_INFO_KIND (fp, dtd->dtd_data.ctt_info))
+    {
+    case CTF_K_POINTER:
+    case CTF_K_TYPEDEF:
+    case CTF_K_VOLATILE:
+    case CTF_K_CONST:
+    case CTF_K_RESTRICT:
+    case CTF_K_ARRAY:
+      return 1;
+    default:
+      return 0;
+    }
+}
+
+/* Set the CTF_CREATE_* flags of a writable container, and return the previous
+   flags.  Turning on CTF_CREATE_SHARE_REFS hashes the types already there, so
+   that they can be shared as well.  */
+
+int
+ctf_create_flags (ctf_file_t *fp, int flags)
+{
+  int oflags = (fp->ctf_refhash != NULL ? CTF_CREATE_SHARE_REFS : 0);
+  ctf_dtdef_t *dtd;
+
+  if (!(fp->ctf_flags & LCTF_RDWR))
+    return (ctf_set_errno (fp, ECTF_RDONLY));
+
+  if (flags & ~CTF_CREATE_SHARE_REFS)
+    return (ctf_set_errno (fp, EINVAL));
+
+  if (!(flags & CTF_CREATE_SHARE_REFS))
+    {
+      ctf_dynhash_destroy (fp->ctf_refhash);
+      fp->ctf_refhash = NULL;
+      return oflags;
+    }
+
+  if (fp->ctf_refhash != NULL)
+    return oflags;
+
+  if ((fp->ctf_refhash = ctf_dynhash_create (ctf_dtd_ref_hash,
+					     ctf_dtd_ref_eq)) == NULL)
+    return (ctf_set_errno (fp, EAGAIN));
+
+  /* The oldest of identical types already added is the one shared.  */
+
+  for (dtd = ctf_list_next (&fp->ctf_dtdefs); dtd != NULL;
+       dtd = ctf_list_next (dtd))
+    {
+      if (ctf_dtd_ref_kind (fp, dtd)
+	  && ctf_dynhash_lookup (fp->ctf_refhash, dtd) == NULL
+	  && ctf_dynhash_insert (fp->ctf_refhash, dtd, dtd) != 0)
+	{
+	  ctf_dynhash_destroy (fp->ctf_refhash);
+	  fp->ctf_refhash = NULL;
+	  return (ctf_set_errno (fp, EAGAIN));
+	}
+    }
+
+  ctf_dprintf ("ctf_create_flags: flags %x\n", flags);
+  return oflags;
+}
+
 static unsigned char *
-ctf_copy_smembers (ctf_dtdef_t *dtd, uint32_t soff, unsigned char *t)
+ctf_copy_smembers (ctf_dtdef_t *dtd, ctf_strset_t *css, unsigned char *t)
 {
   ctf_dmdef_t *dmd = ctf_list_next (&dtd->dtd_u.dtu_members);
   ctf_member_t ctm;
 
   for (; dmd != NULL; dmd = ctf_list_next (dmd))
     {
-      if (dmd->dmd_name)
-	{
-	  ctm.ctm_name = soff;
-	  soff += strlen (dmd->dmd_name) + 1;
-	}
-      else
-	ctm.ctm_name = 0;
-
+      ctm.ctm_name = ctf_strset_offset (css, dmd->dmd_name);
       ctm.ctm_type = (uint32_t) dmd->dmd_type;
       ctm.ctm_offset = (uint32_t) dmd->dmd_offset;
 
@@ -98,21 +226,14 @@ ctf_copy_smembers (ctf_dtdef_t *dtd, uint32_t soff, unsigned char *t)
 }
 
 static unsigned char *
-ctf_copy_lmembers (ctf_dtdef_t *dtd, uint32_t soff, unsigned char *t)
+ctf_copy_lmembers (ctf_dtdef_t *dtd, ctf_strset_t *css, unsigned char *t)
 {
   ctf_dmdef_t *dmd = ctf_list_next (&dtd->dtd_u.dtu_members);
   ctf_lmember_t ctlm;
 
   for (; dmd != NULL; dmd = ctf_list_next (dmd))
     {
-      if (dmd->dmd_name)
-	{
-	  ctlm.ctlm_name = soff;
-	  soff += strlen (dmd->dmd_name) + 1;
-	}
-      else
-	ctlm.ctlm_name = 0;
-
+      ctlm.ctlm_name = ctf_strset_offset (css, dmd->dmd_name);
       ctlm.ctlm_type = (uint32_t) dmd->dmd_type;
       ctlm.ctlm_offsethi = CTF_OFFSET_TO_LMEMHI (dmd->dmd_offset);
       ctlm.ctlm_offsetlo = CTF_OFFSET_TO_LMEMLO (dmd->dmd_offset);
@@ -125,16 +246,15 @@ ctf_copy_lmembers (ctf_dtdef_t *dtd, uint32_t soff, unsigned char *t)
 }
 
 static unsigned char *
-ctf_copy_emembers (ctf_dtdef_t *dtd, uint32_t soff, unsigned char *t)
+ctf_copy_emembers (ctf_dtdef_t *dtd, ctf_strset_t *css, unsigned char *t)
 {
   ctf_dmdef_t *dmd = ctf_list_next (&dtd->dtd_u.dtu_members);
   ctf_enum_t cte;
 
   for (; dmd != NULL; dmd = ctf_list_next (dmd))
     {
-      cte.cte_name = soff;
+      cte.cte_name = ctf_strset_offset (css, dmd->dmd_name);
       cte.cte_value = dmd->dmd_value;
-      soff += strlen (dmd->dmd_name) + 1;
       memcpy (t, &cte, sizeof (cte));
       t += sizeof (cte);
     }
@@ -142,22 +262,208 @@ ctf_copy_emembers (ctf_dtdef_t *dtd, uint32_t soff, unsigned char *t)
   return t;
 }
 
+/* Intern the name of DTD and the names of its members in CSS.  */
+
+static int
+ctf_dtd_strings (ctf_file_t *fp, const ctf_dtdef_t *dtd, ctf_strset_t *css)
+{
+  const ctf_dmdef_t *dmd;
+  int err;
+
+  if ((err = ctf_strset_add (css, dtd->dtd_name)) != 0)
+    return err;
+
+  switch (LCTF_INFO_KIND (fp, dtd->dtd_data.ctt_info))
+    {
+    case CTF_K_STRUCT:
+    case CTF_K_UNION:
+    case CTF_K_ENUM:
+      for (dmd = ctf_list_next (&dtd->dtd_u.dtu_members);
+	   dmd != NULL; dmd = ctf_list_next (dmd))
+	{
+	  if ((err = ctf_strset_add (css, dmd->dmd_name)) != 0)
+	    return err;
+	}
+      break;
+    }
+
+  return 0;
+}
+
+/* Return the size of the type record that DTD will be written out as.  */
+
+static size_t
+ctf_dtd_size (ctf_file_t *fp, const ctf_dtdef_t *dtd)
+{
+  uint32_t kind = LCTF_INFO_KIND (fp, dtd->dtd_data.ctt_info);
+  uint32_t vlen = LCTF_INFO_VLEN (fp, dtd->dtd_data.ctt_info);
+  size_t type_size;
+
+  if (dtd->dtd_data.ctt_size != CTF_LSIZE_SENT)
+    type_size = sizeof (ctf_stype_t);
+  else
+    type_size = sizeof (ctf_type_t);
+
+  switch (kind)
+    {
+    case CTF_K_INTEGER:
+    case CTF_K_FLOAT:
+      type_size += sizeof (uint32_t);
+      break;
+    case CTF_K_ARRAY:
+      type_size += sizeof (ctf_array_t);
+      break;
+    case CTF_K_FUNCTION:
+      type_size += sizeof (uint32_t) * (vlen + (vlen & 1));
+      break;
+    case CTF_K_STRUCT:
+    case CTF_K_UNION:
+      if (dtd->dtd_data.ctt_size < CTF_LSTRUCT_THRESH)
+	type_size += sizeof (ctf_member_t) * vlen;
+      else
+	type_size += sizeof (ctf_lmember_t) * vlen;
+      break;
+    case CTF_K_ENUM:
+      type_size += sizeof (ctf_enum_t) * vlen;
+      break;
+    }
+
+  return type_size;
+}
+
+/* Copy the type record of DTD to T, with the offsets its name and member names
+   have been laid out at in CSS.  Returns the end of the type record.  */
+
 static unsigned char *
-ctf_copy_membnames (ctf_dtdef_t *dtd, unsigned char *s)
+ctf_copy_type (ctf_file_t *fp, ctf_dtdef_t *dtd, unsigned char *t,
+	       ctf_strset_t *css)
 {
-  ctf_dmdef_t *dmd = ctf_list_next (&dtd->dtd_u.dtu_members);
+  uint32_t kind = LCTF_INFO_KIND (fp, dtd->dtd_data.ctt_info);
+  uint32_t vlen = LCTF_INFO_VLEN (fp, dtd->dtd_data.ctt_info);
+
+  ctf_array_t cta;
+  uint32_t encoding;
   size_t len;
 
-  for (; dmd != NULL; dmd = ctf_list_next (dmd))
+  dtd->dtd_data.ctt_name = ctf_strset_offset (css, dtd->dtd_name);
+
+  if (dtd->dtd_data.ctt_size != CTF_LSIZE_SENT)
+    len = sizeof (ctf_stype_t);
+  else
+    len = sizeof (ctf_type_t);
+
+  memcpy (t, &dtd->dtd_data, len);
+  t += len;
+
+  switch (kind)
     {
-      if (dmd->dmd_name == NULL)
-	continue;			/* Skip anonymous members.  */
-      len = strlen (dmd->dmd_name) + 1;
-      memcpy (s, dmd->dmd_name, len);
-      s += len;
+    case CTF_K_INTEGER:
+    case CTF_K_FLOAT:
+      if (kind == CTF_K_INTEGER)
+	{
+	  encoding = CTF_INT_DATA (dtd->dtd_u.dtu_enc.cte_format,
+				   dtd->dtd_u.dtu_enc.cte_offset,
+				   dtd->dtd_u.dtu_enc.cte_bits);
+	}
+      else
+	{
+	  encoding = CTF_FP_DATA (dtd->dtd_u.dtu_enc.cte_format,
+				  dtd->dtd_u.dtu_enc.cte_offset,
+				  dtd->dtd_u.dtu_enc.cte_bits);
+	}
+      memcpy (t, &encoding, sizeof (encoding));
+      t += sizeof (encoding);
+      break;
+
+    case CTF_K_ARRAY:
+      cta.cta_contents = (uint32_t) dtd->dtd_u.dtu_arr.ctr_contents;
+      cta.cta_index = (uint32_t) dtd->dtd_u.dtu_arr.ctr_index;
+      cta.cta_nelems = dtd->dtd_u.dtu_arr.ctr_nelems;
+      memcpy (t, &cta, sizeof (cta));
+      t += sizeof (cta);
+      break;
+
+    case CTF_K_FUNCTION:
+      {
+	uint32_t *argv = (uint32_t *) (uintptr_t) t;
+	uint32_t argc;
+
+	for (argc = 0; argc < vlen; argc++)
+	  *argv++ = (uint32_t) dtd->dtd_u.dtu_argv[argc];
+
+	if (vlen & 1)
+	  *argv++ = 0;	/* Pad to 4-byte boundary.  */
+
+	t = (unsigned char *) argv;
+	break;
+      }
+
+    case CTF_K_STRUCT:
+    case CTF_K_UNION:
+      if (dtd->dtd_data.ctt_size < CTF_LSTRUCT_THRESH)
+	t = ctf_copy_smembers (dtd, css, t);
+      else
+	t = ctf_copy_lmembers (dtd, css, t);
+      break;
+
+    case CTF_K_ENUM:
+      t = ctf_copy_emembers (dtd, css, t);
+      break;
     }
 
-  return s;
+  return t;
+}
+
+/* Threads copying type records in parallel each take at least this many.  */
+
+#define COPY_TYPES_CHUNK 8192
+
+typedef struct ctf_copy_types
+{
+  ctf_file_t *cct_fp;		/* Container the types belong to.  */
+  ctf_dtdef_t **cct_dtds;	/* Types to copy.  */
+  const uint32_t *cct_offs;	/* Offset of each from cct_t0.  */
+  unsigned char *cct_t0;	/* Start of the type section.  */
+  ctf_strset_t *cct_css;	/* Strings, already laid out.  */
+} ctf_copy_types_t;
+
+static int
+ctf_copy_types_work (void *arg, unsigned long start, unsigned long end)
+{
+  ctf_copy_types_t *cct = arg;
+  unsigned long i;
+
+  for (i = start; i < end; i++)
+    (void) ctf_copy_type (cct->cct_fp, cct->cct_dtds[i],
+			  cct->cct_t0 + cct->cct_offs[i], cct->cct_css);
+
+  return 0;
+}
+
+/* Copy the N type records DTDS to the offsets OFFS from the start T0 of the
+   type section, in parallel.  The records do not overlap and CSS is only read,
+   so the output is just as if they had been copied one after another.  */
+
+static void
+ctf_copy_types (ctf_file_t *fp, ctf_dtdef_t **dtds, const uint32_t *offs,
+		unsigned long n, unsigned char *t0, ctf_strset_t *css)
+{
+  ctf_copy_types_t cct = { fp, dtds, offs, t0, css };
+
+  (void) ctf_parallel (n, COPY_TYPES_CHUNK, ctf_copy_types_work, &cct);
+}
+
+/* Whether DTD is a pointer to a type in this container that has not been added
+   yet, which cannot go into the pointer table until it has been.  */
+
+static int
+ctf_dtd_ptrfwd (ctf_file_t *fp, const ctf_dtdef_t *dtd)
+{
+  uint32_t ref = dtd->dtd_data.ctt_type;
+
+  return (LCTF_INFO_KIND (fp, dtd->dtd_data.ctt_info) == CTF_K_POINTER
+	  && LCTF_TYPE_ISCHILD (fp, ref) == ((fp->ctf_flags & LCTF_CHILD) != 0)
+	  && LCTF_TYPE_TO_INDEX (fp, ref) >= fp->ctf_dtnextid);
 }
 
 /* Sort a newly-constructed static variable array.  */
@@ -174,335 +480,966 @@ ctf_sort_var (const void *one_, const void *two_, void *strtab_)
   return (strcmp (n1, n2));
 }
 
-/* If the specified CTF container is writable and has been modified, reload this
-   container with the updated type definitions.  In order to make this code and
-   the rest of libctf as simple as possible, we perform updates by taking the
-   dynamic type definitions and creating an in-memory CTF file containing the
-   definitions, and then call ctf_bufopen() on it.  This not only leverages
-   ctf_bufopen(), but also avoids having to bifurcate the rest of the library
-   code with different lookup paths for static and dynamic type definitions.  We
-/   are therefore optimizing greatly for lookup over update, which we assume will
-   be an uncommon operation.  We perform one extra trick here for the benefit of
-   callers and to keep our code simple: ctf_bufopen() will return a new
-   ctf_file_t, but we want to keep the fp constant for the caller, so after
-   ctf_bufopen() returns, we use memcpy to swap the interior of the old and new
-   ctf_file_t's, and then free the old.  */
+/* Append an index built from the type tables and hashes of NFP, just opened
+   from *BUFP, to its string table, so that opening the container again need
+   not walk the type section or hash every type name.  The index is hashed with
+   a fixed seed, so the output does not vary from run to run.  On success, NFP
+   is moved over to the new buffer, which replaces *BUFP and *SIZEP, and the
+   old buffer is freed.  */
+
+static int
+ctf_add_index (ctf_file_t *nfp, ctf_header_t *hdr, void **bufp, size_t *sizep)
+{
+  ctf_hash_t *hashes[CTF_INDEX_MAX] = { &nfp->ctf_structs, &nfp->ctf_unions,
+					&nfp->ctf_enums, &nfp->ctf_names };
+  ctf_hash_t idx[CTF_INDEX_MAX];
+  ctf_index_t cti;
+  unsigned char *buf, *s0;
+  size_t off, size;
+  int i, err = 0;
+
+  memset (idx, 0, sizeof (idx));
+  memset (&cti, 0, sizeof (cti));
+  cti.cti_magic = CTF_INDEX_MAGIC;
+  cti.cti_version = CTF_INDEX_VERSION;
+  cti.cti_strlen = hdr->cth_strlen;
+  cti.cti_ntypes = (uint32_t) nfp->ctf_typemax;
+
+  off = (hdr->cth_strlen + 3) & ~3;
+  cti.cti_typeoff = (uint32_t) off;
+  off += sizeof (uint32_t) * (nfp->ctf_typemax + 1);
+  cti.cti_ptroff = (uint32_t) off;
+  off += sizeof (uint32_t) * (nfp->ctf_typemax + 1);
+
+  for (i = 0; i < CTF_INDEX_MAX; i++)
+    {
+      ctf_idxhash_t *cih = &cti.cti_hash[i];
+
+      if ((err = ctf_hash_rehash (&idx[i], hashes[i], nfp, 0)) != 0)
+	goto out;
+
+      cih->cih_nbuckets = idx[i].h_nbuckets;
+      cih->cih_nelems = idx[i].h_free;
+      cih->cih_bucketoff = (uint32_t) off;
+      off += sizeof (uint32_t) * cih->cih_nbuckets;
+      cih->cih_elemoff = (uint32_t) off;
+      off += sizeof (ctf_idxelem_t) * cih->cih_nelems;
+    }
+  off += sizeof (ctf_index_t);
+
+  /* An index too large to describe is simply left out.  */
+
+  if (off > UINT32_MAX - hdr->cth_stroff)
+    goto out;
+
+  size = sizeof (ctf_header_t) + hdr->cth_stroff + off;
+  if ((buf = ctf_data_alloc (size)) == MAP_FAILED)
+    {
+      err = EAGAIN;
+      goto out;
+    }
+
+  memcpy (buf, *bufp, *sizep);
+  s0 = buf + sizeof (ctf_header_t) + hdr->cth_stroff;
+
+  memcpy (s0 + cti.cti_typeoff, nfp->ctf_txlate,
+	  sizeof (uint32_t) * (nfp->ctf_typemax + 1));
+  memcpy (s0 + cti.cti_ptroff, nfp->ctf_ptrtab,
+	  sizeof (uint32_t) * (nfp->ctf_typemax + 1));
+
+  for (i = 0; i < CTF_INDEX_MAX; i++)
+    {
+      const ctf_idxhash_t *cih = &cti.cti_hash[i];
+
+      memcpy (s0 + cih->cih_bucketoff, idx[i].h_buckets,
+	      sizeof (uint32_t) * cih->cih_nbuckets);
+      if (idx[i].h_elems != NULL)
+	memcpy (s0 + cih->cih_elemoff, idx[i].h_elems,
+		sizeof (ctf_idxelem_t) * cih->cih_nelems);
+    }
+  memcpy (s0 + off - sizeof (ctf_index_t), &cti, sizeof (ctf_index_t));
+
+  hdr->cth_flags |= CTF_F_INDEX;
+  hdr->cth_strlen = (uint32_t) off;
+  memcpy (buf, hdr, sizeof (ctf_header_t));
+  ctf_data_protect (buf, size);
+
+  ctf_set_base (nfp, hdr, buf);
+  nfp->ctf_str[CTF_STRTAB_0].cts_len = cti.cti_strlen;
+  nfp->ctf_index = (const ctf_index_t *) (s0 + off - sizeof (ctf_index_t));
+  nfp->ctf_size = size;
+
+  ctf_data_free (*bufp, *sizep);
+  *bufp = buf;
+  *sizep = size;
+
+ out:
+  for (i = 0; i < CTF_INDEX_MAX; i++)
+    ctf_hash_destroy (&idx[i]);
+  return err;
+}
+
+/* Add an index to the buffer of writable container FP, if the last ctf_update()
+   only appended types to it and so left it without one, so that containers
+   written out can be opened as quickly however they were built.  */
+
 int
-ctf_update (ctf_file_t *fp)
+ctf_refresh_index (ctf_file_t *fp)
 {
-  ctf_file_t ofp, *nfp;
+  void *buf = (void *) fp->ctf_base;
+  size_t size = fp->ctf_size;
+  ctf_header_t hdr;
+
+  if (!(fp->ctf_flags & LCTF_RDWR) || fp->ctf_base == fp->ctf_data.cts_data)
+    return 0;
+
+  memcpy (&hdr, fp->ctf_base, sizeof (ctf_header_t));
+  if (hdr.cth_flags & CTF_F_INDEX)
+    return 0;
+
+  return ctf_add_index (fp, &hdr, &buf, &size);
+}
+
+/* Commit the types and variables added to FP since the last ctf_update() by
+   appending them to those already committed, rather than by writing every one
+   out again and reopening the result.  The committed type records and strings
+   are copied over unchanged, so the type ID translation table, pointer table
+   and name hashes of FP need only be extended to cover the new types, and
+   ctf_serial stays as it was.
+
+   New strings that are already in the string table are not added again; the
+   rest are appended to it.
+
+   This is not possible once a committed type has been changed, and returns
+   nonzero without changing FP if so, or if anything else stands in the way.
+   FP is left usable, but due for a rewrite, if extending the hashes fails.  */
+
+static int
+ctf_update_append (ctf_file_t *fp)
+{
+  const ctf_header_t *ohp = (const ctf_header_t *) fp->ctf_base;
+  const unsigned char *obase = fp->ctf_base;
+  const char *ostrs = fp->ctf_str[CTF_STRTAB_0].cts_strs;
+  size_t ostrlen = fp->ctf_str[CTF_STRTAB_0].cts_len;
+  size_t osize = fp->ctf_size;
+  unsigned long oldmax = fp->ctf_typemax;
+  unsigned long newmax = fp->ctf_dtnextid - 1;
+  ctf_strset_t *css = &fp->ctf_strset;
+
   ctf_header_t hdr;
   ctf_dtdef_t *dtd;
   ctf_dvdef_t *dvd;
   ctf_varent_t *dvarents;
-  ctf_sect_t cts;
+  uint32_t *txlate, *ptrtab;
 
-  unsigned char *s, *s0, *t;
-  unsigned long i;
+  unsigned char *s0, *t, *t0;
+  unsigned long i, id;
   size_t buf_size, type_size, nvars;
+  uint32_t delta;
+  int ptrfwd = 0;
   void *buf;
   int err;
 
-  if (!(fp->ctf_flags & LCTF_RDWR))
-    return (ctf_set_errno (fp, ECTF_RDONLY));
+  if ((fp->ctf_flags & (LCTF_REBUILD | LCTF_TXMAPPED))
+      || fp->ctf_dynparname != NULL || fp->ctf_version != CTF_VERSION
+      || oldmax != fp->ctf_dtoldid || newmax < oldmax
+      || (newmax > oldmax && newmax >= fp->ctf_dtdtablen))
+    return ECTF_NOTSUP;
 
-  /* Update required?  */
-  if (!(fp->ctf_flags & LCTF_DIRTY))
-    return 0;
+  /* The committed strings must all be known, unless there are none yet.  */
 
-  /* Fill in an initial CTF header.  We will leave the label, object,
-     and function sections empty and only output a header, type section,
-     and string table.  The type section begins at a 4-byte aligned
-     boundary past the CTF header itself (at relative offset zero).  */
+  if (css->css_atoms == NULL)
+    {
+      if (ostrlen != 0 || fp->ctf_parname != NULL)
+	return ECTF_NOTSUP;
+      if ((err = ctf_strset_init (css, 1)) != 0)
+	return err;
+    }
+  else if (css->css_len != MAX (ostrlen, 1))
+    return ECTF_NOTSUP;
 
   memset (&hdr, 0, sizeof (hdr));
   hdr.cth_magic = CTF_MAGIC;
   hdr.cth_version = CTF_VERSION;
 
   if (fp->ctf_flags & LCTF_CHILD)
-    hdr.cth_parname = 1;		/* parname added just below.  */
-
-  /* Iterate through the dynamic type definition list and compute the
-     size of the CTF type section we will need to generate.  */
+    hdr.cth_parname = 1;		/* parname is already in the strtab.  */
 
-  for (type_size = 0, dtd = ctf_list_next (&fp->ctf_dtdefs);
-       dtd != NULL; dtd = ctf_list_next (dtd))
+  type_size = ohp->cth_stroff - ohp->cth_typeoff;
+  for (id = oldmax + 1; id <= newmax; id++)
     {
-      uint32_t kind = LCTF_INFO_KIND (fp, dtd->dtd_data.ctt_info);
-      uint32_t vlen = LCTF_INFO_VLEN (fp, dtd->dtd_data.ctt_info);
+      if ((dtd = fp->ctf_dtdtab[id]) == NULL)
+	return ECTF_CORRUPT;
+
+      type_size += ctf_dtd_size (fp, dtd);
+      ptrfwd |= ctf_dtd_ptrfwd (fp, dtd);
+    }
+
+  for (nvars = 0, dvd = ctf_list_next (&fp->ctf_dvdefs);
+       dvd != NULL; dvd = ctf_list_next (dvd), nvars++);
+
+  hdr.cth_typeoff = hdr.cth_varoff + (nvars * sizeof (ctf_varent_t));
+  hdr.cth_stroff = hdr.cth_typeoff + type_size;
+
+  /* Grow the type tables before anything else, so that nothing need be undone
+     if we cannot.  They are just a little oversized if we go on to fail.  */
+
+  if ((txlate = ctf_realloc (fp->ctf_txlate,
+			     sizeof (uint32_t) * (newmax + 1))) == NULL)
+    return EAGAIN;
+  fp->ctf_txlate = txlate;
+
+  if ((ptrtab = ctf_realloc (fp->ctf_ptrtab,
+			     sizeof (uint32_t) * (newmax + 1))) == NULL)
+    return EAGAIN;
+  fp->ctf_ptrtab = ptrtab;
+
+  for (id = oldmax + 1; id <= newmax; id++)
+    {
+      if ((err = ctf_dtd_strings (fp, fp->ctf_dtdtab[id], css)) != 0)
+	goto err;
+    }
+
+  for (dvd = ctf_list_next (&fp->ctf_dvdefs);
+       dvd != NULL; dvd = ctf_list_next (dvd))
+    {
+      if ((err = ctf_strset_add (css, dvd->dvd_name)) != 0)
+	goto err;
+    }
+
+  if ((err = ctf_strset_layout (css, &hdr.cth_strlen)) != 0)
+    goto err;
+
+  buf_size = sizeof (ctf_header_t) + hdr.cth_stroff + hdr.cth_strlen;
+
+  if ((buf = ctf_data_alloc (buf_size)) == MAP_FAILED)
+    {
+      err = EAGAIN;
+      goto err;
+    }
+
+  memcpy (buf, &hdr, sizeof (ctf_header_t));
+  t0 = (unsigned char *) buf + sizeof (ctf_header_t);
+  t = t0 + hdr.cth_varoff;
+  s0 = t0 + hdr.cth_stroff;
+
+  memcpy (s0, ostrs, ostrlen);
+  s0[0] = '\0';
+  ctf_strset_write (css, s0);
+
+  dvarents = (ctf_varent_t *) t;
+  for (i = 0, dvd = ctf_list_next (&fp->ctf_dvdefs); dvd != NULL;
+       dvd = ctf_list_next (dvd), i++)
+    {
+      ctf_varent_t *var = &dvarents[i];
+
+      var->ctv_name = ctf_strset_offset (css, dvd->dvd_name);
+      var->ctv_typeidx = dvd->dvd_type;
+    }
+  assert (i == nvars);
+
+  qsort_r (dvarents, nvars, sizeof (ctf_varent_t), ctf_sort_var, s0);
+  t += sizeof (ctf_varent_t) * nvars;
+
+  assert (t == t0 + hdr.cth_typeoff);
+
+  memcpy (t, fp->ctf_buf + ohp->cth_typeoff,
+	  ohp->cth_stroff - ohp->cth_typeoff);
+  t += ohp->cth_stroff - ohp->cth_typeoff;
+
+  /* The type ID translation table of the new types is the prefix sum of their
+     sizes, so it tells the threads copying them where each one goes.  */
+
+  for (id = oldmax + 1; id <= newmax; id++)
+    {
+      fp->ctf_txlate[id] = (uint32_t) (t - t0);
+      fp->ctf_ptrtab[id] = 0;
+      t += ctf_dtd_size (fp, fp->ctf_dtdtab[id]);
+    }
+
+  assert (t == t0 + hdr.cth_stroff);
+
+  ctf_copy_types (fp, &fp->ctf_dtdtab[oldmax + 1], &fp->ctf_txlate[oldmax + 1],
+		  newmax - oldmax, t0, css);
+
+  /* The committed types have moved along with the start of the type section,
+     if any variables were added.  */
+
+  if ((delta = hdr.cth_typeoff - ohp->cth_typeoff) != 0)
+    for (id = 1; id <= oldmax; id++)
+      fp->ctf_txlate[id] += delta;
+
+  ctf_data_protect (buf, buf_size);
+  ctf_set_base (fp, &hdr, buf);
+  ctf_strset_commit (css);
+  fp->ctf_size = buf_size;
+  fp->ctf_typemax = newmax;
+  fp->ctf_index = NULL;
+
+  if (obase != fp->ctf_data.cts_data)
+    ctf_data_free ((void *) obase, osize);
+  fp->ctf_data.cts_data = NULL;	/* Force ctf_data_free() on close.  */
+
+  if ((err = ctf_init_appended (fp, oldmax)) != 0)
+    {
+      fp->ctf_flags |= LCTF_REBUILD;
+      return err;
+    }
+
+  if (ptrfwd)
+    fp->ctf_flags |= LCTF_REBUILD;
+
+  fp->ctf_flags &= ~LCTF_DIRTY;
+  fp->ctf_dtoldid = newmax;
+  fp->ctf_snapshot_lu = fp->ctf_snapshots++;
+  fp->ctf_marks_base = fp->ctf_snapshots;
+  fp->ctf_nmarks = 0;
+
+  ctf_dprintf ("ctf_update: appended %lu types\n", newmax - oldmax);
+  return 0;
+
+err:
+  ctf_strset_abort (css);
+  return err;
+}
+
+/* Reload the specified CTF container with all of its type definitions.  In
+   order to make this code and the rest of libctf as simple as possible, we
+   perform updates by taking the dynamic type definitions and creating an
+   in-memory CTF file containing the definitions, and then call ctf_bufopen()
+   on it.  This not only leverages ctf_bufopen(), but also avoids having to
+   bifurcate the rest of the library code with different lookup paths for
+   static and dynamic type definitions.  We are therefore optimizing greatly
+   for lookup over update, which we assume will be an uncommon operation.  We
+   perform one extra trick here for the benefit of callers and to keep our code
+   simple: ctf_bufopen() will return a new ctf_file_t, but we want to keep the
+   fp constant for the caller, so after ctf_bufopen() returns, we use memcpy to
+   swap the interior of the old and new ctf_file_t's, and then free the old.  */
+static int
+ctf_update_rewrite (ctf_file_t *fp)
+{
+  ctf_file_t ofp, *nfp;
+  ctf_header_t hdr;
+  ctf_dtdef_t *dtd;
+  ctf_dvdef_t *dvd;
+  ctf_dtdef_t **dtds = NULL;
+  ctf_varent_t *dvarents;
+  ctf_strset_t css;
+  ctf_sect_t cts;
+
+  unsigned char *s0, *t;
+  uint32_t parlen = 0;
+  uint32_t *offs = NULL;
+  unsigned long i, ntypes;
+  size_t buf_size, type_size, nvars;
+  void *buf;
+  int ptrfwd = 0;
+  int err;
+
+  /* Fill in an initial CTF header.  We will leave the label, object,
+     and function sections empty and only output a header, type section,
+     and string table.  The type section begins at a 4-byte aligned
+     boundary past the CTF header itself (at relative offset zero).  */
+
+  memset (&hdr, 0, sizeof (hdr));
+  hdr.cth_magic = CTF_MAGIC;
+  hdr.cth_version = CTF_VERSION;
+
+  if (fp->ctf_flags & LCTF_CHILD)
+    hdr.cth_parname = 1;		/* parname added just below.  */
+
+  /* Iterate through the dynamic type definition list and compute the
+     size of the CTF type section we will need to generate.  */
+
+  for (type_size = 0, ntypes = 0, dtd = ctf_list_next (&fp->ctf_dtdefs);
+       dtd != NULL; dtd = ctf_list_next (dtd), ntypes++)
+    {
+      type_size += ctf_dtd_size (fp, dtd);
+      ptrfwd |= ctf_dtd_ptrfwd (fp, dtd);
+    }
+
+  /* Computing the number of entries in the CTF variable section is much
+     simpler.  */
+
+  for (nvars = 0, dvd = ctf_list_next (&fp->ctf_dvdefs);
+       dvd != NULL; dvd = ctf_list_next (dvd), nvars++);
+
+  /* Lay out the string table: the parent name (if any) comes first, then
+     each distinct type, member and variable name.  */
+
+  if (fp->ctf_parname != NULL)
+    parlen = strlen (fp->ctf_parname) + 1;
+
+  if ((err = ctf_strset_init (&css, 1 + parlen)) != 0)
+    return (ctf_set_errno (fp, err));
+
+  for (dtd = ctf_list_next (&fp->ctf_dtdefs);
+       dtd != NULL && err == 0; dtd = ctf_list_next (dtd))
+    err = ctf_dtd_strings (fp, dtd, &css);
+
+  for (dvd = ctf_list_next (&fp->ctf_dvdefs);
+       dvd != NULL && err == 0; dvd = ctf_list_next (dvd))
+    err = ctf_strset_add (&css, dvd->dvd_name);
+
+  if (err != 0 || (err = ctf_strset_layout (&css, &hdr.cth_strlen)) != 0)
+    {
+      ctf_strset_destroy (&css);
+      return (ctf_set_errno (fp, err));
+    }
+
+  /* Fill in the type offset and size, compute the size of the entire CTF
+     buffer we need, and then allocate a new buffer and memcpy the finished
+     header to the start of the buffer.  */
+
+  hdr.cth_typeoff = hdr.cth_varoff + (nvars * sizeof (ctf_varent_t));
+  hdr.cth_stroff = hdr.cth_typeoff + type_size;
+
+  buf_size = sizeof (ctf_header_t) + hdr.cth_stroff + hdr.cth_strlen;
+
+  if ((buf = ctf_data_alloc (buf_size)) == MAP_FAILED)
+    {
+      ctf_strset_destroy (&css);
+      return (ctf_set_errno (fp, EAGAIN));
+    }
+
+  memcpy (buf, &hdr, sizeof (ctf_header_t));
+  t = (unsigned char *) buf + sizeof (ctf_header_t) + hdr.cth_varoff;
+  s0 = (unsigned char *) buf + sizeof (ctf_header_t) + hdr.cth_stroff;
+
+  s0[0] = '\0';
+  if (fp->ctf_parname != NULL)
+    memcpy (s0 + 1, fp->ctf_parname, parlen);
+  ctf_strset_write (&css, s0);
+
+  /* Work over the variable list, translating everything into
+     ctf_varent_t's, then sort the buffer of ctf_varent_t's.  */
+
+  dvarents = (ctf_varent_t *) t;
+  for (i = 0, dvd = ctf_list_next (&fp->ctf_dvdefs); dvd != NULL;
+       dvd = ctf_list_next (dvd), i++)
+    {
+      ctf_varent_t *var = &dvarents[i];
+
+      var->ctv_name = ctf_strset_offset (&css, dvd->dvd_name);
+      var->ctv_typeidx = dvd->dvd_type;
+    }
+  assert (i == nvars);
+
+  qsort_r (dvarents, nvars, sizeof (ctf_varent_t), ctf_sort_var, s0);
+  t += sizeof (ctf_varent_t) * nvars;
+
+  assert (t == (unsigned char *) buf + sizeof (ctf_header_t) + hdr.cth_typeoff);
+
+  /* We now take a final lap through the dynamic type definition list and
+     copy the appropriate type records to the output buffer: in parallel, at
+     offsets summed up from their sizes, if there are enough of them and room
+     for the offsets, and otherwise one after another.  */
+
+  if (_libctf_nthreads > 1 && ntypes >= 2 * COPY_TYPES_CHUNK
+      && (dtds = ctf_alloc (ntypes * sizeof (ctf_dtdef_t *))) != NULL
+      && (offs = ctf_alloc (ntypes * sizeof (uint32_t))) != NULL)
+    {
+      unsigned char *t0 = t;
+
+      for (i = 0, dtd = ctf_list_next (&fp->ctf_dtdefs);
+	   dtd != NULL; dtd = ctf_list_next (dtd), i++)
+	{
+	  dtds[i] = dtd;
+	  offs[i] = (uint32_t) (t - t0);
+	  t += ctf_dtd_size (fp, dtd);
+	}
+
+      ctf_copy_types (fp, dtds, offs, ntypes, t0, &css);
+    }
+  else
+    {
+      for (dtd = ctf_list_next (&fp->ctf_dtdefs);
+	   dtd != NULL; dtd = ctf_list_next (dtd))
+	t = ctf_copy_type (fp, dtd, t, &css);
+    }
+
+  ctf_free (dtds, ntypes * sizeof (ctf_dtdef_t *));
+  ctf_free (offs, ntypes * sizeof (uint32_t));
+
+  assert (t == (unsigned char *) buf + sizeof (ctf_header_t) + hdr.cth_stroff);
+
+  /* Finally, we are ready to ctf_bufopen() the new container.  If this
+     is successful, we then switch nfp and fp and free the old container.  */
+
+  ctf_data_protect (buf, buf_size);
+  cts.cts_name = _CTF_SECTION;
+  cts.cts_type = SHT_PROGBITS;
+  cts.cts_flags = 0;
+  cts.cts_data = buf;
+  cts.cts_size = buf_size;
+  cts.cts_entsize = 1;
+  cts.cts_offset = 0;
+
+  if ((nfp = ctf_bufopen (&cts, NULL, NULL, &err)) == NULL)
+    {
+      ctf_strset_destroy (&css);
+      ctf_data_free (buf, buf_size);
+      return (ctf_set_errno (fp, err));
+    }
+
+  if ((err = ctf_init_hashes (nfp)) != 0
+      || (err = ctf_add_index (nfp, &hdr, &buf, &buf_size)) != 0)
+    {
+      ctf_strset_destroy (&css);
+      ctf_close (nfp);
+      ctf_data_free (buf, buf_size);
+      return (ctf_set_errno (fp, err));
+    }
+
+  ctf_strset_commit (&css);
+
+  (void) ctf_setmodel (nfp, ctf_getmodel (fp));
+  (void) ctf_import (nfp, fp->ctf_parent);
+
+  nfp->ctf_refcnt = fp->ctf_refcnt;
+  nfp->ctf_flags |= fp->ctf_flags & ~(LCTF_DIRTY | LCTF_TXMAPPED
+				       | LCTF_REBUILD);
+  if (ptrfwd)
+    nfp->ctf_flags |= LCTF_REBUILD;
+  nfp->ctf_data.cts_data = NULL;	/* Force ctf_data_free() on close.  */
+  nfp->ctf_dtdtab = fp->ctf_dtdtab;
+  nfp->ctf_dtdtablen = fp->ctf_dtdtablen;
+  nfp->ctf_dtdefs = fp->ctf_dtdefs;
+  nfp->ctf_dmhash = fp->ctf_dmhash;
+  memcpy (nfp->ctf_dtnames, fp->ctf_dtnames, sizeof (fp->ctf_dtnames));
+  nfp->ctf_refhash = fp->ctf_refhash;
+  nfp->ctf_srcmaps = fp->ctf_srcmaps;
+  nfp->ctf_srcmapl = fp->ctf_srcmapl;
+  nfp->ctf_dvhash = fp->ctf_dvhash;
+  nfp->ctf_dvdefs = fp->ctf_dvdefs;
+  nfp->ctf_strset = css;
+  nfp->ctf_dtnextid = fp->ctf_dtnextid;
+  nfp->ctf_dtoldid = fp->ctf_dtnextid - 1;
+  nfp->ctf_snapshots = fp->ctf_snapshots + 1;
+  nfp->ctf_specific = fp->ctf_specific;
+
+  nfp->ctf_snapshot_lu = fp->ctf_snapshots;
+  nfp->ctf_arena = fp->ctf_arena;
+  nfp->ctf_marks = fp->ctf_marks;
+  nfp->ctf_marks_base = nfp->ctf_snapshots;
+  nfp->ctf_nmarks = 0;
+  nfp->ctf_markslen = fp->ctf_markslen;
+  nfp->ctf_arena_pin = fp->ctf_arena_pin;
+
+  fp->ctf_arena.ca_block = NULL;
+  fp->ctf_marks = NULL;
+  fp->ctf_markslen = 0;
+
+  fp->ctf_dtdtab = NULL;
+  fp->ctf_dtdtablen = 0;
+  memset (&fp->ctf_dtdefs, 0, sizeof (ctf_list_t));
+  fp->ctf_dmhash = NULL;
+  memset (fp->ctf_dtnames, 0, sizeof (fp->ctf_dtnames));
+  fp->ctf_refhash = NULL;
+  fp->ctf_srcmaps = NULL;
+  memset (&fp->ctf_srcmapl, 0, sizeof (ctf_list_t));
+
+  fp->ctf_dvhash = NULL;
+  memset (&fp->ctf_dvdefs, 0, sizeof (ctf_list_t));
+
+  memcpy (&ofp, fp, sizeof (ctf_file_t));
+  memcpy (fp, nfp, sizeof (ctf_file_t));
+  memcpy (nfp, &ofp, sizeof (ctf_file_t));
+
+  /* Initialize the ctf_lookup_by_name top-level dictionary.  We keep an
+     array of type name prefixes and the corresponding ctf_hash to use.
+     NOTE: This code must be kept in sync with the code in ctf_bufopen().  */
+
+  fp->ctf_lookups[0].ctl_hash = &fp->ctf_structs;
+  fp->ctf_lookups[1].ctl_hash = &fp->ctf_unions;
+  fp->ctf_lookups[2].ctl_hash = &fp->ctf_enums;
+  fp->ctf_lookups[3].ctl_hash = &fp->ctf_names;
+
+  nfp->ctf_refcnt = 1;		/* Force nfp to be freed.  */
+  ctf_close (nfp);
+
+  return 0;
+}
+
+/* If the specified CTF container is writable and has been modified, commit the
+   new type definitions, appending them to those already committed if we can,
+   and otherwise rewriting them all.  */
+
+int
+ctf_update (ctf_file_t *fp)
+{
+  int err;
+
+  if (!(fp->ctf_flags & LCTF_RDWR))
+    return (ctf_set_errno (fp, ECTF_RDONLY));
+
+  /* Update required?  */
+  if (!(fp->ctf_flags & LCTF_DIRTY))
+    return 0;
+
+  if (!(fp->ctf_flags & LCTF_REBUILD))
+    {
+      if ((err = ctf_update_append (fp)) == 0)
+	return 0;
+      ctf_dprintf ("ctf_update: cannot append types: %s\n", ctf_errmsg (err));
+    }
+
+  return ctf_update_rewrite (fp);
+}
+
+/* ctf_serialize() stages what it writes out in a buffer of this size, passing
+   it to the sink whenever it fills up.  */
+
+#define CTF_STREAM_BUF (64 * 1024)
+
+typedef struct ctf_stream
+{
+  unsigned char *cs_buf;	/* Staging buffer.  */
+  size_t cs_len;		/* Bytes of it in use.  */
+  size_t cs_size;		/* Its size.  */
+  ctf_sink_f *cs_sink;		/* Where the buffer goes when full.  */
+  void *cs_arg;			/* Argument to cs_sink.  */
+} ctf_stream_t;
+
+static int
+ctf_stream_flush (ctf_stream_t *cs)
+{
+  int err = 0;
+
+  if (cs->cs_len > 0)
+    err = cs->cs_sink (cs->cs_buf, cs->cs_len, cs->cs_arg);
+  cs->cs_len = 0;
+
+  return err;
+}
+
+/* Make room for LEN more bytes in the staging buffer of CS, growing it if it
+   is too small for them even once flushed, and return where they go.  */
+
+static unsigned char *
+ctf_stream_reserve (ctf_stream_t *cs, size_t len, int *errp)
+{
+  unsigned char *buf;
+
+  if (cs->cs_len + len > cs->cs_size
+      && (*errp = ctf_stream_flush (cs)) != 0)
+    return NULL;
+
+  if (len > cs->cs_size)
+    {
+      if ((buf = ctf_realloc (cs->cs_buf, len)) == NULL)
+	{
+	  *errp = EAGAIN;
+	  return NULL;
+	}
+      cs->cs_buf = buf;
+      cs->cs_size = len;
+    }
+
+  return cs->cs_buf + cs->cs_len;
+}
+
+/* Append LEN bytes at DATA to the stream ARG.  A ctf_sink_f, so that it can
+   be passed on to ctf_strset_stream().  */
+
+static int
+ctf_stream_write (const void *data, size_t len, void *arg)
+{
+  ctf_stream_t *cs = arg;
+  unsigned char *t;
+  int err = 0;
+
+  if ((t = ctf_stream_reserve (cs, len, &err)) == NULL)
+    return err;
+
+  memcpy (t, data, len);
+  cs->cs_len += len;
+  return 0;
+}
+
+/* Sort the variables to be written out by name, as ctf_sort_var() does.  */
+
+static int
+ctf_sort_dvd (const void *one_, const void *two_)
+{
+  const ctf_dvdef_t *one = *(const ctf_dvdef_t **) one_;
+  const ctf_dvdef_t *two = *(const ctf_dvdef_t **) two_;
+
+  return (strcmp (one->dvd_name, two->dvd_name));
+}
+
+/* Write out every type and variable definition of writable container FP, with
+   the header flags FLAGS, passing the header and then the successive pieces of
+   the data that follows it to SINK, and return zero or an error.
+
+   The container is laid out as ctf_update_rewrite() would lay it out, straight
+   from the dynamic definitions, so nothing the size of the whole container is
+   ever allocated and FP is left just as it was.  No index is written: it is
+   only an optimization, which ctf_bufopen() does without.  */
+
+int
+ctf_serialize (ctf_file_t *fp, int flags, ctf_sink_f *sink, void *arg)
+{
+  ctf_header_t hdr;
+  ctf_dtdef_t *dtd;
+  ctf_dvdef_t *dvd, **dvds = NULL;
+  ctf_strset_t css;
+  ctf_stream_t cs;
+
+  unsigned char *t, *end;
+  uint32_t parlen = 0;
+  uint32_t name;
+  size_t type_size, nvars, size, i;
+  int err;
+
+  if (!(fp->ctf_flags & LCTF_RDWR))
+    return ECTF_RDONLY;
 
-      if (dtd->dtd_data.ctt_size != CTF_LSIZE_SENT)
-	type_size += sizeof (ctf_stype_t);
-      else
-	type_size += sizeof (ctf_type_t);
+  memset (&hdr, 0, sizeof (hdr));
+  hdr.cth_magic = CTF_MAGIC;
+  hdr.cth_version = CTF_VERSION;
+  hdr.cth_flags = flags;
 
-      switch (kind)
-	{
-	case CTF_K_INTEGER:
-	case CTF_K_FLOAT:
-	  type_size += sizeof (uint32_t);
-	  break;
-	case CTF_K_ARRAY:
-	  type_size += sizeof (ctf_array_t);
-	  break;
-	case CTF_K_FUNCTION:
-	  type_size += sizeof (uint32_t) * (vlen + (vlen & 1));
-	  break;
-	case CTF_K_STRUCT:
-	case CTF_K_UNION:
-	  if (dtd->dtd_data.ctt_size < CTF_LSTRUCT_THRESH)
-	    type_size += sizeof (ctf_member_t) * vlen;
-	  else
-	    type_size += sizeof (ctf_lmember_t) * vlen;
-	  break;
-	case CTF_K_ENUM:
-	  type_size += sizeof (ctf_enum_t) * vlen;
-	  break;
-	}
-    }
+  if (fp->ctf_flags & LCTF_CHILD)
+    hdr.cth_parname = 1;
 
-  /* Computing the number of entries in the CTF variable section is much
-     simpler.  */
+  for (type_size = 0, dtd = ctf_list_next (&fp->ctf_dtdefs);
+       dtd != NULL; dtd = ctf_list_next (dtd))
+    type_size += ctf_dtd_size (fp, dtd);
 
   for (nvars = 0, dvd = ctf_list_next (&fp->ctf_dvdefs);
        dvd != NULL; dvd = ctf_list_next (dvd), nvars++);
 
-  /* Fill in the string table and type offset and size, compute the size
-     of the entire CTF buffer we need, and then allocate a new buffer and
-     memcpy the finished header to the start of the buffer.  */
-
-  hdr.cth_typeoff = hdr.cth_varoff + (nvars * sizeof (ctf_varent_t));
-  hdr.cth_stroff = hdr.cth_typeoff + type_size;
-  hdr.cth_strlen = fp->ctf_dtvstrlen;
   if (fp->ctf_parname != NULL)
-    hdr.cth_strlen += strlen (fp->ctf_parname) + 1;
+    parlen = strlen (fp->ctf_parname) + 1;
 
-  buf_size = sizeof (ctf_header_t) + hdr.cth_stroff + hdr.cth_strlen;
+  if ((err = ctf_strset_init (&css, 1 + parlen)) != 0)
+    return err;
 
-  if ((buf = ctf_data_alloc (buf_size)) == MAP_FAILED)
-    return (ctf_set_errno (fp, EAGAIN));
+  memset (&cs, 0, sizeof (ctf_stream_t));
+  cs.cs_sink = sink;
+  cs.cs_arg = arg;
 
-  memcpy (buf, &hdr, sizeof (ctf_header_t));
-  t = (unsigned char *) buf + sizeof (ctf_header_t) + hdr.cth_varoff;
-  s = s0 = (unsigned char *) buf + sizeof (ctf_header_t) + hdr.cth_stroff;
+  for (dtd = ctf_list_next (&fp->ctf_dtdefs);
+       dtd != NULL && err == 0; dtd = ctf_list_next (dtd))
+    err = ctf_dtd_strings (fp, dtd, &css);
 
-  s[0] = '\0';
-  s++;
+  for (dvd = ctf_list_next (&fp->ctf_dvdefs);
+       dvd != NULL && err == 0; dvd = ctf_list_next (dvd))
+    err = ctf_strset_add (&css, dvd->dvd_name);
 
-  if (fp->ctf_parname != NULL)
+  if (err != 0 || (err = ctf_strset_layout (&css, &hdr.cth_strlen)) != 0)
+    goto out;
+
+  hdr.cth_typeoff = hdr.cth_varoff + (nvars * sizeof (ctf_varent_t));
+  hdr.cth_stroff = hdr.cth_typeoff + type_size;
+
+  if ((nvars > 0
+       && (dvds = ctf_alloc (nvars * sizeof (ctf_dvdef_t *))) == NULL)
+      || (cs.cs_buf = ctf_alloc (CTF_STREAM_BUF)) == NULL)
     {
-      memcpy (s, fp->ctf_parname, strlen (fp->ctf_parname) + 1);
-      s += strlen (fp->ctf_parname) + 1;
+      err = EAGAIN;
+      goto out;
     }
+  cs.cs_size = CTF_STREAM_BUF;
 
-  /* Work over the variable list, translating everything into
-     ctf_varent_t's and filling out the string table, then sort the buffer
-     of ctf_varent_t's.  */
-
-  dvarents = (ctf_varent_t *) t;
   for (i = 0, dvd = ctf_list_next (&fp->ctf_dvdefs); dvd != NULL;
        dvd = ctf_list_next (dvd), i++)
-    {
-      ctf_varent_t *var = &dvarents[i];
-      size_t len = strlen (dvd->dvd_name) + 1;
+    dvds[i] = dvd;
 
-      var->ctv_name = (uint32_t) (s - s0);
-      var->ctv_typeidx = dvd->dvd_type;
-      memcpy (s, dvd->dvd_name, len);
-      s += len;
-    }
-  assert (i == nvars);
+  qsort (dvds, nvars, sizeof (ctf_dvdef_t *), ctf_sort_dvd);
 
-  qsort_r (dvarents, nvars, sizeof (ctf_varent_t), ctf_sort_var, s0);
-  t += sizeof (ctf_varent_t) * nvars;
+  if ((err = ctf_stream_write (&hdr, sizeof (ctf_header_t), &cs)) != 0)
+    goto out;
 
-  assert (t == (unsigned char *) buf + sizeof (ctf_header_t) + hdr.cth_typeoff);
+  for (i = 0; i < nvars; i++)
+    {
+      ctf_varent_t var;
 
-  /* We now take a final lap through the dynamic type definition list and
-     copy the appropriate type records and strings to the output buffer.  */
+      var.ctv_name = ctf_strset_offset (&css, dvds[i]->dvd_name);
+      var.ctv_typeidx = dvds[i]->dvd_type;
+
+      if ((err = ctf_stream_write (&var, sizeof (ctf_varent_t), &cs)) != 0)
+	goto out;
+    }
+
+  /* ctf_copy_type() sets the name offset of the dtd it copies, which must not
+     change here, since FP is not being updated.  */
 
   for (dtd = ctf_list_next (&fp->ctf_dtdefs);
        dtd != NULL; dtd = ctf_list_next (dtd))
     {
+      size = ctf_dtd_size (fp, dtd);
 
-      uint32_t kind = LCTF_INFO_KIND (fp, dtd->dtd_data.ctt_info);
-      uint32_t vlen = LCTF_INFO_VLEN (fp, dtd->dtd_data.ctt_info);
+      if ((t = ctf_stream_reserve (&cs, size, &err)) == NULL)
+	goto out;
 
-      ctf_array_t cta;
-      uint32_t encoding;
-      size_t len;
+      name = dtd->dtd_data.ctt_name;
+      end = ctf_copy_type (fp, dtd, t, &css);
+      dtd->dtd_data.ctt_name = name;
 
-      if (dtd->dtd_name != NULL)
-	{
-	  dtd->dtd_data.ctt_name = (uint32_t) (s - s0);
-	  len = strlen (dtd->dtd_name) + 1;
-	  memcpy (s, dtd->dtd_name, len);
-	  s += len;
-	}
-      else
-	dtd->dtd_data.ctt_name = 0;
+      assert (end == t + size);
+      cs.cs_len += size;
+    }
 
-      if (dtd->dtd_data.ctt_size != CTF_LSIZE_SENT)
-	len = sizeof (ctf_stype_t);
-      else
-	len = sizeof (ctf_type_t);
+  if ((err = ctf_stream_write (_CTF_NULLSTR, 1, &cs)) != 0
+      || (fp->ctf_parname != NULL
+	  && (err = ctf_stream_write (fp->ctf_parname, parlen, &cs)) != 0)
+      || (err = ctf_strset_stream (&css, ctf_stream_write, &cs)) != 0)
+    goto out;
 
-      memcpy (t, &dtd->dtd_data, len);
-      t += len;
+  err = ctf_stream_flush (&cs);
 
-      switch (kind)
-	{
-	case CTF_K_INTEGER:
-	case CTF_K_FLOAT:
-	  if (kind == CTF_K_INTEGER)
-	    {
-	      encoding = CTF_INT_DATA (dtd->dtd_u.dtu_enc.cte_format,
-				       dtd->dtd_u.dtu_enc.cte_offset,
-				       dtd->dtd_u.dtu_enc.cte_bits);
-	    }
-	  else
-	    {
-	      encoding = CTF_FP_DATA (dtd->dtd_u.dtu_enc.cte_format,
-				      dtd->dtd_u.dtu_enc.cte_offset,
-				      dtd->dtd_u.dtu_enc.cte_bits);
-	    }
-	  memcpy (t, &encoding, sizeof (encoding));
-	  t += sizeof (encoding);
-	  break;
+out:
+  ctf_free (cs.cs_buf, cs.cs_size);
+  ctf_free (dvds, nvars * sizeof (ctf_dvdef_t *));
+  ctf_strset_destroy (&css);
+  return err;
+}
 
-	case CTF_K_ARRAY:
-	  cta.cta_contents = (uint32_t) dtd->dtd_u.dtu_arr.ctr_contents;
-	  cta.cta_index = (uint32_t) dtd->dtd_u.dtu_arr.ctr_index;
-	  cta.cta_nelems = dtd->dtd_u.dtu_arr.ctr_nelems;
-	  memcpy (t, &cta, sizeof (cta));
-	  t += sizeof (cta);
-	  break;
+/* The name index of dynamic types maps each name in each of the CTF_INDEX_*
+   namespaces to the newest dtd of that name, which is chained to older ones
+   through dtd_nameprev, so that types not yet committed can be found by name
+   without ctf_update().  Committed types stay in the index, so lookups among
+   uncommitted types stop at the first dtd with an ID no greater than
+   ctf_dtoldid.  */
 
-	case CTF_K_FUNCTION:
-	  {
-	    uint32_t *argv = (uint32_t *) (uintptr_t) t;
-	    uint32_t argc;
+/* The namespace of names of types of the given KIND.  Forwards are named in the
+   namespace of the kind FWDKIND they forward to, structs by default, as in
+   init_hash_type().  */
+
+int
+ctf_name_space (uint32_t kind, uint32_t fwdkind)
+{
+  if (kind == CTF_K_FORWARD)
+    kind = (fwdkind == CTF_K_UNION || fwdkind == CTF_K_ENUM
+	    ? fwdkind : CTF_K_STRUCT);
 
-	    for (argc = 0; argc < vlen; argc++)
-	      *argv++ = (uint32_t) dtd->dtd_u.dtu_argv[argc];
+  switch (kind)
+    {
+    case CTF_K_STRUCT:
+      return CTF_INDEX_STRUCTS;
+    case CTF_K_UNION:
+      return CTF_INDEX_UNIONS;
+    case CTF_K_ENUM:
+      return CTF_INDEX_ENUMS;
+    default:
+      return CTF_INDEX_NAMES;
+    }
+}
 
-	    if (vlen & 1)
-	      *argv++ = 0;	/* Pad to 4-byte boundary.  */
+static int
+ctf_dtd_name_insert (ctf_file_t *fp, ctf_dtdef_t *dtd, int ns)
+{
+  if (dtd->dtd_name == NULL || dtd->dtd_name[0] == '\0')
+    return 0;
 
-	    t = (unsigned char *) argv;
-	    break;
-	  }
+  dtd->dtd_nameprev = ctf_dynhash_lookup (fp->ctf_dtnames[ns], dtd->dtd_name);
+  return ctf_dynhash_insert (fp->ctf_dtnames[ns], dtd->dtd_name, dtd);
+}
 
-	case CTF_K_STRUCT:
-	case CTF_K_UNION:
-	  if (dtd->dtd_data.ctt_size < CTF_LSTRUCT_THRESH)
-	    t = ctf_copy_smembers (dtd, (uint32_t) (s - s0), t);
-	  else
-	    t = ctf_copy_lmembers (dtd, (uint32_t) (s - s0), t);
-	  s = ctf_copy_membnames (dtd, s);
-	  break;
+/* Remove DTD from the name index, if it is there.  Rollbacks remove the newest
+   types, so DTD is usually at the head of its chain.  */
 
-	case CTF_K_ENUM:
-	  t = ctf_copy_emembers (dtd, (uint32_t) (s - s0), t);
-	  s = ctf_copy_membnames (dtd, s);
-	  break;
-	}
-    }
-  assert (t == (unsigned char *) buf + sizeof (ctf_header_t) + hdr.cth_stroff);
+static void
+ctf_dtd_name_delete (ctf_file_t *fp, ctf_dtdef_t *dtd)
+{
+  uint32_t kind = LCTF_INFO_KIND (fp, dtd->dtd_data.ctt_info);
+  ctf_dynhash_t *dhp;
+  ctf_dtdef_t *head, **pp;
 
-  /* Finally, we are ready to ctf_bufopen() the new container.  If this
-     is successful, we then switch nfp and fp and free the old container.  */
+  if (dtd->dtd_name == NULL || dtd->dtd_name[0] == '\0')
+    return;
 
-  ctf_data_protect (buf, buf_size);
-  cts.cts_name = _CTF_SECTION;
-  cts.cts_type = SHT_PROGBITS;
-  cts.cts_flags = 0;
-  cts.cts_data = buf;
-  cts.cts_size = buf_size;
-  cts.cts_entsize = 1;
-  cts.cts_offset = 0;
+  dhp = fp->ctf_dtnames[ctf_name_space (kind, dtd->dtd_data.ctt_type)];
+  if ((head = ctf_dynhash_lookup (dhp, dtd->dtd_name)) == NULL)
+    return;
 
-  if ((nfp = ctf_bufopen (&cts, NULL, NULL, &err)) == NULL)
+  if (head == dtd)
     {
-      ctf_data_free (buf, buf_size);
-      return (ctf_set_errno (fp, err));
+      /* The key is DTD's own name, so must be replaced along with it.  */
+
+      if (dtd->dtd_nameprev != NULL)
+	ctf_dynhash_insert (dhp, dtd->dtd_nameprev->dtd_name,
+			    dtd->dtd_nameprev);
+      else
+	ctf_dynhash_remove (dhp, dtd->dtd_name);
+      return;
     }
 
-  (void) ctf_setmodel (nfp, ctf_getmodel (fp));
-  (void) ctf_import (nfp, fp->ctf_parent);
+  for (pp = &head->dtd_nameprev; *pp != NULL; pp = &(*pp)->dtd_nameprev)
+    {
+      if (*pp == dtd)
+	{
+	  *pp = dtd->dtd_nameprev;
+	  break;
+	}
+    }
+}
 
-  nfp->ctf_refcnt = fp->ctf_refcnt;
-  nfp->ctf_flags |= fp->ctf_flags & ~LCTF_DIRTY;
-  nfp->ctf_data.cts_data = NULL;	/* Force ctf_data_free() on close.  */
-  nfp->ctf_dthash = fp->ctf_dthash;
-  nfp->ctf_dthashlen = fp->ctf_dthashlen;
-  nfp->ctf_dtdefs = fp->ctf_dtdefs;
-  nfp->ctf_dvhash = fp->ctf_dvhash;
-  nfp->ctf_dvhashlen = fp->ctf_dvhashlen;
-  nfp->ctf_dvdefs = fp->ctf_dvdefs;
-  nfp->ctf_dtvstrlen = fp->ctf_dtvstrlen;
-  nfp->ctf_dtnextid = fp->ctf_dtnextid;
-  nfp->ctf_dtoldid = fp->ctf_dtnextid - 1;
-  nfp->ctf_snapshots = fp->ctf_snapshots + 1;
-  nfp->ctf_specific = fp->ctf_specific;
+/* Return the newest dynamic type named NAME in namespace NS (one of the
+   CTF_INDEX_* constants), or NULL.  Older types of the same name follow it on
+   its dtd_nameprev chain.  */
 
-  nfp->ctf_snapshot_lu = fp->ctf_snapshots;
+ctf_dtdef_t *
+ctf_dtd_lookup_name (ctf_file_t *fp, int ns, const char *name)
+{
+  if (fp->ctf_dtnames[ns] == NULL)
+    return NULL;
 
-  fp->ctf_dthash = NULL;
-  fp->ctf_dthashlen = 0;
-  memset (&fp->ctf_dtdefs, 0, sizeof (ctf_list_t));
+  return ctf_dynhash_lookup (fp->ctf_dtnames[ns], name);
+}
 
-  fp->ctf_dvhash = NULL;
-  fp->ctf_dvhashlen = 0;
-  memset (&fp->ctf_dvdefs, 0, sizeof (ctf_list_t));
+/* Dynamic type IDs are handed out densely from ctf_dtnextid, so the dtds are
+   kept in an array indexed by type index rather than in a hash.  Entries past
+   the end of the array are NULL; the array only ever grows, and rollbacks just
+   clear the entries of the dtds they delete.  */
 
-  memcpy (&ofp, fp, sizeof (ctf_file_t));
-  memcpy (fp, nfp, sizeof (ctf_file_t));
-  memcpy (nfp, &ofp, sizeof (ctf_file_t));
+int
+ctf_dtd_insert (ctf_file_t *fp, ctf_dtdef_t *dtd)
+{
+  size_t idx = LCTF_TYPE_TO_INDEX (fp, dtd->dtd_type);
 
-  /* Initialize the ctf_lookup_by_name top-level dictionary.  We keep an
-     array of type name prefixes and the corresponding ctf_hash to use.
-     NOTE: This code must be kept in sync with the code in ctf_bufopen().  */
+  if (idx >= fp->ctf_dtdtablen)
+    {
+      size_t len = fp->ctf_dtdtablen < 1024 ? 1024 : fp->ctf_dtdtablen * 2;
+      ctf_dtdef_t **tab;
 
-  fp->ctf_lookups[0].ctl_hash = &fp->ctf_structs;
-  fp->ctf_lookups[1].ctl_hash = &fp->ctf_unions;
-  fp->ctf_lookups[2].ctl_hash = &fp->ctf_enums;
-  fp->ctf_lookups[3].ctl_hash = &fp->ctf_names;
+      while (len <= idx)
+	len *= 2;
 
-  nfp->ctf_refcnt = 1;		/* Force nfp to be freed.  */
-  ctf_close (nfp);
+      if ((tab = ctf_alloc (len * sizeof (ctf_dtdef_t *))) == NULL)
+	return EAGAIN;
 
-  return 0;
-}
+      if (fp->ctf_dtdtab != NULL)
+	memcpy (tab, fp->ctf_dtdtab,
+		fp->ctf_dtdtablen * sizeof (ctf_dtdef_t *));
+      memset (tab + fp->ctf_dtdtablen, 0,
+	      (len - fp->ctf_dtdtablen) * sizeof (ctf_dtdef_t *));
+      ctf_free (fp->ctf_dtdtab, fp->ctf_dtdtablen * sizeof (ctf_dtdef_t *));
 
-void
-ctf_dtd_insert (ctf_file_t *fp, ctf_dtdef_t *dtd)
-{
-  unsigned long h = dtd->dtd_type % (fp->ctf_dthashlen - 1);
+      fp->ctf_dtdtab = tab;
+      fp->ctf_dtdtablen = len;
+    }
 
-  dtd->dtd_hash = fp->ctf_dthash[h];
-  fp->ctf_dthash[h] = dtd;
+  fp->ctf_dtdtab[idx] = dtd;
   ctf_list_append (&fp->ctf_dtdefs, dtd);
+  return 0;
 }
 
+/* Remove DTD from the container.  Its memory, and that of its members, is
+   left for the arena to release.  */
+
 void
 ctf_dtd_delete (ctf_file_t *fp, ctf_dtdef_t *dtd)
 {
-  unsigned long h = dtd->dtd_type % (fp->ctf_dthashlen - 1);
-  ctf_dtdef_t *p, **q = &fp->ctf_dthash[h];
-  ctf_dmdef_t *dmd, *nmd;
-  size_t len;
+  ctf_dmdef_t *dmd;
 
-  for (p = *q; p != NULL; p = p->dtd_hash)
-    {
-      if (p != dtd)
-	q = &p->dtd_hash;
-      else
-	break;
-    }
+  ctf_dtd_name_delete (fp, dtd);
 
-  if (p != NULL)
-    *q = p->dtd_hash;
+  if (fp->ctf_refhash != NULL
+      && ctf_dynhash_lookup (fp->ctf_refhash, dtd) == dtd)
+    ctf_dynhash_remove (fp->ctf_refhash, dtd);
 
   switch (LCTF_INFO_KIND (fp, dtd->dtd_data.ctt_info))
     {
@@ -510,119 +1447,158 @@ ctf_dtd_delete (ctf_file_t *fp, ctf_dtdef_t *dtd)
     case CTF_K_UNION:
     case CTF_K_ENUM:
       for (dmd = ctf_list_next (&dtd->dtd_u.dtu_members);
-	   dmd != NULL; dmd = nmd)
+	   dmd != NULL; dmd = ctf_list_next (dmd))
 	{
 	  if (dmd->dmd_name != NULL)
-	    {
-	      len = strlen (dmd->dmd_name) + 1;
-	      ctf_free (dmd->dmd_name, len);
-	      fp->ctf_dtvstrlen -= len;
-	    }
-	  nmd = ctf_list_next (dmd);
-	  ctf_free (dmd, sizeof (ctf_dmdef_t));
+	    ctf_dynhash_remove (fp->ctf_dmhash, dmd);
 	}
       break;
-    case CTF_K_FUNCTION:
-      ctf_free (dtd->dtd_u.dtu_argv, sizeof (ctf_id_t) *
-		LCTF_INFO_VLEN (fp, dtd->dtd_data.ctt_info));
-      break;
-    }
-
-  if (dtd->dtd_name)
-    {
-      len = strlen (dtd->dtd_name) + 1;
-      ctf_free (dtd->dtd_name, len);
-      fp->ctf_dtvstrlen -= len;
     }
 
+  fp->ctf_dtdtab[LCTF_TYPE_TO_INDEX (fp, dtd->dtd_type)] = NULL;
   ctf_list_delete (&fp->ctf_dtdefs, dtd);
-  ctf_free (dtd, sizeof (ctf_dtdef_t));
 }
 
 ctf_dtdef_t *
 ctf_dtd_lookup (ctf_file_t *fp, ctf_id_t type)
 {
-  unsigned long h = type % (fp->ctf_dthashlen - 1);
+  size_t idx = LCTF_TYPE_TO_INDEX (fp, type);
   ctf_dtdef_t *dtd;
 
-  if (fp->ctf_dthash == NULL)
+  if (idx >= fp->ctf_dtdtablen || (dtd = fp->ctf_dtdtab[idx]) == NULL)
     return NULL;
 
-  for (dtd = fp->ctf_dthash[h]; dtd != NULL; dtd = dtd->dtd_hash)
-    {
-      if (dtd->dtd_type == type)
-	break;
-    }
+  /* The index alone does not say whether this is a parent or child type.  */
 
-  return dtd;
+  return (dtd->dtd_type == type ? dtd : NULL);
 }
 
-void
-ctf_dvd_insert (ctf_file_t *fp, ctf_dvdef_t *dvd)
+/* Add DMD, a new member of DTD, to the end of its member list and, if it is
+   named, to the member hash.  Returns zero or an error code.  */
+
+static int
+ctf_dmd_insert (ctf_file_t *fp, ctf_dtdef_t *dtd, ctf_dmdef_t *dmd)
 {
-  unsigned long h = ctf_hash_compute (dvd->dvd_name, strlen (dvd->dvd_name))
-    % (fp->ctf_dvhashlen - 1);
+  int err;
 
-  dvd->dvd_hash = fp->ctf_dvhash[h];
-  fp->ctf_dvhash[h] = dvd;
-  ctf_list_append (&fp->ctf_dvdefs, dvd);
+  dmd->dmd_owner = dtd->dtd_type;
+
+  if (dmd->dmd_name != NULL
+      && (err = ctf_dynhash_insert (fp->ctf_dmhash, dmd, dmd)) != 0)
+    return err;
+
+  ctf_list_append (&dtd->dtd_u.dtu_members, dmd);
+  return 0;
 }
 
-void
-ctf_dvd_delete (ctf_file_t *fp, ctf_dvdef_t *dvd)
+/* Add DMD to the end of the members of DTD like ctf_dmd_insert(), unless DTD
+   already has a member of the same name, when ECTF_DUPLICATE is returned:
+   looking for the name and inserting it are done in one go.  */
+
+static int
+ctf_dmd_insert_new (ctf_file_t *fp, ctf_dtdef_t *dtd, ctf_dmdef_t *dmd)
 {
-  size_t len = strlen (dvd->dvd_name);
-  unsigned long h = ctf_hash_compute (dvd->dvd_name, len)
-    % (fp->ctf_dvhashlen - 1);
-  ctf_dvdef_t *p, **q = &fp->ctf_dvhash[h];
+  int err;
 
-  for (p = *q; p != NULL; p = p->dvd_hash)
-    {
-      if (p != dvd)
-	q = &p->dvd_hash;
-      else
-	break;
-    }
+  dmd->dmd_owner = dtd->dtd_type;
+
+  if (dmd->dmd_name != NULL
+      && (err = ctf_dynhash_insert_new (fp->ctf_dmhash, dmd, dmd)) != 0)
+    return (err == EEXIST ? ECTF_DUPLICATE : err);
+
+  ctf_list_append (&dtd->dtd_u.dtu_members, dmd);
+  return 0;
+}
 
-  if (p != NULL)
-    *q = p->dvd_hash;
+/* Return whether DTD already has a member named NAME.  */
 
-  if (dvd->dvd_name)
+static int
+ctf_dmd_exists (ctf_file_t *fp, const ctf_dtdef_t *dtd, const char *name)
+{
+  ctf_dmdef_t key;
+
+  key.dmd_name = (char *) name;
+  key.dmd_owner = dtd->dtd_type;
+
+  return (ctf_dynhash_lookup (fp->ctf_dmhash, &key) != NULL);
+}
+
+/* Remove the last N members of DTD again, when adding several at once fails
+   part of the way through.  */
+
+static void
+ctf_dmd_unwind (ctf_file_t *fp, ctf_dtdef_t *dtd, size_t n)
+{
+  while (n-- > 0)
     {
-      ctf_free (dvd->dvd_name, len + 1);
-      fp->ctf_dtvstrlen -= len + 1;
+      ctf_dmdef_t *dmd = ctf_list_prev (&dtd->dtd_u.dtu_members);
+
+      if (dmd->dmd_name != NULL)
+	ctf_dynhash_remove (fp->ctf_dmhash, dmd);
+      ctf_list_delete (&dtd->dtd_u.dtu_members, dmd);
     }
+}
+
+/* Note that DTD has been changed.  The records of types already committed by
+   ctf_update() cannot be changed in place, so the next update must write them
+   all out again if one of them is.  */
+
+static void
+ctf_dtd_dirty (ctf_file_t *fp, const ctf_dtdef_t *dtd)
+{
+  if (LCTF_TYPE_TO_INDEX (fp, dtd->dtd_type) <= fp->ctf_dtoldid)
+    fp->ctf_flags |= LCTF_REBUILD;
+
+  fp->ctf_flags |= LCTF_DIRTY;
+}
 
+/* Note that a member has just been allocated for DTD.  If DTD would survive a
+   rollback to the last snapshot, so must the member, so rollbacks must not
+   release the arena up to here.  */
+
+static void
+ctf_dtd_pin (ctf_file_t *fp, const ctf_dtdef_t *dtd)
+{
+  if (fp->ctf_nmarks > 0
+      && LCTF_TYPE_TO_INDEX (fp, dtd->dtd_type)
+	 <= fp->ctf_marks[fp->ctf_nmarks - 1].cam_dtd_id)
+    fp->ctf_arena_pin = ctf_arena_mark (&fp->ctf_arena);
+}
+
+int
+ctf_dvd_insert (ctf_file_t *fp, ctf_dvdef_t *dvd)
+{
+  int err;
+
+  if ((err = ctf_dynhash_insert (fp->ctf_dvhash, dvd->dvd_name, dvd)) != 0)
+    return err;
+
+  ctf_list_append (&fp->ctf_dvdefs, dvd);
+  return 0;
+}
+
+void
+ctf_dvd_delete (ctf_file_t *fp, ctf_dvdef_t *dvd)
+{
+  ctf_dynhash_remove (fp->ctf_dvhash, dvd->dvd_name);
   ctf_list_delete (&fp->ctf_dvdefs, dvd);
-  ctf_free (dvd, sizeof (ctf_dvdef_t));
 }
 
 ctf_dvdef_t *
 ctf_dvd_lookup (ctf_file_t *fp, const char *name)
 {
-  unsigned long h = ctf_hash_compute (name, strlen (name))
-    % (fp->ctf_dvhashlen - 1);
-  ctf_dvdef_t *dvd;
-
   if (fp->ctf_dvhash == NULL)
     return NULL;
 
-  for (dvd = fp->ctf_dvhash[h]; dvd != NULL; dvd = dvd->dvd_hash)
-    {
-      if (strcmp (name, dvd->dvd_name) == 0)
-	break;
-    }
-
-  return dvd;
+  return ctf_dynhash_lookup (fp->ctf_dvhash, name);
 }
 
 /* Discard all of the dynamic type definitions and variable definitions that
-   have been added to the container since the last call to ctf_update().  We
-   locate such types by scanning the dtd list and deleting elements that have
-   type IDs greater than ctf_dtoldid, which is set by ctf_update(), above, and
-   by scanning the variable list and deleting elements that have update IDs
-   equal to the current value of the last-update snapshot count (indicating that
-   they were added after the most recent call to ctf_update()).  */
+   have been added to the container since the last call to ctf_update().  These
+   are the types with IDs greater than ctf_dtoldid, which is set by
+   ctf_update(), above, and the variables with update IDs greater than the
+   last-update snapshot count (indicating that they were added after the most
+   recent call to ctf_update()).  */
 int
 ctf_discard (ctf_file_t *fp)
 {
@@ -637,12 +1613,58 @@ ctf_discard (ctf_file_t *fp)
   return (ctf_rollback (fp, last_update));
 }
 
+/* Record where the arena stood when the snapshot ID was taken, so that a
+   rollback to it can release everything allocated since.  If there is no room
+   to, nothing is released.  */
+
+static void
+ctf_snapshot_mark (ctf_file_t *fp, ctf_snapshot_id_t id)
+{
+  unsigned long i = id.snapshot_id - fp->ctf_marks_base;
+
+  if (id.snapshot_id < fp->ctf_marks_base)
+    return;
+
+  if (i >= fp->ctf_markslen)
+    {
+      unsigned long len = fp->ctf_markslen < 64 ? 64 : fp->ctf_markslen * 2;
+      ctf_arena_mark_t *marks;
+
+      while (len <= i)
+	len *= 2;
+
+      if ((marks = ctf_realloc (fp->ctf_marks,
+				len * sizeof (ctf_arena_mark_t))) == NULL)
+	{
+	  if (fp->ctf_nmarks > i)
+	    fp->ctf_nmarks = i;
+	  return;
+	}
+
+      fp->ctf_marks = marks;
+      fp->ctf_markslen = len;
+    }
+
+  /* Snapshots skipped over by a rollback have no known position.  */
+
+  for (; fp->ctf_nmarks < i; fp->ctf_nmarks++)
+    {
+      fp->ctf_marks[fp->ctf_nmarks].cam_pos = (size_t) -1;
+      fp->ctf_marks[fp->ctf_nmarks].cam_dtd_id = ULONG_MAX;
+    }
+
+  fp->ctf_marks[i].cam_pos = ctf_arena_mark (&fp->ctf_arena);
+  fp->ctf_marks[i].cam_dtd_id = id.dtd_id;
+  fp->ctf_nmarks = i + 1;
+}
+
 ctf_snapshot_id_t
 ctf_snapshot (ctf_file_t *fp)
 {
   ctf_snapshot_id_t snapid;
   snapid.dtd_id = fp->ctf_dtnextid - 1;
   snapid.snapshot_id = fp->ctf_snapshots++;
+  ctf_snapshot_mark (fp, snapid);
   return snapid;
 }
 
@@ -650,8 +1672,9 @@ ctf_snapshot (ctf_file_t *fp)
 int
 ctf_rollback (ctf_file_t *fp, ctf_snapshot_id_t id)
 {
-  ctf_dtdef_t *dtd, *ntd;
-  ctf_dvdef_t *dvd, *nvd;
+  ctf_dtdef_t *dtd;
+  ctf_dvdef_t *dvd;
+  unsigned long idx;
 
   if (!(fp->ctf_flags & LCTF_RDWR))
     return (ctf_set_errno (fp, ECTF_RDONLY));
@@ -662,24 +1685,38 @@ ctf_rollback (ctf_file_t *fp, ctf_snapshot_id_t id)
   if (fp->ctf_snapshot_lu >= id.snapshot_id)
     return (ctf_set_errno (fp, ECTF_OVERROLLBACK));
 
-  for (dtd = ctf_list_next (&fp->ctf_dtdefs); dtd != NULL; dtd = ntd)
+  /* Types get dense, increasing IDs and variables are appended to their list
+     with the snapshot count at the time, and rollbacks only ever remove the
+     newest of each, so those added since the snapshot are the last ones, and
+     can be found without looking at the rest.  */
+
+  for (idx = fp->ctf_dtnextid - 1; idx > id.dtd_id; idx--)
     {
-      ntd = ctf_list_next (dtd);
+      if (idx < fp->ctf_dtdtablen && (dtd = fp->ctf_dtdtab[idx]) != NULL)
+	ctf_dtd_delete (fp, dtd);
+    }
 
-      if (LCTF_TYPE_TO_INDEX (fp, dtd->dtd_type) <= id.dtd_id)
-	continue;
+  /* Types copied in by ctf_add_type() may just have been deleted.  */
 
-      ctf_dtd_delete (fp, dtd);
-    }
+  if (fp->ctf_dtnextid > id.dtd_id + 1)
+    ctf_srcmap_clear (fp);
+
+  while ((dvd = ctf_list_prev (&fp->ctf_dvdefs)) != NULL
+	 && dvd->dvd_snapshots > id.snapshot_id)
+    ctf_dvd_delete (fp, dvd);
 
-  for (dvd = ctf_list_next (&fp->ctf_dvdefs); dvd != NULL; dvd = nvd)
-    {
-      nvd = ctf_list_next (dvd);
+  /* Now release everything allocated since the snapshot, other than members
+     added since to the types it kept.  Marks of later snapshots, and of this
+     one, may describe memory reused from here on.  */
 
-      if (dvd->dvd_snapshots <= id.snapshot_id)
-	continue;
+  if (id.snapshot_id >= fp->ctf_marks_base
+      && id.snapshot_id - fp->ctf_marks_base < fp->ctf_nmarks)
+    {
+      size_t pos = fp->ctf_marks[id.snapshot_id - fp->ctf_marks_base].cam_pos;
 
-      ctf_dvd_delete (fp, dvd);
+      if (pos != (size_t) -1)
+	ctf_arena_release (&fp->ctf_arena, MAX (pos, fp->ctf_arena_pin));
+      fp->ctf_nmarks = id.snapshot_id - fp->ctf_marks_base;
     }
 
   fp->ctf_dtnextid = id.dtd_id + 1;
@@ -691,14 +1728,57 @@ ctf_rollback (ctf_file_t *fp, ctf_snapshot_id_t id)
   return 0;
 }
 
+/* If reference types are shared, return the ID of the type identical to KEY,
+   whose info word is yet to be filled in, or zero if there is none.  */
+
+static ctf_id_t
+ctf_dtd_ref_find (ctf_file_t *fp, uint32_t flag, uint32_t kind,
+		  ctf_dtdef_t *key)
+{
+  ctf_dtdef_t *dtd;
+
+  if (fp->ctf_refhash == NULL
+      || (flag != CTF_ADD_NONROOT && flag != CTF_ADD_ROOT))
+    return 0;
+
+  key->dtd_data.ctt_info = CTF_TYPE_INFO (kind, flag, 0);
+  if ((dtd = ctf_dynhash_lookup (fp->ctf_refhash, key)) == NULL)
+    return 0;
+
+  return dtd->dtd_type;
+}
+
+/* If reference types are shared, note DTD, which has just been added and filled
+   in.  On failure, DTD is removed again.  */
+
+static ctf_id_t
+ctf_dtd_ref_insert (ctf_file_t *fp, ctf_dtdef_t *dtd)
+{
+  if (fp->ctf_refhash != NULL
+      && ctf_dynhash_insert (fp->ctf_refhash, dtd, dtd) != 0)
+    {
+      ctf_dtd_delete (fp, dtd);
+      fp->ctf_dtnextid--;
+      return (ctf_set_errno (fp, EAGAIN));
+    }
+
+  return dtd->dtd_type;
+}
+
+/* Add a new dynamic type named NAME (if not NULL), a type of the given KIND or,
+   for forwards, a forward to a type of that kind, so that its name goes in the
+   right namespace.  The caller fills in the type itself.  */
+
 static ctf_id_t
 ctf_add_generic (ctf_file_t *fp, uint32_t flag, const char *name,
-		 ctf_dtdef_t **rp)
+		 uint32_t kind, ctf_dtdef_t **rp)
 {
   ctf_dtdef_t *dtd;
   ctf_id_t type;
   char *s = NULL;
 
+  *rp = NULL;
+
   if (flag != CTF_ADD_NONROOT && flag != CTF_ADD_ROOT)
     return (ctf_set_errno (fp, EINVAL));
 
@@ -711,14 +1791,11 @@ ctf_add_generic (ctf_file_t *fp, uint32_t flag, const char *name,
   if (LCTF_INDEX_TO_TYPE (fp, fp->ctf_dtnextid, 1) == CTF_MAX_PTYPE)
     return (ctf_set_errno (fp, ECTF_FULL));
 
-  if ((dtd = ctf_alloc (sizeof (ctf_dtdef_t))) == NULL)
+  if ((dtd = ctf_arena_alloc (&fp->ctf_arena, sizeof (ctf_dtdef_t))) == NULL)
     return (ctf_set_errno (fp, EAGAIN));
 
-  if (name != NULL && (s = ctf_strdup (name)) == NULL)
-    {
-      ctf_free (dtd, sizeof (ctf_dtdef_t));
-      return (ctf_set_errno (fp, EAGAIN));
-    }
+  if (name != NULL && (s = ctf_arena_strdup (&fp->ctf_arena, name)) == NULL)
+    return (ctf_set_errno (fp, EAGAIN));
 
   type = fp->ctf_dtnextid++;
   type = LCTF_INDEX_TO_TYPE (fp, type, (fp->ctf_flags & LCTF_CHILD));
@@ -727,10 +1804,19 @@ ctf_add_generic (ctf_file_t *fp, uint32_t flag, const char *name,
   dtd->dtd_name = s;
   dtd->dtd_type = type;
 
-  if (s != NULL)
-    fp->ctf_dtvstrlen += strlen (s) + 1;
+  if (ctf_dtd_insert (fp, dtd) != 0)
+    {
+      fp->ctf_dtnextid--;
+      return (ctf_set_errno (fp, EAGAIN));
+    }
+
+  if (ctf_dtd_name_insert (fp, dtd, ctf_name_space (kind, 0)) != 0)
+    {
+      ctf_dtd_delete (fp, dtd);
+      fp->ctf_dtnextid--;
+      return (ctf_set_errno (fp, EAGAIN));
+    }
 
-  ctf_dtd_insert (fp, dtd);
   fp->ctf_flags |= LCTF_DIRTY;
 
   *rp = dtd;
@@ -764,7 +1850,7 @@ ctf_add_encoded (ctf_file_t *fp, uint32_t flag,
   if (ep == NULL)
     return (ctf_set_errno (fp, EINVAL));
 
-  if ((type = ctf_add_generic (fp, flag, name, &dtd)) == CTF_ERR)
+  if ((type = ctf_add_generic (fp, flag, name, kind, &dtd)) == CTF_ERR)
     return CTF_ERR;		/* errno is set for us.  */
 
   dtd->dtd_data.ctt_info = CTF_TYPE_INFO (kind, flag, 0);
@@ -775,21 +1861,29 @@ ctf_add_encoded (ctf_file_t *fp, uint32_t flag,
 }
 
 static ctf_id_t
-ctf_add_reftype (ctf_file_t *fp, uint32_t flag, ctf_id_t ref, uint32_t kind)
+ctf_add_reftype (ctf_file_t *fp, uint32_t flag, const char *name,
+		 ctf_id_t ref, uint32_t kind)
 {
-  ctf_dtdef_t *dtd;
+  ctf_dtdef_t *dtd, key;
   ctf_id_t type;
 
   if (ref == CTF_ERR || ref < 0 || ref > CTF_MAX_TYPE)
     return (ctf_set_errno (fp, EINVAL));
 
-  if ((type = ctf_add_generic (fp, flag, NULL, &dtd)) == CTF_ERR)
+  memset (&key, 0, sizeof (key));
+  key.dtd_name = (char *) name;
+  key.dtd_data.ctt_type = (uint32_t) ref;
+
+  if ((type = ctf_dtd_ref_find (fp, flag, kind, &key)) != 0)
+    return type;
+
+  if ((type = ctf_add_generic (fp, flag, name, kind, &dtd)) == CTF_ERR)
     return CTF_ERR;		/* errno is set for us.  */
 
   dtd->dtd_data.ctt_info = CTF_TYPE_INFO (kind, flag, 0);
   dtd->dtd_data.ctt_type = (uint32_t) ref;
 
-  return type;
+  return ctf_dtd_ref_insert (fp, dtd);
 }
 
 ctf_id_t
@@ -809,26 +1903,33 @@ ctf_add_float (ctf_file_t *fp, uint32_t flag,
 ctf_id_t
 ctf_add_pointer (ctf_file_t *fp, uint32_t flag, ctf_id_t ref)
 {
-  return (ctf_add_reftype (fp, flag, ref, CTF_K_POINTER));
+  return (ctf_add_reftype (fp, flag, NULL, ref, CTF_K_POINTER));
 }
 
 ctf_id_t
 ctf_add_array (ctf_file_t *fp, uint32_t flag, const ctf_arinfo_t *arp)
 {
-  ctf_dtdef_t *dtd;
+  ctf_dtdef_t *dtd, key;
   ctf_id_t type;
 
   if (arp == NULL)
     return (ctf_set_errno (fp, EINVAL));
 
-  if ((type = ctf_add_generic (fp, flag, NULL, &dtd)) == CTF_ERR)
+  memset (&key, 0, sizeof (key));
+  key.dtd_u.dtu_arr = *arp;
+
+  if ((type = ctf_dtd_ref_find (fp, flag, CTF_K_ARRAY, &key)) != 0)
+    return type;
+
+  if ((type = ctf_add_generic (fp, flag, NULL, CTF_K_ARRAY,
+			       &dtd)) == CTF_ERR)
     return CTF_ERR;		/* errno is set for us.  */
 
   dtd->dtd_data.ctt_info = CTF_TYPE_INFO (CTF_K_ARRAY, flag, 0);
   dtd->dtd_data.ctt_size = 0;
   dtd->dtd_u.dtu_arr = *arp;
 
-  return type;
+  return ctf_dtd_ref_insert (fp, dtd);
 }
 
 int
@@ -843,9 +1944,20 @@ ctf_set_array (ctf_file_t *fp, ctf_id_t type, const ctf_arinfo_t *arp)
       || LCTF_INFO_KIND (fp, dtd->dtd_data.ctt_info) != CTF_K_ARRAY)
     return (ctf_set_errno (fp, ECTF_BADID));
 
-  fp->ctf_flags |= LCTF_DIRTY;
+  /* A changed array is shared under its new contents, unless there is already
+     one like that, or no memory to note it: it is then just not shared.  */
+
+  if (fp->ctf_refhash != NULL
+      && ctf_dynhash_lookup (fp->ctf_refhash, dtd) == dtd)
+    ctf_dynhash_remove (fp->ctf_refhash, dtd);
+
+  ctf_dtd_dirty (fp, dtd);
   dtd->dtd_u.dtu_arr = *arp;
 
+  if (fp->ctf_refhash != NULL
+      && ctf_dynhash_lookup (fp->ctf_refhash, dtd) == NULL)
+    (void) ctf_dynhash_insert (fp->ctf_refhash, dtd, dtd);
+
   return 0;
 }
 
@@ -869,14 +1981,13 @@ ctf_add_function (ctf_file_t *fp, uint32_t flag,
   if (vlen > CTF_MAX_VLEN)
     return (ctf_set_errno (fp, EOVERFLOW));
 
-  if (vlen != 0 && (vdat = ctf_alloc (sizeof (ctf_id_t) * vlen)) == NULL)
+  if (vlen != 0 && (vdat = ctf_arena_alloc (&fp->ctf_arena,
+					    sizeof (ctf_id_t) * vlen)) == NULL)
     return (ctf_set_errno (fp, EAGAIN));
 
-  if ((type = ctf_add_generic (fp, flag, NULL, &dtd)) == CTF_ERR)
-    {
-      ctf_free (vdat, sizeof (ctf_id_t) * vlen);
-      return CTF_ERR;		   /* errno is set for us.  */
-    }
+  if ((type = ctf_add_generic (fp, flag, NULL, CTF_K_FUNCTION,
+			       &dtd)) == CTF_ERR)
+    return CTF_ERR;		   /* errno is set for us.  */
 
   dtd->dtd_data.ctt_info = CTF_TYPE_INFO (CTF_K_FUNCTION, flag, vlen);
   dtd->dtd_data.ctt_type = (uint32_t) ctc->ctc_return;
@@ -902,8 +2013,12 @@ ctf_add_struct_sized (ctf_file_t *fp, uint32_t flag, const char *name,
     hep = ctf_hash_lookup (hp, fp, name, strlen (name));
 
   if (hep != NULL && ctf_type_kind (fp, hep->h_type) == CTF_K_FORWARD)
-    dtd = ctf_dtd_lookup (fp, type = hep->h_type);
-  else if ((type = ctf_add_generic (fp, flag, name, &dtd)) == CTF_ERR)
+    {
+      dtd = ctf_dtd_lookup (fp, type = hep->h_type);
+      ctf_dtd_dirty (fp, dtd);
+    }
+  else if ((type = ctf_add_generic (fp, flag, name, CTF_K_STRUCT,
+				    &dtd)) == CTF_ERR)
     return CTF_ERR;		/* errno is set for us.  */
 
   dtd->dtd_data.ctt_info = CTF_TYPE_INFO (CTF_K_STRUCT, flag, 0);
@@ -939,8 +2054,12 @@ ctf_add_union_sized (ctf_file_t *fp, uint32_t flag, const char *name,
     hep = ctf_hash_lookup (hp, fp, name, strlen (name));
 
   if (hep != NULL && ctf_type_kind (fp, hep->h_type) == CTF_K_FORWARD)
-    dtd = ctf_dtd_lookup (fp, type = hep->h_type);
-  else if ((type = ctf_add_generic (fp, flag, name, &dtd)) == CTF_ERR)
+    {
+      dtd = ctf_dtd_lookup (fp, type = hep->h_type);
+      ctf_dtd_dirty (fp, dtd);
+    }
+  else if ((type = ctf_add_generic (fp, flag, name, CTF_K_UNION,
+				    &dtd)) == CTF_ERR)
     return CTF_ERR;		/* errno is set for us */
 
   dtd->dtd_data.ctt_info = CTF_TYPE_INFO (CTF_K_UNION, flag, 0);
@@ -975,8 +2094,12 @@ ctf_add_enum (ctf_file_t *fp, uint32_t flag, const char *name)
     hep = ctf_hash_lookup (hp, fp, name, strlen (name));
 
   if (hep != NULL && ctf_type_kind (fp, hep->h_type) == CTF_K_FORWARD)
-    dtd = ctf_dtd_lookup (fp, type = hep->h_type);
-  else if ((type = ctf_add_generic (fp, flag, name, &dtd)) == CTF_ERR)
+    {
+      dtd = ctf_dtd_lookup (fp, type = hep->h_type);
+      ctf_dtd_dirty (fp, dtd);
+    }
+  else if ((type = ctf_add_generic (fp, flag, name, CTF_K_ENUM,
+				    &dtd)) == CTF_ERR)
     return CTF_ERR;		/* errno is set for us.  */
 
   dtd->dtd_data.ctt_info = CTF_TYPE_INFO (CTF_K_ENUM, flag, 0);
@@ -985,94 +2108,359 @@ ctf_add_enum (ctf_file_t *fp, uint32_t flag, const char *name)
   return type;
 }
 
-ctf_id_t
-ctf_add_forward (ctf_file_t *fp, uint32_t flag, const char *name,
-		 uint32_t kind)
-{
-  ctf_hash_t *hp;
-  ctf_helem_t *hep;
-  ctf_dtdef_t *dtd;
-  ctf_id_t type;
+ctf_id_t
+ctf_add_forward (ctf_file_t *fp, uint32_t flag, const char *name,
+		 uint32_t kind)
+{
+  ctf_hash_t *hp;
+  ctf_helem_t *hep;
+  ctf_dtdef_t *dtd;
+  ctf_id_t type;
+
+  switch (kind)
+    {
+    case CTF_K_STRUCT:
+      hp = &fp->ctf_structs;
+      break;
+    case CTF_K_UNION:
+      hp = &fp->ctf_unions;
+      break;
+    case CTF_K_ENUM:
+      hp = &fp->ctf_enums;
+      break;
+    default:
+      return (ctf_set_errno (fp, ECTF_NOTSUE));
+    }
+
+  /* If the type is already defined or exists as a forward tag, just
+     return the ctf_id_t of the existing definition.  */
+  if (name != NULL && (hep = ctf_hash_lookup (hp, fp, name,
+					      strlen (name))) != NULL)
+    return hep->h_type;
+
+  if ((type = ctf_add_generic (fp, flag, name, kind, &dtd)) == CTF_ERR)
+    return CTF_ERR;		/* errno is set for us.  */
+
+  dtd->dtd_data.ctt_info = CTF_TYPE_INFO (CTF_K_FORWARD, flag, 0);
+  dtd->dtd_data.ctt_type = kind;
+
+  return type;
+}
+
+ctf_id_t
+ctf_add_typedef (ctf_file_t *fp, uint32_t flag, const char *name,
+		 ctf_id_t ref)
+{
+  return (ctf_add_reftype (fp, flag, name, ref, CTF_K_TYPEDEF));
+}
+
+ctf_id_t
+ctf_add_volatile (ctf_file_t *fp, uint32_t flag, ctf_id_t ref)
+{
+  return (ctf_add_reftype (fp, flag, NULL, ref, CTF_K_VOLATILE));
+}
+
+ctf_id_t
+ctf_add_const (ctf_file_t *fp, uint32_t flag, ctf_id_t ref)
+{
+  return (ctf_add_reftype (fp, flag, NULL, ref, CTF_K_CONST));
+}
+
+ctf_id_t
+ctf_add_restrict (ctf_file_t *fp, uint32_t flag, ctf_id_t ref)
+{
+  return (ctf_add_reftype (fp, flag, NULL, ref, CTF_K_RESTRICT));
+}
+
+int
+ctf_add_enumerator (ctf_file_t *fp, ctf_id_t enid, const char *name,
+		    int value)
+{
+  ctf_dtdef_t *dtd = ctf_dtd_lookup (fp, enid);
+  ctf_dmdef_t *dmd;
+
+  uint32_t kind, vlen, root;
+  char *s;
+  int err;
+
+  if (name == NULL)
+    return (ctf_set_errno (fp, EINVAL));
+
+  if (!(fp->ctf_flags & LCTF_RDWR))
+    return (ctf_set_errno (fp, ECTF_RDONLY));
+
+  if (dtd == NULL)
+    return (ctf_set_errno (fp, ECTF_BADID));
+
+  kind = LCTF_INFO_KIND (fp, dtd->dtd_data.ctt_info);
+  root = LCTF_INFO_ISROOT (fp, dtd->dtd_data.ctt_info);
+  vlen = LCTF_INFO_VLEN (fp, dtd->dtd_data.ctt_info);
+
+  if (kind != CTF_K_ENUM)
+    return (ctf_set_errno (fp, ECTF_NOTENUM));
+
+  if (vlen == CTF_MAX_VLEN)
+    return (ctf_set_errno (fp, ECTF_DTFULL));
+
+  if (ctf_dmd_exists (fp, dtd, name))
+    return (ctf_set_errno (fp, ECTF_DUPLICATE));
+
+  if ((dmd = ctf_arena_alloc (&fp->ctf_arena, sizeof (ctf_dmdef_t))) == NULL
+      || (s = ctf_arena_strdup (&fp->ctf_arena, name)) == NULL)
+    return (ctf_set_errno (fp, EAGAIN));
+
+  dmd->dmd_name = s;
+  dmd->dmd_type = CTF_ERR;
+  dmd->dmd_offset = 0;
+  dmd->dmd_value = value;
+
+  if ((err = ctf_dmd_insert (fp, dtd, dmd)) != 0)
+    return (ctf_set_errno (fp, err));
+
+  dtd->dtd_data.ctt_info = CTF_TYPE_INFO (kind, root, vlen + 1);
+
+  ctf_dtd_dirty (fp, dtd);
+  ctf_dtd_pin (fp, dtd);
+
+  return 0;
+}
+
+/* Add the N enumerators in ENUMS to the enum ENID, as if by one call to
+   ctf_add_enumerator() for each, but looking the enum up and allocating room
+   for the enumerators only once.  Either all the enumerators are added, or
+   none are.  */
+
+int
+ctf_add_enumerators (ctf_file_t *fp, ctf_id_t enid, const ctf_enumdef_t *enums,
+		     size_t n)
+{
+  ctf_dtdef_t *dtd = ctf_dtd_lookup (fp, enid);
+  ctf_dmdef_t *dmds;
+
+  uint32_t kind, vlen, root;
+  size_t i, len = 0;
+  char *s;
+  int err;
+
+  for (i = 0; i < n; i++)
+    {
+      if (enums[i].cted_name == NULL)
+	return (ctf_set_errno (fp, EINVAL));
+      len += strlen (enums[i].cted_name) + 1;
+    }
+
+  if (!(fp->ctf_flags & LCTF_RDWR))
+    return (ctf_set_errno (fp, ECTF_RDONLY));
+
+  if (dtd == NULL)
+    return (ctf_set_errno (fp, ECTF_BADID));
+
+  kind = LCTF_INFO_KIND (fp, dtd->dtd_data.ctt_info);
+  root = LCTF_INFO_ISROOT (fp, dtd->dtd_data.ctt_info);
+  vlen = LCTF_INFO_VLEN (fp, dtd->dtd_data.ctt_info);
+
+  if (kind != CTF_K_ENUM)
+    return (ctf_set_errno (fp, ECTF_NOTENUM));
+
+  if (n > CTF_MAX_VLEN - vlen)
+    return (ctf_set_errno (fp, ECTF_DTFULL));
+
+  if (n == 0)
+    return 0;
+
+  if ((dmds = ctf_arena_alloc (&fp->ctf_arena, n * sizeof (ctf_dmdef_t)))
+      == NULL
+      || (s = ctf_arena_alloc (&fp->ctf_arena, len)) == NULL
+      || ctf_dynhash_reserve (fp->ctf_dmhash, n) != 0)
+    return (ctf_set_errno (fp, EAGAIN));
+
+  for (i = 0; i < n; i++)
+    {
+      ctf_dmdef_t *dmd = &dmds[i];
+
+      dmd->dmd_name = strcpy (s, enums[i].cted_name);
+      s += strlen (s) + 1;
+      dmd->dmd_type = CTF_ERR;
+      dmd->dmd_offset = 0;
+      dmd->dmd_value = enums[i].cted_value;
+
+      if ((err = ctf_dmd_insert_new (fp, dtd, dmd)) != 0)
+	goto err;
+    }
+
+  dtd->dtd_data.ctt_info = CTF_TYPE_INFO (kind, root, vlen + n);
+
+  ctf_dtd_dirty (fp, dtd);
+  ctf_dtd_pin (fp, dtd);
+  return 0;
+
+err:
+  ctf_dmd_unwind (fp, dtd, i);
+  return (ctf_set_errno (fp, err));
+}
+
+/* Return the number of bits a member of the given TYPE takes up, for placing
+   the member after it: the width of integers and floats, and the size of
+   anything else.  */
+
+static size_t
+ctf_member_bits (ctf_file_t *fp, ctf_id_t type)
+{
+  ctf_id_t rtype = ctf_type_resolve (fp, type);
+  ctf_encoding_t enc;
+  ssize_t size;
+
+  if (ctf_type_encoding (fp, rtype, &enc) != CTF_ERR)
+    return enc.cte_bits;
+  else if ((size = ctf_type_size (fp, rtype)) != CTF_ERR)
+    return size * NBBY;
+
+  return 0;
+}
+
+/* Return the offset in bits of a member of size MSIZE and alignment MALIGN
+   added to a struct or union of the given KIND with VLEN members, and update
+   its size in *SSIZEP.  The member goes at BIT_OFFSET or, if that is -1, at the
+   next suitably aligned byte after LASTEND, the end of the last member.  */
+
+static unsigned long
+ctf_member_place (uint32_t kind, uint32_t vlen, unsigned long bit_offset,
+		  ssize_t msize, ssize_t malign, size_t lastend,
+		  ssize_t *ssizep)
+{
+  size_t off;
+
+  if (kind != CTF_K_STRUCT || vlen == 0)
+    {
+      *ssizep = MAX (*ssizep, msize);
+      return 0;
+    }
+
+  if (bit_offset != (unsigned long) - 1)
+    {
+      /* Specified offset in bits.  */
+
+      *ssizep = MAX (*ssizep, (ssize_t) (bit_offset / NBBY) + msize);
+      return bit_offset;
+    }
+
+  /* Natural alignment.  Round up the offset of the end of the last member to
+     the next byte boundary, convert 'off' to bytes, and then round it up
+     again to the next multiple of the alignment required by the new member.
+     Finally, convert back to bits.  Technically we could do more efficient
+     packing if the new member is a bit-field, but we're the "compiler" and
+     ANSI says we can do as we choose.  */
+
+  off = roundup (lastend, NBBY) / NBBY;
+  off = roundup (off, MAX (malign, 1));
+  *ssizep = off + msize;
+  return off * NBBY;
+}
+
+/* Set the size of the struct or union DTD.  */
+
+static void
+ctf_dtd_set_size (ctf_dtdef_t *dtd, ssize_t ssize)
+{
+  if (ssize > CTF_MAX_SIZE)
+    {
+      dtd->dtd_data.ctt_size = CTF_LSIZE_SENT;
+      dtd->dtd_data.ctt_lsizehi = CTF_SIZE_TO_LSIZE_HI (ssize);
+      dtd->dtd_data.ctt_lsizelo = CTF_SIZE_TO_LSIZE_LO (ssize);
+    }
+  else
+    dtd->dtd_data.ctt_size = (uint32_t) ssize;
+}
+
+int
+ctf_add_member_offset (ctf_file_t *fp, ctf_id_t souid, const char *name,
+		       ctf_id_t type, unsigned long bit_offset)
+{
+  ctf_dtdef_t *dtd = ctf_dtd_lookup (fp, souid);
+  ctf_dmdef_t *dmd;
+
+  ssize_t msize, malign, ssize;
+  uint32_t kind, vlen, root;
+  size_t lastend = 0;
+  char *s = NULL;
+  int err;
+
+  if (!(fp->ctf_flags & LCTF_RDWR))
+    return (ctf_set_errno (fp, ECTF_RDONLY));
+
+  if (dtd == NULL)
+    return (ctf_set_errno (fp, ECTF_BADID));
+
+  kind = LCTF_INFO_KIND (fp, dtd->dtd_data.ctt_info);
+  root = LCTF_INFO_ISROOT (fp, dtd->dtd_data.ctt_info);
+  vlen = LCTF_INFO_VLEN (fp, dtd->dtd_data.ctt_info);
+
+  if (kind != CTF_K_STRUCT && kind != CTF_K_UNION)
+    return (ctf_set_errno (fp, ECTF_NOTSOU));
 
-  switch (kind)
-    {
-    case CTF_K_STRUCT:
-      hp = &fp->ctf_structs;
-      break;
-    case CTF_K_UNION:
-      hp = &fp->ctf_unions;
-      break;
-    case CTF_K_ENUM:
-      hp = &fp->ctf_enums;
-      break;
-    default:
-      return (ctf_set_errno (fp, ECTF_NOTSUE));
-    }
+  if (vlen == CTF_MAX_VLEN)
+    return (ctf_set_errno (fp, ECTF_DTFULL));
 
-  /* If the type is already defined or exists as a forward tag, just
-     return the ctf_id_t of the existing definition.  */
-  if (name != NULL && (hep = ctf_hash_lookup (hp, fp, name,
-					      strlen (name))) != NULL)
-    return hep->h_type;
+  if (name != NULL && ctf_dmd_exists (fp, dtd, name))
+    return (ctf_set_errno (fp, ECTF_DUPLICATE));
 
-  if ((type = ctf_add_generic (fp, flag, name, &dtd)) == CTF_ERR)
+  if ((msize = ctf_type_size (fp, type)) == CTF_ERR ||
+      (malign = ctf_type_align (fp, type)) == CTF_ERR)
     return CTF_ERR;		/* errno is set for us.  */
 
-  dtd->dtd_data.ctt_info = CTF_TYPE_INFO (CTF_K_FORWARD, flag, 0);
-  dtd->dtd_data.ctt_type = kind;
+  if ((dmd = ctf_arena_alloc (&fp->ctf_arena, sizeof (ctf_dmdef_t))) == NULL)
+    return (ctf_set_errno (fp, EAGAIN));
 
-  return type;
-}
+  if (name != NULL && (s = ctf_arena_strdup (&fp->ctf_arena, name)) == NULL)
+    return (ctf_set_errno (fp, EAGAIN));
 
-ctf_id_t
-ctf_add_typedef (ctf_file_t *fp, uint32_t flag, const char *name,
-		 ctf_id_t ref)
-{
-  ctf_dtdef_t *dtd;
-  ctf_id_t type;
+  dmd->dmd_name = s;
+  dmd->dmd_type = type;
+  dmd->dmd_value = -1;
 
-  if (ref == CTF_ERR || ref < 0 || ref > CTF_MAX_TYPE)
-    return (ctf_set_errno (fp, EINVAL));
+  if (kind == CTF_K_STRUCT && vlen != 0 && bit_offset == (unsigned long) - 1)
+    {
+      ctf_dmdef_t *lmd = ctf_list_prev (&dtd->dtd_u.dtu_members);
 
-  if ((type = ctf_add_generic (fp, flag, name, &dtd)) == CTF_ERR)
-    return CTF_ERR;		/* errno is set for us.  */
+      lastend = lmd->dmd_offset + ctf_member_bits (fp, lmd->dmd_type);
+    }
 
-  dtd->dtd_data.ctt_info = CTF_TYPE_INFO (CTF_K_TYPEDEF, flag, 0);
-  dtd->dtd_data.ctt_type = (uint32_t) ref;
+  ssize = ctf_get_ctt_size (fp, &dtd->dtd_data, NULL, NULL);
+  dmd->dmd_offset = ctf_member_place (kind, vlen, bit_offset, msize, malign,
+				      lastend, &ssize);
 
-  return type;
-}
+  if ((err = ctf_dmd_insert (fp, dtd, dmd)) != 0)
+    return (ctf_set_errno (fp, err));
 
-ctf_id_t
-ctf_add_volatile (ctf_file_t *fp, uint32_t flag, ctf_id_t ref)
-{
-  return (ctf_add_reftype (fp, flag, ref, CTF_K_VOLATILE));
-}
+  ctf_dtd_set_size (dtd, ssize);
+  dtd->dtd_data.ctt_info = CTF_TYPE_INFO (kind, root, vlen + 1);
 
-ctf_id_t
-ctf_add_const (ctf_file_t *fp, uint32_t flag, ctf_id_t ref)
-{
-  return (ctf_add_reftype (fp, flag, ref, CTF_K_CONST));
+  ctf_dtd_dirty (fp, dtd);
+  ctf_dtd_pin (fp, dtd);
+  return 0;
 }
 
-ctf_id_t
-ctf_add_restrict (ctf_file_t *fp, uint32_t flag, ctf_id_t ref)
+int
+ctf_add_member (ctf_file_t *fp, ctf_id_t souid, const char *name,
+		ctf_id_t type)
 {
-  return (ctf_add_reftype (fp, flag, ref, CTF_K_RESTRICT));
+  return ctf_add_member_offset (fp, souid, name, type, (unsigned long) - 1);
 }
 
+/* Append a member at BIT_OFFSET to the struct or union SOUID, leaving its size
+   alone.  Unlike ctf_add_member_offset(), TYPE is not looked at, so it need
+   not have been committed, or even added yet: this is for callers copying
+   whole structures whose sizes they already know.  */
+
 int
-ctf_add_enumerator (ctf_file_t *fp, ctf_id_t enid, const char *name,
-		    int value)
+ctf_add_member_raw (ctf_file_t *fp, ctf_id_t souid, const char *name,
+		    ctf_id_t type, unsigned long bit_offset)
 {
-  ctf_dtdef_t *dtd = ctf_dtd_lookup (fp, enid);
+  ctf_dtdef_t *dtd = ctf_dtd_lookup (fp, souid);
   ctf_dmdef_t *dmd;
-
   uint32_t kind, vlen, root;
-  char *s;
-
-  if (name == NULL)
-    return (ctf_set_errno (fp, EINVAL));
+  char *s = NULL;
+  int err;
 
   if (!(fp->ctf_flags & LCTF_RDWR))
     return (ctf_set_errno (fp, ECTF_RDONLY));
@@ -1084,52 +2472,55 @@ ctf_add_enumerator (ctf_file_t *fp, ctf_id_t enid, const char *name,
   root = LCTF_INFO_ISROOT (fp, dtd->dtd_data.ctt_info);
   vlen = LCTF_INFO_VLEN (fp, dtd->dtd_data.ctt_info);
 
-  if (kind != CTF_K_ENUM)
-    return (ctf_set_errno (fp, ECTF_NOTENUM));
+  if (kind != CTF_K_STRUCT && kind != CTF_K_UNION)
+    return (ctf_set_errno (fp, ECTF_NOTSOU));
 
   if (vlen == CTF_MAX_VLEN)
     return (ctf_set_errno (fp, ECTF_DTFULL));
 
-  for (dmd = ctf_list_next (&dtd->dtd_u.dtu_members);
-       dmd != NULL; dmd = ctf_list_next (dmd))
-    {
-      if (strcmp (dmd->dmd_name, name) == 0)
-	return (ctf_set_errno (fp, ECTF_DUPLICATE));
-    }
+  if (name != NULL && ctf_dmd_exists (fp, dtd, name))
+    return (ctf_set_errno (fp, ECTF_DUPLICATE));
 
-  if ((dmd = ctf_alloc (sizeof (ctf_dmdef_t))) == NULL)
+  if ((dmd = ctf_arena_alloc (&fp->ctf_arena, sizeof (ctf_dmdef_t))) == NULL)
     return (ctf_set_errno (fp, EAGAIN));
 
-  if ((s = ctf_strdup (name)) == NULL)
-    {
-      ctf_free (dmd, sizeof (ctf_dmdef_t));
-      return (ctf_set_errno (fp, EAGAIN));
-    }
+  if (name != NULL && (s = ctf_arena_strdup (&fp->ctf_arena, name)) == NULL)
+    return (ctf_set_errno (fp, EAGAIN));
 
   dmd->dmd_name = s;
-  dmd->dmd_type = CTF_ERR;
-  dmd->dmd_offset = 0;
-  dmd->dmd_value = value;
+  dmd->dmd_type = type;
+  dmd->dmd_offset = kind == CTF_K_STRUCT ? bit_offset : 0;
+  dmd->dmd_value = -1;
 
-  dtd->dtd_data.ctt_info = CTF_TYPE_INFO (kind, root, vlen + 1);
-  ctf_list_append (&dtd->dtd_u.dtu_members, dmd);
+  if ((err = ctf_dmd_insert (fp, dtd, dmd)) != 0)
+    return (ctf_set_errno (fp, err));
 
-  fp->ctf_dtvstrlen += strlen (s) + 1;
-  fp->ctf_flags |= LCTF_DIRTY;
+  dtd->dtd_data.ctt_info = CTF_TYPE_INFO (kind, root, vlen + 1);
 
+  ctf_dtd_dirty (fp, dtd);
+  ctf_dtd_pin (fp, dtd);
   return 0;
 }
 
+/* Add the N members in MEMBERS to the struct or union SOUID, as if by one call
+   to ctf_add_member_offset() for each, but looking the struct up and allocating
+   room for the members only once, checking for duplicate names as they are
+   hashed, and placing naturally-aligned members after the ones before them
+   without looking the earlier ones up again.
+   Either all the members are added, or none are.  */
+
 int
-ctf_add_member_offset (ctf_file_t *fp, ctf_id_t souid, const char *name,
-		       ctf_id_t type, unsigned long bit_offset)
+ctf_add_members (ctf_file_t *fp, ctf_id_t souid, const ctf_membdef_t *members,
+		 size_t n)
 {
   ctf_dtdef_t *dtd = ctf_dtd_lookup (fp, souid);
-  ctf_dmdef_t *dmd;
+  ctf_dmdef_t *dmds;
 
   ssize_t msize, malign, ssize;
   uint32_t kind, vlen, root;
-  char *s = NULL;
+  size_t i, len = 0, named = 0, lastend = 0, lbits = 0;
+  char *s;
+  int err;
 
   if (!(fp->ctf_flags & LCTF_RDWR))
     return (ctf_set_errno (fp, ECTF_RDONLY));
@@ -1144,108 +2535,95 @@ ctf_add_member_offset (ctf_file_t *fp, ctf_id_t souid, const char *name,
   if (kind != CTF_K_STRUCT && kind != CTF_K_UNION)
     return (ctf_set_errno (fp, ECTF_NOTSOU));
 
-  if (vlen == CTF_MAX_VLEN)
+  if (n > CTF_MAX_VLEN - vlen)
     return (ctf_set_errno (fp, ECTF_DTFULL));
 
-  if (name != NULL)
+  if (n == 0)
+    return 0;
+
+  for (i = 0; i < n; i++)
     {
-      for (dmd = ctf_list_next (&dtd->dtd_u.dtu_members);
-	   dmd != NULL; dmd = ctf_list_next (dmd))
+      if (members[i].ctmd_name != NULL)
 	{
-	  if (dmd->dmd_name != NULL && strcmp (dmd->dmd_name, name) == 0)
-	    return (ctf_set_errno (fp, ECTF_DUPLICATE));
+	  len += strlen (members[i].ctmd_name) + 1;
+	  named++;
 	}
     }
 
-  if ((msize = ctf_type_size (fp, type)) == CTF_ERR ||
-      (malign = ctf_type_align (fp, type)) == CTF_ERR)
-    return CTF_ERR;		/* errno is set for us.  */
-
-  if ((dmd = ctf_alloc (sizeof (ctf_dmdef_t))) == NULL)
+  if ((dmds = ctf_arena_alloc (&fp->ctf_arena, n * sizeof (ctf_dmdef_t)))
+      == NULL
+      || (s = ctf_arena_alloc (&fp->ctf_arena, MAX (len, 1))) == NULL
+      || ctf_dynhash_reserve (fp->ctf_dmhash, named) != 0)
     return (ctf_set_errno (fp, EAGAIN));
 
-  if (name != NULL && (s = ctf_strdup (name)) == NULL)
-    {
-      ctf_free (dmd, sizeof (ctf_dmdef_t));
-      return (ctf_set_errno (fp, EAGAIN));
-    }
-
-  dmd->dmd_name = s;
-  dmd->dmd_type = type;
-  dmd->dmd_value = -1;
+  ssize = ctf_get_ctt_size (fp, &dtd->dtd_data, NULL, NULL);
 
-  if (kind == CTF_K_STRUCT && vlen != 0)
+  for (i = 0; i < n; i++)
     {
-      if (bit_offset == (unsigned long) - 1)
+      const ctf_membdef_t *md = &members[i];
+      ctf_dmdef_t *dmd = &dmds[i];
+
+      if ((msize = ctf_type_size (fp, md->ctmd_type)) == CTF_ERR
+	  || (malign = ctf_type_align (fp, md->ctmd_type)) == CTF_ERR)
 	{
-	  /* Natural alignment.  */
-
-	  ctf_dmdef_t *lmd = ctf_list_prev (&dtd->dtd_u.dtu_members);
-	  ctf_id_t ltype = ctf_type_resolve (fp, lmd->dmd_type);
-	  size_t off = lmd->dmd_offset;
-
-	  ctf_encoding_t linfo;
-	  ssize_t lsize;
-
-	  if (ctf_type_encoding (fp, ltype, &linfo) != CTF_ERR)
-	    off += linfo.cte_bits;
-	  else if ((lsize = ctf_type_size (fp, ltype)) != CTF_ERR)
-	    off += lsize * NBBY;
-
-	  /* Round up the offset of the end of the last member to
-	     the next byte boundary, convert 'off' to bytes, and
-	     then round it up again to the next multiple of the
-	     alignment required by the new member.  Finally,
-	     convert back to bits and store the result in
-	     dmd_offset.  Technically we could do more efficient
-	     packing if the new member is a bit-field, but we're
-	     the "compiler" and ANSI says we can do as we choose.  */
-
-	  off = roundup (off, NBBY) / NBBY;
-	  off = roundup (off, MAX (malign, 1));
-	  dmd->dmd_offset = off * NBBY;
-	  ssize = off + msize;
+	  err = ctf_errno (fp);
+	  goto err;
 	}
-      else
+
+      if (kind == CTF_K_STRUCT && vlen + i != 0
+	  && md->ctmd_offset == (unsigned long) - 1)
 	{
-	  /* Specified offset in bits.  */
+	  if (i == 0)
+	    {
+	      ctf_dmdef_t *lmd = ctf_list_prev (&dtd->dtd_u.dtu_members);
 
-	  dmd->dmd_offset = bit_offset;
-	  ssize = ctf_get_ctt_size (fp, &dtd->dtd_data, NULL, NULL);
-	  ssize = MAX (ssize, (bit_offset / NBBY) + msize);
+	      lastend = lmd->dmd_offset + ctf_member_bits (fp, lmd->dmd_type);
+	    }
+	  else
+	    lastend = dmds[i - 1].dmd_offset + lbits;
 	}
-    }
-  else
-    {
-      dmd->dmd_offset = 0;
-      ssize = ctf_get_ctt_size (fp, &dtd->dtd_data, NULL, NULL);
-      ssize = MAX (ssize, msize);
-    }
 
-  if (ssize > CTF_MAX_SIZE)
-    {
-      dtd->dtd_data.ctt_size = CTF_LSIZE_SENT;
-      dtd->dtd_data.ctt_lsizehi = CTF_SIZE_TO_LSIZE_HI (ssize);
-      dtd->dtd_data.ctt_lsizelo = CTF_SIZE_TO_LSIZE_LO (ssize);
-    }
-  else
-    dtd->dtd_data.ctt_size = (uint32_t) ssize;
+      dmd->dmd_name = NULL;
+      if (md->ctmd_name != NULL)
+	{
+	  dmd->dmd_name = strcpy (s, md->ctmd_name);
+	  s += strlen (s) + 1;
+	}
 
-  dtd->dtd_data.ctt_info = CTF_TYPE_INFO (kind, root, vlen + 1);
-  ctf_list_append (&dtd->dtd_u.dtu_members, dmd);
+      dmd->dmd_type = md->ctmd_type;
+      dmd->dmd_value = -1;
+      dmd->dmd_offset = ctf_member_place (kind, vlen + i, md->ctmd_offset,
+					  msize, malign, lastend, &ssize);
 
-  if (s != NULL)
-    fp->ctf_dtvstrlen += strlen (s) + 1;
+      if ((err = ctf_dmd_insert_new (fp, dtd, dmd)) != 0)
+	goto err;
 
-  fp->ctf_flags |= LCTF_DIRTY;
+      /* The next member may need to know where this one ends.  The size of the
+	 member is already known, so only integers and floats need a look.  */
+
+      if (kind == CTF_K_STRUCT && i + 1 < n
+	  && members[i + 1].ctmd_offset == (unsigned long) - 1)
+	{
+	  ctf_encoding_t enc;
+
+	  if (ctf_type_encoding (fp, ctf_type_resolve (fp, md->ctmd_type),
+				 &enc) != CTF_ERR)
+	    lbits = enc.cte_bits;
+	  else
+	    lbits = msize * NBBY;
+	}
+    }
+
+  ctf_dtd_set_size (dtd, ssize);
+  dtd->dtd_data.ctt_info = CTF_TYPE_INFO (kind, root, vlen + n);
+
+  ctf_dtd_dirty (fp, dtd);
+  ctf_dtd_pin (fp, dtd);
   return 0;
-}
 
-int
-ctf_add_member (ctf_file_t *fp, ctf_id_t souid, const char *name,
-		ctf_id_t type)
-{
-  return ctf_add_member_offset (fp, souid, name, type, (unsigned long) - 1);
+err:
+  ctf_dmd_unwind (fp, dtd, i);
+  return (ctf_set_errno (fp, err));
 }
 
 int
@@ -1259,20 +2637,18 @@ ctf_add_variable (ctf_file_t *fp, const char *name, ctf_id_t ref)
   if (ctf_dvd_lookup (fp, name) != NULL)
     return (ctf_set_errno (fp, ECTF_DUPLICATE));
 
-  if ((dvd = ctf_alloc (sizeof (ctf_dvdef_t))) == NULL)
+  if ((dvd = ctf_arena_alloc (&fp->ctf_arena, sizeof (ctf_dvdef_t))) == NULL)
     return (ctf_set_errno (fp, EAGAIN));
 
-  if (name != NULL && (dvd->dvd_name = ctf_strdup (name)) == NULL)
-    {
-      ctf_free (dvd, sizeof (ctf_dvdef_t));
-      return (ctf_set_errno (fp, EAGAIN));
-    }
+  if (name != NULL
+      && (dvd->dvd_name = ctf_arena_strdup (&fp->ctf_arena, name)) == NULL)
+    return (ctf_set_errno (fp, EAGAIN));
   dvd->dvd_type = ref;
   dvd->dvd_snapshots = fp->ctf_snapshots;
 
-  ctf_dvd_insert (fp, dvd);
+  if (ctf_dvd_insert (fp, dvd) != 0)
+    return (ctf_set_errno (fp, EAGAIN));
 
-  fp->ctf_dtvstrlen += strlen (name) + 1;
   fp->ctf_flags |= LCTF_DIRTY;
   return 0;
 }
@@ -1333,15 +2709,15 @@ membadd (const char *name, ctf_id_t type, unsigned long offset, void *arg)
   ctf_bundle_t *ctb = arg;
   ctf_dmdef_t *dmd;
   char *s = NULL;
+  int err;
 
-  if ((dmd = ctf_alloc (sizeof (ctf_dmdef_t))) == NULL)
+  if ((dmd = ctf_arena_alloc (&ctb->ctb_file->ctf_arena,
+			     sizeof (ctf_dmdef_t))) == NULL)
     return (ctf_set_errno (ctb->ctb_file, EAGAIN));
 
-  if (name != NULL && (s = ctf_strdup (name)) == NULL)
-    {
-      ctf_free (dmd, sizeof (ctf_dmdef_t));
-      return (ctf_set_errno (ctb->ctb_file, EAGAIN));
-    }
+  if (name != NULL
+      && (s = ctf_arena_strdup (&ctb->ctb_file->ctf_arena, name)) == NULL)
+    return (ctf_set_errno (ctb->ctb_file, EAGAIN));
 
   /* For now, dmd_type is copied as the src_fp's type; it is reset to an
     equivalent dst_fp type by a final loop in ctf_add_type(), below.  */
@@ -1350,22 +2726,124 @@ membadd (const char *name, ctf_id_t type, unsigned long offset, void *arg)
   dmd->dmd_offset = offset;
   dmd->dmd_value = -1;
 
-  ctf_list_append (&ctb->ctb_dtd->dtd_u.dtu_members, dmd);
-
-  if (s != NULL)
-    ctb->ctb_file->ctf_dtvstrlen += strlen (s) + 1;
+  if ((err = ctf_dmd_insert (ctb->ctb_file, ctb->ctb_dtd, dmd)) != 0)
+    return (ctf_set_errno (ctb->ctb_file, err));
 
   ctb->ctb_file->ctf_flags |= LCTF_DIRTY;
   return 0;
 }
 
+/* Return the translation table for types copied into DST_FP from SRC_FP,
+   creating it if need be, or NULL if it cannot be.  */
+
+static ctf_srcmap_t *
+ctf_srcmap (ctf_file_t *dst_fp, const ctf_file_t *src_fp)
+{
+  ctf_srcmap_t *csm;
+
+  if (dst_fp->ctf_srcmaps == NULL
+      && (dst_fp->ctf_srcmaps
+	  = ctf_dynhash_create (ctf_hash_integer, ctf_hash_eq_integer)) == NULL)
+    return NULL;
+
+  if ((csm = ctf_dynhash_lookup (dst_fp->ctf_srcmaps, src_fp)) != NULL)
+    {
+      if (csm->csm_serial == src_fp->ctf_serial)
+	return csm;
+
+      /* SRC_FP has changed since: start again.  */
+
+      ctf_dynhash_destroy (csm->csm_types);
+      csm->csm_types = NULL;
+    }
+  else
+    {
+      if ((csm = ctf_alloc (sizeof (ctf_srcmap_t))) == NULL)
+	return NULL;
+
+      memset (csm, 0, sizeof (ctf_srcmap_t));
+      csm->csm_src = src_fp;
+
+      if (ctf_dynhash_insert (dst_fp->ctf_srcmaps, (void *) src_fp, csm) != 0)
+	{
+	  ctf_free (csm, sizeof (ctf_srcmap_t));
+	  return NULL;
+	}
+      ctf_list_append (&dst_fp->ctf_srcmapl, csm);
+    }
+
+  csm->csm_serial = src_fp->ctf_serial;
+  if ((csm->csm_types = ctf_dynhash_create (ctf_hash_integer,
+					    ctf_hash_eq_integer)) == NULL)
+    {
+      ctf_dynhash_remove (dst_fp->ctf_srcmaps, src_fp);
+      ctf_list_delete (&dst_fp->ctf_srcmapl, csm);
+      ctf_free (csm, sizeof (ctf_srcmap_t));
+      return NULL;
+    }
+
+  return csm;
+}
+
+/* Forget every type ctf_add_type() has copied into FP.  */
+
+void
+ctf_srcmap_clear (ctf_file_t *fp)
+{
+  ctf_srcmap_t *csm, *ncsm;
+
+  for (csm = ctf_list_next (&fp->ctf_srcmapl); csm != NULL; csm = ncsm)
+    {
+      ncsm = ctf_list_next (csm);
+      ctf_dynhash_destroy (csm->csm_types);
+      ctf_free (csm, sizeof (ctf_srcmap_t));
+    }
+
+  ctf_dynhash_destroy (fp->ctf_srcmaps);
+  fp->ctf_srcmaps = NULL;
+  memset (&fp->ctf_srcmapl, 0, sizeof (ctf_list_t));
+}
+
+/* Record that SRC_TYPE in the source of CSM has been copied to DST_TYPE.  This
+   is only a cache, so failure to record it is ignored.  */
+
+static void
+ctf_srcmap_add (ctf_srcmap_t *csm, ctf_id_t src_type, ctf_id_t dst_type)
+{
+  if (csm != NULL)
+    (void) ctf_dynhash_insert (csm->csm_types, (void *) (uintptr_t) src_type,
+			       (void *) (uintptr_t) dst_type);
+}
+
+/* Return the type SRC_TYPE in the source of CSM was copied to, or CTF_ERR.  */
+
+static ctf_id_t
+ctf_srcmap_lookup (ctf_srcmap_t *csm, ctf_id_t src_type)
+{
+  void *dst_type;
+
+  if (csm == NULL || (dst_type = ctf_dynhash_lookup (csm->csm_types,
+						     (void *) (uintptr_t)
+						     src_type)) == NULL)
+    return CTF_ERR;
+
+  return (ctf_id_t) (uintptr_t) dst_type;
+}
+
 /* The ctf_add_type routine is used to copy a type from a source CTF container
    to a dynamic destination container.  This routine operates recursively by
    following the source type's links and embedded member types.  If the
    destination container already contains a named type which has the same
-   attributes, then we succeed and return this type but no changes occur.  */
-ctf_id_t
-ctf_add_type (ctf_file_t *dst_fp, ctf_file_t *src_fp, ctf_id_t src_type)
+   attributes, then we succeed and return this type but no changes occur.
+
+   Each type copied is recorded in the translation table CSM of types from
+   SRC_FP, so that copying it again, directly or as part of another type, finds
+   it straight away.  Structs and unions are recorded before their members are
+   copied, so members that refer back to them do not copy them again.  */
+
+static ctf_id_t
+ctf_add_type_internal (ctf_file_t *dst_fp, ctf_file_t *src_fp,
+		       ctf_id_t src_type, ctf_srcmap_t *csm)
 {
   ctf_id_t dst_type = CTF_ERR;
   uint32_t dst_kind = CTF_K_UNKNOWN;
@@ -1385,9 +2863,6 @@ ctf_add_type (ctf_file_t *dst_fp, ctf_file_t *src_fp, ctf_id_t src_type)
   ctf_hash_t *hp;
   ctf_helem_t *hep;
 
-  if (!(dst_fp->ctf_flags & LCTF_RDWR))
-    return (ctf_set_errno (dst_fp, ECTF_RDONLY));
-
   if ((src_tp = ctf_lookup_by_id (&src_fp, src_type)) == NULL)
     return (ctf_set_errno (dst_fp, ctf_errno (src_fp)));
 
@@ -1492,20 +2967,50 @@ ctf_add_type (ctf_file_t *dst_fp, ctf_file_t *src_fp, ctf_id_t src_type)
     }
 
   /* If the non-empty name was not found in the appropriate hash, search
-     the list of pending dynamic definitions that are not yet committed.
-     If a matching name and kind are found, assume this is the type that
+     the pending dynamic definitions of that name that are not yet committed,
+     newest first.  If a matching kind is found, assume this is the type that
      we are looking for.  This is necessary to permit ctf_add_type() to
      operate recursively on entities such as a struct that contains a
-     pointer member that refers to the same struct type.  */
+     pointer member that refers to the same struct type.
+
+     Forwards are always added as struct forwards below, but may also have
+     been added for unions or enums by ctf_add_forward(), so any forward of
+     that name will do, in whichever tag namespace it is.  */
+
+  if (dst_type == CTF_ERR && name[0] != '\0' && kind == CTF_K_FORWARD)
+    {
+      static const int fwd_ns[] = { CTF_INDEX_STRUCTS, CTF_INDEX_UNIONS,
+				    CTF_INDEX_ENUMS };
+      ctf_dtdef_t *fwd = NULL;
+      size_t i;
+
+      for (i = 0; i < sizeof (fwd_ns) / sizeof (fwd_ns[0]); i++)
+	for (dtd = ctf_dtd_lookup_name (dst_fp, fwd_ns[i], name);
+	     dtd != NULL && (LCTF_TYPE_TO_INDEX (src_fp, dtd->dtd_type)
+			     > dst_fp->ctf_dtoldid);
+	     dtd = dtd->dtd_nameprev)
+	  {
+	    if (LCTF_INFO_KIND (src_fp, dtd->dtd_data.ctt_info) == kind)
+	      {
+		if (fwd == NULL || LCTF_TYPE_TO_INDEX (src_fp, dtd->dtd_type)
+		    > LCTF_TYPE_TO_INDEX (src_fp, fwd->dtd_type))
+		  fwd = dtd;
+		break;
+	      }
+	  }
 
-  if (dst_type == CTF_ERR && name[0] != '\0')
+      if (fwd != NULL)
+	return fwd->dtd_type;
+    }
+  else if (dst_type == CTF_ERR && name[0] != '\0')
     {
-      for (dtd = ctf_list_prev (&dst_fp->ctf_dtdefs); dtd != NULL
+      int ns = ctf_name_space (kind, src_tp->ctt_type);
+
+      for (dtd = ctf_dtd_lookup_name (dst_fp, ns, name); dtd != NULL
 	     && LCTF_TYPE_TO_INDEX (src_fp, dtd->dtd_type) > dst_fp->ctf_dtoldid;
-	   dtd = ctf_list_prev (dtd))
+	   dtd = dtd->dtd_nameprev)
 	{
-	  if (LCTF_INFO_KIND (src_fp, dtd->dtd_data.ctt_info) == kind
-	      && dtd->dtd_name != NULL && strcmp (dtd->dtd_name, name) == 0)
+	  if (LCTF_INFO_KIND (src_fp, dtd->dtd_data.ctt_info) == kind)
 	    {
 	      int sroot;	/* Is the src root-visible?  */
 	      int droot;	/* Is the dst root-visible?  */
@@ -1585,7 +3090,7 @@ ctf_add_type (ctf_file_t *dst_fp, ctf_file_t *src_fp, ctf_id_t src_type)
       if (src_type == CTF_ERR)
 	return CTF_ERR;				/* errno is set for us.  */
 
-      dst_type = ctf_add_reftype (dst_fp, flag, src_type, kind);
+      dst_type = ctf_add_reftype (dst_fp, flag, NULL, src_type, kind);
       break;
 
     case CTF_K_ARRAY:
@@ -1671,10 +3176,12 @@ ctf_add_type (ctf_file_t *dst_fp, ctf_file_t *src_fp, ctf_id_t src_type)
 	   manually so as to avoid repeated lookups in ctf_add_member
 	   and to ensure the exact same member offsets as in src_type.  */
 
-	dst_type = ctf_add_generic (dst_fp, flag, name, &dtd);
+	dst_type = ctf_add_generic (dst_fp, flag, name, kind, &dtd);
 	if (dst_type == CTF_ERR)
 	  return CTF_ERR;			/* errno is set for us.  */
 
+	ctf_srcmap_add (csm, src_type, dst_type);
+
 	dst.ctb_type = dst_type;
 	dst.ctb_dtd = dtd;
 
@@ -1704,7 +3211,12 @@ ctf_add_type (ctf_file_t *dst_fp, ctf_file_t *src_fp, ctf_id_t src_type)
 	  }
 
 	if (errs)
-	  return CTF_ERR;			/* errno is set for us.  */
+	  {
+	    if (csm != NULL)
+	      ctf_dynhash_remove (csm->csm_types,
+				  (void *) (uintptr_t) src_type);
+	    return CTF_ERR;			/* errno is set for us.  */
+	  }
 	break;
       }
 
@@ -1763,3 +3275,23 @@ ctf_add_type (ctf_file_t *dst_fp, ctf_file_t *src_fp, ctf_id_t src_type)
 
   return dst_type;
 }
+
+ctf_id_t
+ctf_add_type (ctf_file_t *dst_fp, ctf_file_t *src_fp, ctf_id_t src_type)
+{
+  ctf_srcmap_t *csm;
+  ctf_id_t dst_type;
+
+  if (!(dst_fp->ctf_flags & LCTF_RDWR))
+    return (ctf_set_errno (dst_fp, ECTF_RDONLY));
+
+  csm = ctf_srcmap (dst_fp, src_fp);
+  if ((dst_type = ctf_srcmap_lookup (csm, src_type)) != CTF_ERR)
+    return dst_type;
+
+  dst_type = ctf_add_type_internal (dst_fp, src_fp, src_type, csm);
+  if (dst_type != CTF_ERR)
+    ctf_srcmap_add (csm, src_type, dst_type);
+
+  return dst_type;
+}
@@ -8,47 +8,72 @@
    COPYING in the top level of this tree.  */
 
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/auxv.h>
 #include <ctf-impl.h>
 
-static const unsigned short _CTF_EMPTY[1] = { 0 };
-
-/* TODO: switch to a proper expanding hash table implementation.  */
+static const uint32_t _CTF_EMPTY[1] = { 0 };
 
 /* XXX before GNUizing: add an abstraction layer so that libiberty hashtab can
    supplant this.  */
 
+/* The smallest number of slots that holds NELEMS elements at a load factor of
+   no more than 3/4.  */
+
+static uint64_t
+ctf_hash_nbuckets (uint64_t nelems)
+{
+  uint64_t nbuckets = 16;
+
+  while (nbuckets * 3 < nelems * 4)
+    nbuckets <<= 1;
+
+  return nbuckets;
+}
+
 int
 ctf_hash_create (ctf_hash_t *hp, unsigned long nelems)
 {
-  if (nelems > UINT32_MAX)
+  uint64_t nbuckets;
+
+  /* We use index zero as a sentinel, so can hold one fewer element than
+     the maximum index, and the slot array must be addressable with a uint32_t
+     mask.  */
+
+  if (nelems >= UINT32_MAX / 2)
     return EOVERFLOW;
 
+  memset (hp, 0, sizeof (ctf_hash_t));
+  hp->h_free = 1;		/* First free element is index 1.  */
+  hp->h_seed = _libctf_hash_seed;
+
   /* If the hash table is going to be empty, don't bother allocating any
-     memory and make the only bucket point to a zero so lookups fail.  */
+     memory and make the only slot point to a zero so lookups fail.  The first
+     insertion, if any, will grow it.  */
 
   if (nelems == 0)
     {
-      memset (hp, 0, sizeof (ctf_hash_t));
-      hp->h_buckets = (unsigned short *) _CTF_EMPTY;
+      hp->h_buckets = (uint32_t *) _CTF_EMPTY;
       hp->h_nbuckets = 1;
       return 0;
     }
 
-  hp->h_nbuckets = 8191;	/* Use a prime number of hash buckets.  */
-  hp->h_nelems = nelems + 1;	/* We use index zero as a sentinel.  */
-  hp->h_free = 1;		/* First free element is index 1.  */
+  nbuckets = ctf_hash_nbuckets (nelems);
+  hp->h_nbuckets = (uint32_t) nbuckets;
+  hp->h_nelems = nelems + 1;
 
-  hp->h_buckets = ctf_alloc (sizeof (unsigned short) * hp->h_nbuckets);
-  hp->h_chains = ctf_alloc (sizeof (ctf_helem_t) * hp->h_nelems);
+  hp->h_buckets = ctf_alloc (sizeof (uint32_t) * hp->h_nbuckets);
+  hp->h_elems = ctf_alloc (sizeof (ctf_helem_t) * hp->h_nelems);
 
-  if (hp->h_buckets == NULL || hp->h_chains == NULL)
+  if (hp->h_buckets == NULL || hp->h_elems == NULL)
     {
       ctf_hash_destroy (hp);
       return EAGAIN;
     }
 
-  memset (hp->h_buckets, 0, sizeof (unsigned short) * hp->h_nbuckets);
-  memset (hp->h_chains, 0, sizeof (ctf_helem_t) * hp->h_nelems);
+  memset (hp->h_buckets, 0, sizeof (uint32_t) * hp->h_nbuckets);
+  memset (hp->h_elems, 0, sizeof (ctf_helem_t) * hp->h_nelems);
 
   return 0;
 }
@@ -56,116 +81,695 @@ ctf_hash_create (ctf_hash_t *hp, unsigned long nelems)
 uint32_t
 ctf_hash_size (const ctf_hash_t *hp)
 {
-  return (hp->h_nelems ? hp->h_nelems - 1 : 0);
+  return (hp->h_free ? hp->h_free - 1 : 0);
+}
+
+/* Per-process hash seed, set up by _libctf_init(), so that the layout of the
+   hashes cannot be predicted from the contents of a CTF file.  */
+
+uint64_t _libctf_hash_seed;
+
+/* The final avalanche step of MurmurHash3's 64-bit hash.  */
+
+static uint64_t
+ctf_hash_mix (uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+
+  return h;
+}
+
+/* Hash a string a word at a time.  The tail is zero-padded, so the length is
+   folded into the initial state to keep keys of different lengths apart.
+
+   Name indexes in CTF files depend on this function: if it changes,
+   CTF_INDEX_VERSION must be bumped.  */
+
+static unsigned long
+ctf_hash_seeded (uint64_t seed, const char *key, size_t len)
+{
+  const unsigned char *p = (const unsigned char *) key;
+  uint64_t h = seed ^ (len * 0x9e3779b97f4a7c15ULL);
+  uint64_t w;
+
+  for (; len >= sizeof (w); p += sizeof (w), len -= sizeof (w))
+    {
+      memcpy (&w, p, sizeof (w));
+      h = (h ^ w) * 0x9fb21c651e98df25ULL;
+      h ^= h >> 29;
+    }
+
+  if (len > 0)
+    {
+      w = 0;
+      memcpy (&w, p, len);
+      h = (h ^ w) * 0x9fb21c651e98df25ULL;
+      h ^= h >> 29;
+    }
+
+  return (unsigned long) ctf_hash_mix (h);
 }
 
 unsigned long
 ctf_hash_compute (const char *key, size_t len)
 {
-  unsigned long g, h = 0;
-  const char *p, *q = key + len;
-  size_t n = 0;
+  return ctf_hash_seeded (_libctf_hash_seed, key, len);
+}
 
-  for (p = key; p < q; p++, n++)
+/* Derive the per-process seed from the random bytes the kernel provides to
+   every process, falling back to ASLR and the clock if they are missing.  */
+
+void
+ctf_hash_seed (void)
+{
+  const uint64_t *rnd = (const uint64_t *) getauxval (AT_RANDOM);
+  uint64_t seed;
+
+  if (rnd != NULL)
+    {
+      uint64_t r[2];
+
+      memcpy (r, rnd, sizeof (r));
+      seed = ctf_hash_mix (r[0] ^ ctf_hash_mix (r[1]));
+    }
+  else
+    seed = ctf_hash_mix ((uint64_t) time (NULL) ^ (uintptr_t) &seed
+			 ^ ((uint64_t) getpid () << 32));
+
+  _libctf_hash_seed = seed;
+}
+
+/* Return the name of a hash element.  */
+
+static const char *
+ctf_hash_name (const ctf_file_t *fp, const ctf_helem_t *hep)
+{
+  const ctf_strs_t *ctsp = &fp->ctf_str[CTF_NAME_STID (hep->h_name)];
+
+  LCTF_CHUNK_STR (fp, ctsp->cts_strs + CTF_NAME_OFFSET (hep->h_name));
+  return (ctsp->cts_strs + CTF_NAME_OFFSET (hep->h_name));
+}
+
+/* Find the slot holding KEY, whose hash value is H, or the empty slot where it
+   should go.  The stored hash values let us skip most non-matching elements
+   without touching the string table.  */
+
+static uint32_t *
+ctf_hash_slot (const ctf_hash_t *hp, const ctf_file_t *fp, const char *key,
+	       size_t len, uint32_t h)
+{
+  uint32_t mask = hp->h_nbuckets - 1;
+  uint32_t i = h & mask;
+  uint32_t n;
+
+  while ((n = hp->h_buckets[i]) != 0)
     {
-      h = (h << 4) + *p;
+      const ctf_helem_t *hep = &hp->h_elems[n];
 
-      if ((g = (h & 0xf0000000)) != 0)
+      if (hep->h_hash == h)
 	{
-	  h ^= (g >> 24);
-	  h ^= g;
+	  const char *str = ctf_hash_name (fp, hep);
+
+	  if (strncmp (key, str, len) == 0 && str[len] == '\0')
+	    break;
 	}
+
+      i = (i + 1) & mask;
     }
 
-  return h;
+  return &hp->h_buckets[i];
 }
 
-int
-ctf_hash_insert (ctf_hash_t * hp, ctf_file_t * fp, uint32_t type,
-		 uint32_t name)
+/* Make sure there is room for one more element, growing the element buffer
+   and rehashing into a larger slot array as needed.  Slots are rehashed from
+   the old slot array, not the element buffer, since elements may have been
+   superseded by later insertions under the same name.  */
+
+static int
+ctf_hash_reserve (ctf_hash_t *hp)
+{
+  if (hp->h_mapped)
+    {
+      uint32_t *buckets;
+      ctf_helem_t *elems;
+
+      buckets = ctf_alloc (sizeof (uint32_t) * hp->h_nbuckets);
+      elems = ctf_alloc (sizeof (ctf_helem_t) * hp->h_nelems);
+
+      if (buckets == NULL || elems == NULL)
+	{
+	  ctf_free (buckets, sizeof (uint32_t) * hp->h_nbuckets);
+	  ctf_free (elems, sizeof (ctf_helem_t) * hp->h_nelems);
+	  return EAGAIN;
+	}
+
+      memcpy (buckets, hp->h_buckets, sizeof (uint32_t) * hp->h_nbuckets);
+      memcpy (elems, hp->h_elems, sizeof (ctf_helem_t) * hp->h_nelems);
+      hp->h_buckets = buckets;
+      hp->h_elems = elems;
+      hp->h_mapped = 0;
+    }
+
+  if (hp->h_free >= hp->h_nelems)
+    {
+      uint64_t nelems = hp->h_nelems < 16 ? 16 : (uint64_t) hp->h_nelems * 2;
+      ctf_helem_t *elems;
+
+      if (nelems >= UINT32_MAX / 2)
+	return EOVERFLOW;
+
+      if ((elems = ctf_alloc (sizeof (ctf_helem_t) * nelems)) == NULL)
+	return EAGAIN;
+
+      if (hp->h_elems != NULL)
+	memcpy (elems, hp->h_elems, sizeof (ctf_helem_t) * hp->h_nelems);
+      memset (elems + hp->h_nelems, 0,
+	      sizeof (ctf_helem_t) * (nelems - hp->h_nelems));
+      ctf_free (hp->h_elems, sizeof (ctf_helem_t) * hp->h_nelems);
+
+      hp->h_elems = elems;
+      hp->h_nelems = (uint32_t) nelems;
+    }
+
+  if ((uint64_t) hp->h_free * 4 > (uint64_t) hp->h_nbuckets * 3)
+    {
+      uint64_t nbuckets = ctf_hash_nbuckets (hp->h_free);
+      uint32_t *obuckets = hp->h_buckets;
+      uint32_t onbuckets = hp->h_nbuckets;
+      uint32_t i, mask;
+
+      if (nbuckets <= hp->h_nbuckets)
+	nbuckets = (uint64_t) hp->h_nbuckets * 2;
+
+      if ((hp->h_buckets = ctf_alloc (sizeof (uint32_t) * nbuckets)) == NULL)
+	{
+	  hp->h_buckets = obuckets;
+	  return EAGAIN;
+	}
+
+      memset (hp->h_buckets, 0, sizeof (uint32_t) * nbuckets);
+      hp->h_nbuckets = (uint32_t) nbuckets;
+      mask = hp->h_nbuckets - 1;
+
+      for (i = 0; i < onbuckets; i++)
+	{
+	  uint32_t n = obuckets[i];
+	  uint32_t j;
+
+	  if (n == 0)
+	    continue;
+
+	  for (j = hp->h_elems[n].h_hash & mask; hp->h_buckets[j] != 0;
+	       j = (j + 1) & mask);
+	  hp->h_buckets[j] = n;
+	}
+
+      if (obuckets != _CTF_EMPTY)
+	ctf_free (obuckets, sizeof (uint32_t) * onbuckets);
+    }
+
+  return 0;
+}
+
+/* Add a new element, hashing its name only once, or not at all if HASHP
+   points to a hash value computed by ctf_hash_compute().  If the key is already
+   present, DEFINE says whether to update the type of the existing element in
+   place, or to add a new one that supersedes it for the purposes of lookup.  */
+
+static int
+ctf_hash_add (ctf_hash_t *hp, ctf_file_t *fp, uint32_t type, uint32_t name,
+	      const uint32_t *hashp, int define)
 {
   ctf_strs_t *ctsp = &fp->ctf_str[CTF_NAME_STID (name)];
   const char *str = ctsp->cts_strs + CTF_NAME_OFFSET (name);
-  ctf_helem_t *hep = &hp->h_chains[hp->h_free];
-  unsigned long h;
+  ctf_helem_t *hep;
+  uint32_t *slot;
+  uint32_t h;
+  size_t len;
+  int err;
 
   if (type == 0)
     return EINVAL;
 
-  if (hp->h_free >= hp->h_nelems)
-    return EOVERFLOW;
-
   if (ctsp->cts_strs == NULL)
     return ECTF_STRTAB;
 
   if (ctsp->cts_len <= CTF_NAME_OFFSET (name))
     return ECTF_BADNAME;
 
+  LCTF_CHUNK_STR (fp, str);
+
   if (str[0] == '\0')
     return 0;		   /* Just ignore empty strings on behalf of caller.  */
 
+  if ((err = ctf_hash_reserve (hp)) != 0)
+    return err;
+
+  len = strlen (str);
+  if (hashp != NULL && hp->h_seed == _libctf_hash_seed)
+    h = *hashp;
+  else
+    h = ctf_hash_seeded (hp->h_seed, str, len);
+  slot = ctf_hash_slot (hp, fp, str, len, h);
+
+  if (define && *slot != 0)
+    {
+      hp->h_elems[*slot].h_type = type;
+      return 0;
+    }
+
+  hep = &hp->h_elems[hp->h_free];
   hep->h_name = name;
   hep->h_type = type;
-  h = ctf_hash_compute (str, strlen (str)) % hp->h_nbuckets;
-  hep->h_next = hp->h_buckets[h];
-  hp->h_buckets[h] = hp->h_free++;
+  hep->h_hash = h;
+  *slot = hp->h_free++;
 
   return 0;
 }
 
-/* Wrapper for ctf_hash_lookup/ctf_hash_insert: if the key is already in the
-   hash, override the previous definition with this new official definition.
-   If the key is not present, then call ctf_hash_insert() and hash it in.  */
+int
+ctf_hash_insert (ctf_hash_t *hp, ctf_file_t *fp, uint32_t type,
+		 uint32_t name)
+{
+  return (ctf_hash_add (hp, fp, type, name, NULL, 0));
+}
+
+/* If the key is already in the hash, override the previous definition with
+   this new official definition.  If the key is not present, hash it in.  */
 int
 ctf_hash_define (ctf_hash_t *hp, ctf_file_t *fp, uint32_t type,
 		 uint32_t name)
 {
-  const char *str = ctf_strptr (fp, name);
-  ctf_helem_t *hep = ctf_hash_lookup (hp, fp, str, strlen (str));
+  return (ctf_hash_add (hp, fp, type, name, NULL, 1));
+}
 
-  if (hep == NULL)
-    return (ctf_hash_insert (hp, fp, type, name));
+/* As ctf_hash_insert() and ctf_hash_define(), for names whose hash value H has
+   already been computed by ctf_hash_compute().  */
 
-  hep->h_type = type;
-  return 0;
+int
+ctf_hash_insert_hashed (ctf_hash_t *hp, ctf_file_t *fp, uint32_t type,
+			uint32_t name, uint32_t h)
+{
+  return (ctf_hash_add (hp, fp, type, name, &h, 0));
+}
+
+int
+ctf_hash_define_hashed (ctf_hash_t *hp, ctf_file_t *fp, uint32_t type,
+			uint32_t name, uint32_t h)
+{
+  return (ctf_hash_add (hp, fp, type, name, &h, 1));
 }
 
 ctf_helem_t *
 ctf_hash_lookup (ctf_hash_t *hp, ctf_file_t *fp, const char *key,
 		 size_t len)
 {
-  ctf_helem_t *hep;
-  ctf_strs_t *ctsp;
-  const char *str;
-  unsigned short i;
+  uint32_t n = *ctf_hash_slot (hp, fp, key, len,
+			      ctf_hash_seeded (hp->h_seed, key, len));
+
+  if (n == 0)
+    return NULL;
+
+  return &hp->h_elems[n];
+}
+
+/* Build DST, hashed with SEED, out of those elements of SRC that lookups can
+   find, in the order in which they were added to SRC.  The result is the same
+   whatever the seed of SRC.  */
+
+int
+ctf_hash_rehash (ctf_hash_t *dst, const ctf_hash_t *src, ctf_file_t *fp,
+		 uint64_t seed)
+{
+  unsigned char *live = NULL;
+  uint32_t i, n = 0;
+  int err;
+
+  if (src->h_free > 1)
+    {
+      if ((live = ctf_alloc (src->h_free)) == NULL)
+	return EAGAIN;
+      memset (live, 0, src->h_free);
+
+      for (i = 0; i < src->h_nbuckets; i++)
+	{
+	  if (src->h_buckets[i] != 0)
+	    {
+	      live[src->h_buckets[i]] = 1;
+	      n++;
+	    }
+	}
+    }
 
-  unsigned long h = ctf_hash_compute (key, len) % hp->h_nbuckets;
+  if ((err = ctf_hash_create (dst, n)) != 0)
+    goto out;
+  dst->h_seed = seed;
 
-  for (i = hp->h_buckets[h]; i != 0; i = hep->h_next)
+  for (i = 1; i < src->h_free; i++)
     {
-      hep = &hp->h_chains[i];
-      ctsp = &fp->ctf_str[CTF_NAME_STID (hep->h_name)];
-      str = ctsp->cts_strs + CTF_NAME_OFFSET (hep->h_name);
+      if (live[i] && (err = ctf_hash_insert (dst, fp, src->h_elems[i].h_type,
+					     src->h_elems[i].h_name)) != 0)
+	{
+	  ctf_hash_destroy (dst);
+	  break;
+	}
+    }
 
-      if (strncmp (key, str, len) == 0 && str[len] == '\0')
-	return hep;
+ out:
+  if (live != NULL)
+    ctf_free (live, src->h_free);
+  return err;
+}
+
+/* Set up HP to use one of the hashes of a CTF name index in place.  STRS is
+   the start of the string table, the index occupies its first LEN bytes, and
+   the first STRLEN bytes hold the strings themselves.  Everything lookups rely
+   upon is checked, so a corrupt index cannot make them read out of bounds or
+   probe forever.  */
+
+int
+ctf_hash_map (ctf_hash_t *hp, const char *strs, size_t len, uint32_t strlen,
+	      const ctf_idxhash_t *cih, uint64_t seed)
+{
+  const uint32_t *buckets;
+  const ctf_idxelem_t *elems;
+  uint32_t i, nempty = 0;
+
+  if (cih->cih_nbuckets == 0
+      || (cih->cih_nbuckets & (cih->cih_nbuckets - 1)) != 0
+      || cih->cih_nelems == 0 || cih->cih_nelems > cih->cih_nbuckets
+      || (cih->cih_bucketoff & 3) != 0 || (cih->cih_elemoff & 3) != 0
+      || (uint64_t) cih->cih_bucketoff
+	 + (uint64_t) cih->cih_nbuckets * sizeof (uint32_t) > len
+      || (uint64_t) cih->cih_elemoff
+	 + (uint64_t) cih->cih_nelems * sizeof (ctf_idxelem_t) > len)
+    return ECTF_CORRUPT;
+
+  buckets = (const uint32_t *) (strs + cih->cih_bucketoff);
+  elems = (const ctf_idxelem_t *) (strs + cih->cih_elemoff);
+
+  for (i = 0; i < cih->cih_nbuckets; i++)
+    {
+      if (buckets[i] >= cih->cih_nelems)
+	return ECTF_CORRUPT;
+      if (buckets[i] == 0)
+	nempty++;
+    }
+
+  if (nempty == 0)
+    return ECTF_CORRUPT;
+
+  for (i = 1; i < cih->cih_nelems; i++)
+    {
+      if (CTF_NAME_STID (elems[i].cie_name) != CTF_STRTAB_0
+	  || CTF_NAME_OFFSET (elems[i].cie_name) >= strlen
+	  || elems[i].cie_type == 0)
+	return ECTF_CORRUPT;
     }
 
-  return NULL;
+  memset (hp, 0, sizeof (ctf_hash_t));
+  hp->h_buckets = (uint32_t *) buckets;
+  hp->h_elems = (ctf_helem_t *) elems;
+  hp->h_nbuckets = cih->cih_nbuckets;
+  hp->h_nelems = cih->cih_nelems;
+  hp->h_free = cih->cih_nelems;
+  hp->h_mapped = 1;
+  hp->h_seed = seed;
+
+  return 0;
 }
 
 void
 ctf_hash_destroy (ctf_hash_t *hp)
 {
-  if (hp->h_buckets != NULL && hp->h_nbuckets != 1)
+  if (hp->h_mapped)
     {
-      ctf_free (hp->h_buckets, sizeof (unsigned short) * hp->h_nbuckets);
       hp->h_buckets = NULL;
+      hp->h_elems = NULL;
+      return;
+    }
+
+  if (hp->h_buckets != NULL && hp->h_buckets != _CTF_EMPTY)
+    {
+      ctf_free (hp->h_buckets, sizeof (uint32_t) * hp->h_nbuckets);
+      hp->h_buckets = NULL;
+    }
+
+  if (hp->h_elems != NULL)
+    {
+      ctf_free (hp->h_elems, sizeof (ctf_helem_t) * hp->h_nelems);
+      hp->h_elems = NULL;
+    }
+}
+
+/* Dynamic hashes.  These are open-addressed and linearly probed like the
+   ctf_hash, but the keys and values are opaque pointers, and elements can be
+   deleted: deletion shifts later members of the probe sequence back, so no
+   tombstones are needed and lookups never slow down as the table churns.  */
+
+typedef struct ctf_dynhash_ent
+{
+  void *de_key;			/* Key, or NULL if this slot is empty.  */
+  void *de_value;		/* Value.  */
+  unsigned int de_hash;		/* Hash value of the key.  */
+} ctf_dynhash_ent_t;
+
+struct ctf_dynhash
+{
+  ctf_hash_fun dh_hash;		/* Key hashing function.  */
+  ctf_hash_eq_fun dh_eq;	/* Key equality function.  */
+  ctf_dynhash_ent_t *dh_ents;	/* Slot array.  */
+  uint32_t dh_nslots;		/* Number of slots (zero, or a power of 2).  */
+  uint32_t dh_nelems;		/* Number of occupied slots.  */
+};
+
+unsigned int
+ctf_hash_integer (const void *ptr)
+{
+  return (unsigned int) ctf_hash_mix ((uintptr_t) ptr ^ _libctf_hash_seed);
+}
+
+int
+ctf_hash_eq_integer (const void *a, const void *b)
+{
+  return a == b;
+}
+
+unsigned int
+ctf_hash_string (const void *ptr)
+{
+  const char *str = ptr;
+
+  return (unsigned int) ctf_hash_compute (str, strlen (str));
+}
+
+int
+ctf_hash_eq_string (const void *a, const void *b)
+{
+  return strcmp (a, b) == 0;
+}
+
+ctf_dynhash_t *
+ctf_dynhash_create (ctf_hash_fun hash_fun, ctf_hash_eq_fun eq_fun)
+{
+  ctf_dynhash_t *dhp;
+
+  if ((dhp = ctf_alloc (sizeof (ctf_dynhash_t))) == NULL)
+    return NULL;
+
+  memset (dhp, 0, sizeof (ctf_dynhash_t));
+  dhp->dh_hash = hash_fun;
+  dhp->dh_eq = eq_fun;
+
+  return dhp;
+}
+
+/* Find the slot holding KEY, whose hash value is H, or the empty slot where it
+   should go.  The table must not be empty.  */
+
+static ctf_dynhash_ent_t *
+ctf_dynhash_slot (const ctf_dynhash_t *dhp, const void *key, unsigned int h)
+{
+  uint32_t mask = dhp->dh_nslots - 1;
+  uint32_t i;
+
+  for (i = h & mask; dhp->dh_ents[i].de_key != NULL; i = (i + 1) & mask)
+    {
+      if (dhp->dh_ents[i].de_hash == h
+	  && dhp->dh_eq (dhp->dh_ents[i].de_key, key))
+	break;
+    }
+
+  return &dhp->dh_ents[i];
+}
+
+static int
+ctf_dynhash_grow (ctf_dynhash_t *dhp)
+{
+  ctf_dynhash_ent_t *oents = dhp->dh_ents;
+  uint32_t onslots = dhp->dh_nslots;
+  uint64_t nslots = onslots == 0 ? 16 : (uint64_t) onslots * 2;
+  uint32_t i;
+
+  if (nslots > UINT32_MAX / 2)
+    return EOVERFLOW;
+
+  if ((dhp->dh_ents = ctf_alloc (sizeof (ctf_dynhash_ent_t) * nslots)) == NULL)
+    {
+      dhp->dh_ents = oents;
+      return EAGAIN;
     }
 
-  if (hp->h_chains != NULL)
+  memset (dhp->dh_ents, 0, sizeof (ctf_dynhash_ent_t) * nslots);
+  dhp->dh_nslots = (uint32_t) nslots;
+
+  for (i = 0; i < onslots; i++)
     {
-      ctf_free (hp->h_chains, sizeof (ctf_helem_t) * hp->h_nelems);
-      hp->h_chains = NULL;
+      if (oents[i].de_key != NULL)
+	*ctf_dynhash_slot (dhp, oents[i].de_key, oents[i].de_hash) = oents[i];
     }
+
+  ctf_free (oents, sizeof (ctf_dynhash_ent_t) * onslots);
+  return 0;
+}
+
+/* Insert KEY, mapping to VALUE.  If KEY is already present, its value is
+   replaced.  */
+
+int
+ctf_dynhash_insert (ctf_dynhash_t *dhp, void *key, void *value)
+{
+  ctf_dynhash_ent_t *ent;
+  unsigned int h;
+  int err;
+
+  if (key == NULL)
+    return EINVAL;
+
+  h = dhp->dh_hash (key);
+
+  /* Replacing the value of a key already present never fails.  */
+
+  if (dhp->dh_nelems == 0
+      || (ent = ctf_dynhash_slot (dhp, key, h))->de_key == NULL)
+    {
+      if ((uint64_t) (dhp->dh_nelems + 1) * 4 > (uint64_t) dhp->dh_nslots * 3
+	  && (err = ctf_dynhash_grow (dhp)) != 0)
+	return err;
+
+      ent = ctf_dynhash_slot (dhp, key, h);
+      dhp->dh_nelems++;
+    }
+
+  ent->de_key = key;
+  ent->de_value = value;
+  ent->de_hash = h;
+
+  return 0;
+}
+
+/* Insert KEY, mapping to VALUE, unless it is already present, in which case
+   return EEXIST and leave the table alone.  This looks for KEY once, where a
+   lookup followed by an insertion would look twice.  */
+
+int
+ctf_dynhash_insert_new (ctf_dynhash_t *dhp, void *key, void *value)
+{
+  ctf_dynhash_ent_t *ent;
+  unsigned int h;
+  int err;
+
+  if (key == NULL)
+    return EINVAL;
+
+  h = dhp->dh_hash (key);
+
+  if ((uint64_t) (dhp->dh_nelems + 1) * 4 > (uint64_t) dhp->dh_nslots * 3
+      && (err = ctf_dynhash_grow (dhp)) != 0)
+    return err;
+
+  if ((ent = ctf_dynhash_slot (dhp, key, h))->de_key != NULL)
+    return EEXIST;
+
+  ent->de_key = key;
+  ent->de_value = value;
+  ent->de_hash = h;
+  dhp->dh_nelems++;
+
+  return 0;
+}
+
+/* Make room for N more entries, so that inserting them need not grow the table
+   more than once.  */
+
+int
+ctf_dynhash_reserve (ctf_dynhash_t *dhp, size_t n)
+{
+  int err;
+
+  while ((uint64_t) (dhp->dh_nelems + n) * 4 > (uint64_t) dhp->dh_nslots * 3)
+    if ((err = ctf_dynhash_grow (dhp)) != 0)
+      return err;
+
+  return 0;
+}
+
+void
+ctf_dynhash_remove (ctf_dynhash_t *dhp, const void *key)
+{
+  uint32_t mask = dhp->dh_nslots - 1;
+  uint32_t i, j;
+
+  if (dhp->dh_nelems == 0)
+    return;
+
+  i = ctf_dynhash_slot (dhp, key, dhp->dh_hash (key)) - dhp->dh_ents;
+  if (dhp->dh_ents[i].de_key == NULL)
+    return;
+
+  /* Move back any later entry in this probe sequence whose home slot does
+     not lie cyclically between the hole and its current position.  */
+
+  for (j = (i + 1) & mask; dhp->dh_ents[j].de_key != NULL; j = (j + 1) & mask)
+    {
+      uint32_t home = dhp->dh_ents[j].de_hash & mask;
+
+      if ((j > i && (home <= i || home > j))
+	  || (j < i && home <= i && home > j))
+	{
+	  dhp->dh_ents[i] = dhp->dh_ents[j];
+	  i = j;
+	}
+    }
+
+  dhp->dh_ents[i].de_key = NULL;
+  dhp->dh_ents[i].de_value = NULL;
+  dhp->dh_nelems--;
+}
+
+void *
+ctf_dynhash_lookup (ctf_dynhash_t *dhp, const void *key)
+{
+  ctf_dynhash_ent_t *ent;
+
+  if (dhp->dh_nelems == 0)
+    return NULL;
+
+  ent = ctf_dynhash_slot (dhp, key, dhp->dh_hash (key));
+
+  return (ent->de_key != NULL ? ent->de_value : NULL);
+}
+
+void
+ctf_dynhash_destroy (ctf_dynhash_t *dhp)
+{
+  if (dhp == NULL)
+    return;
+
+  ctf_free (dhp->dh_ents, sizeof (ctf_dynhash_ent_t) * dhp->dh_nslots);
+  ctf_free (dhp, sizeof (ctf_dynhash_t));
 }
@@ -49,22 +49,42 @@ extern "C"
 
 /* libctf in-memory state.  */
 
+/* Hash elements have the same layout as the ctf_idxelem_t of an on-disk name
+   index, so that a ctf_hash can be used in place on the index.  */
+
 typedef struct ctf_helem
 {
   uint32_t h_name;		/* Reference to name in string table.  */
   uint32_t h_type;		/* Corresponding type ID number.  */
-  uint32_t h_next;		/* Index of next element in hash chain.  */
+  uint32_t h_hash;		/* Hash value of the name.  */
 } ctf_helem_t;
 
+/* A ctf_hash is an open-addressed, linearly-probed table of indices into an
+   element buffer kept in insertion order.  Index zero is a sentinel marking an
+   empty slot.  Both arrays grow on demand, so the initial size is only a hint
+   (though a good one avoids rehashing in init_types()).  A hash may also be
+   mapped from the name index of a CTF buffer, in which case it is copied
+   before it is first modified.  */
+
 typedef struct ctf_hash
 {
-  unsigned short *h_buckets;	/* Hash bucket array (chain indices).  */
-  ctf_helem_t *h_chains;	/* Hash chains buffer.  */
-  unsigned short h_nbuckets;	/* Number of elements in bucket array.  */
-  uint32_t h_nelems;		/* Number of elements in hash table.  */
+  uint32_t *h_buckets;		/* Hash slot array (element indices).  */
+  ctf_helem_t *h_elems;		/* Hash elements buffer.  */
+  uint32_t h_nbuckets;		/* Number of slots (a power of 2).  */
+  uint32_t h_nelems;		/* Number of elements h_elems has room for.  */
   uint32_t h_free;		/* Index of next free hash element.  */
+  int h_mapped;			/* Arrays point into a CTF name index.  */
+  uint64_t h_seed;		/* Hash seed.  */
 } ctf_hash_t;
 
+/* A ctf_dynhash maps arbitrary non-NULL keys to values, growing as needed and
+   supporting deletion.  It is used for the dynamic state of containers under
+   construction.  */
+
+typedef struct ctf_dynhash ctf_dynhash_t;
+typedef unsigned int (*ctf_hash_fun) (const void *);
+typedef int (*ctf_hash_eq_fun) (const void *, const void *);
+
 typedef struct ctf_strs
 {
   const char *cts_strs;		/* Base address of string table.  */
@@ -139,6 +159,7 @@ typedef struct ctf_dmdef
 {
   ctf_list_t dmd_list;		/* List forward/back pointers.  */
   char *dmd_name;		/* Name of this member.  */
+  ctf_id_t dmd_owner;		/* Type this is a member of.  */
   ctf_id_t dmd_type;		/* Type of this member (for sou).  */
   unsigned long dmd_offset;	/* Offset of this member in bits (for sou).  */
   int dmd_value;		/* Value of this member (for enum).  */
@@ -147,8 +168,8 @@ typedef struct ctf_dmdef
 typedef struct ctf_dtdef
 {
   ctf_list_t dtd_list;		/* List forward/back pointers.  */
-  struct ctf_dtdef *dtd_hash;	/* Hash chain pointer for ctf_dthash.  */
   char *dtd_name;		/* Name associated with definition (if any).  */
+  struct ctf_dtdef *dtd_nameprev; /* Older definition with the same name.  */
   ctf_id_t dtd_type;		/* Type identifier for this definition.  */
   ctf_type_t dtd_data;		/* Type node (see <sys/ctf.h>).  */
   union
@@ -163,12 +184,74 @@ typedef struct ctf_dtdef
 typedef struct ctf_dvdef
 {
   ctf_list_t dvd_list;		/* List forward/back pointers.  */
-  struct ctf_dvdef *dvd_hash;	/* Hash chain pointer for ctf_dvhash.  */
   char *dvd_name;		/* Name associated with variable.  */
   ctf_id_t dvd_type;		/* Type of variable.  */
   unsigned long dvd_snapshots;	/* Snapshot count when inserted.  */
 } ctf_dvdef_t;
 
+/* Dynamic definitions and their names are allocated from an arena, a chain of
+   large blocks that are handed out in order and freed together, either when
+   the container is closed or, on ctf_rollback(), everything allocated since a
+   snapshot.  Positions in an arena count the bytes handed out from it, so that
+   they can be compared.  */
+
+#define LCTF_ARENA_BLOCK 65536	/* Usual size of an arena block.  */
+
+typedef struct ctf_arena_block
+{
+  struct ctf_arena_block *cab_prev; /* Previous block (if any).  */
+  size_t cab_start;		/* Arena position of the first byte.  */
+  size_t cab_size;		/* Bytes of space in this block.  */
+  size_t cab_used;		/* Bytes handed out from this block.  */
+} ctf_arena_block_t;
+
+typedef struct ctf_arena
+{
+  ctf_arena_block_t *ca_block;	/* Block allocations come from (if any).  */
+} ctf_arena_t;
+
+typedef struct ctf_arena_mark
+{
+  size_t cam_pos;		/* Arena position, or -1 if not known.  */
+  unsigned long cam_dtd_id;	/* Last type ID at the time.  */
+} ctf_arena_mark_t;
+
+/* A ctf_strset interns the strings ctf_update() writes to the string table, so
+   that each distinct string is written once and strings that are the tail of
+   another share its bytes.  It persists across updates, mapping the strings
+   already committed to their offsets, so that appended types can share them
+   too.  Strings added since then are pending until laid out and committed.  */
+
+typedef struct ctf_strent
+{
+  const char *cse_str;		/* String (owned by a dynamic definition).  */
+  uint32_t cse_len;		/* Its length, excluding the \0.  */
+  uint32_t cse_off;		/* Its offset, once laid out.  */
+} ctf_strent_t;
+
+typedef struct ctf_strset
+{
+  ctf_dynhash_t *css_atoms;	/* Interned strings (see ctf-string.c).  */
+  ctf_strent_t *css_pending;	/* Strings not yet committed.  */
+  size_t css_npending;		/* Number of entries in css_pending.  */
+  size_t css_pendinglen;	/* Number of entries there is room for.  */
+  uint32_t css_len;		/* Length of the committed string table.  */
+} ctf_strset_t;
+
+/* The translation of types that ctf_add_type() has copied from one source
+   container, so that copying them again is a single lookup.  The source is
+   known by its ctf_serial, which changes whenever its committed types do, so a
+   table left behind by a source that has since changed, or been closed and its
+   memory reused, is never consulted.  */
+
+typedef struct ctf_srcmap
+{
+  ctf_list_t csm_list;		/* List forward/back pointers.  */
+  const ctf_file_t *csm_src;	/* Source container.  */
+  uint64_t csm_serial;		/* Its ctf_serial when the table was made.  */
+  ctf_dynhash_t *csm_types;	/* Source type ID -> destination type ID.  */
+} ctf_srcmap_t;
+
 typedef struct ctf_bundle
 {
   ctf_file_t *ctb_file;		/* CTF container handle.  */
@@ -197,8 +280,12 @@ struct ctf_file
   ctf_hash_t ctf_unions;	    /* Hash table of union types.  */
   ctf_hash_t ctf_enums;		    /* Hash table of enum types.  */
   ctf_hash_t ctf_names;		    /* Hash table of remaining type names.  */
+  unsigned long ctf_hashsize[CTF_INDEX_MAX]; /* Initial sizes of the above.  */
+  int ctf_hashstate;		    /* Name hash state (see below).  */
   ctf_lookup_t ctf_lookups[5];	    /* Pointers to hashes for name lookup.  */
   ctf_strs_t ctf_str[2];	    /* Array of string table base and bounds.  */
+  const ctf_index_t *ctf_index;	    /* Index at end of strtab (if any).  */
+  struct ctf_chunks *ctf_chunks;    /* Chunks yet to inflate (if any).  */
   const unsigned char *ctf_base;  /* Base of CTF header + uncompressed buffer.  */
   const unsigned char *ctf_buf;	  /* Uncompressed CTF data buffer.  */
   size_t ctf_size;		  /* Size of CTF header + uncompressed data.  */
@@ -219,17 +306,28 @@ struct ctf_file
   uint32_t ctf_flags;		  /* Libctf flags (see below).  */
   int ctf_errno;		  /* Error code for most recent error.  */
   int ctf_version;		  /* CTF data version.  */
-  ctf_dtdef_t **ctf_dthash;	  /* Hash of dynamic type definitions.  */
-  unsigned long ctf_dthashlen;	  /* Size of dynamic type hash bucket array.  */
+  uint64_t ctf_serial;		  /* Unique ID of the committed types.  */
+  ctf_dtdef_t **ctf_dtdtab;	  /* Dynamic type definitions, by index.  */
+  size_t ctf_dtdtablen;		  /* Number of entries in ctf_dtdtab.  */
   ctf_list_t ctf_dtdefs;	  /* List of dynamic type definitions.  */
-  ctf_dvdef_t **ctf_dvhash;	  /* Hash of dynamic variable mappings.  */
-  unsigned long ctf_dvhashlen;	  /* Size of dynvar hash bucket array.  */
+  ctf_dynhash_t *ctf_dmhash;	  /* Hash of named dynamic members.  */
+  ctf_dynhash_t *ctf_dtnames[CTF_INDEX_MAX]; /* Dynamic types, by name.  */
+  ctf_dynhash_t *ctf_refhash;	  /* Shared reference types (if any).  */
+  ctf_dynhash_t *ctf_srcmaps;	  /* ctf_srcmap_ts, by source container.  */
+  ctf_list_t ctf_srcmapl;	  /* List of the same.  */
+  ctf_dynhash_t *ctf_dvhash;	  /* Hash of dynamic variable mappings.  */
   ctf_list_t ctf_dvdefs;	  /* List of dynamic variable definitions.  */
-  size_t ctf_dtvstrlen;		  /* Total length of dynamic type+var strings.  */
+  ctf_strset_t ctf_strset;	  /* Strings of committed definitions.  */
   unsigned long ctf_dtnextid;	  /* Next dynamic type id to assign.  */
   unsigned long ctf_dtoldid;	  /* Oldest id that has been committed.  */
   unsigned long ctf_snapshots;	  /* ctf_snapshot() plus ctf_update() count.  */
   unsigned long ctf_snapshot_lu;  /* ctf_snapshot() call count at last update.  */
+  ctf_arena_t ctf_arena;	  /* Dynamic definitions and their names.  */
+  ctf_arena_mark_t *ctf_marks;	  /* Arena marks of snapshots since update.  */
+  unsigned long ctf_marks_base;	  /* Snapshot ID of ctf_marks[0].  */
+  unsigned long ctf_nmarks;	  /* Number of entries in ctf_marks.  */
+  unsigned long ctf_markslen;	  /* Number of entries there is room for.  */
+  size_t ctf_arena_pin;		  /* Arena position rollbacks must keep.  */
   void *ctf_specific;		  /* Data for ctf_get/setspecific().  */
 };
 
@@ -292,7 +390,18 @@ typedef struct ctf_archive_modent
 					   (id))
 
 #define LCTF_INDEX_TO_TYPEPTR(fp, i) \
-  ((ctf_type_t *)((uintptr_t)(fp)->ctf_buf + (fp)->ctf_txlate[(i)]))
+  (_libctf_unlikely_ ((fp)->ctf_chunks != NULL) ? ctf_chunk_type ((fp), (i)) \
+   : (ctf_type_t *)((uintptr_t)(fp)->ctf_buf + (fp)->ctf_txlate[(i)]))
+
+/* Make sure that LEN bytes at P, or the string at P, in the CTF data buffer
+   have been inflated, if the container was compressed in chunks.  */
+
+#define LCTF_CHUNK(fp, p, len) \
+  (_libctf_unlikely_ ((fp)->ctf_chunks != NULL)				\
+   ? ctf_chunk_ptr ((fp), (p), (len)) : (void) 0)
+#define LCTF_CHUNK_STR(fp, s) \
+  (_libctf_unlikely_ ((fp)->ctf_chunks != NULL)				\
+   ? ctf_chunk_str ((fp), (s)) : (void) 0)
 
 #define LCTF_INFO_KIND(fp, info)	((fp)->ctf_fileops->ctfo_get_kind(info))
 #define LCTF_INFO_ISROOT(fp, info)	((fp)->ctf_fileops->ctfo_get_root(info))
@@ -312,18 +421,113 @@ static inline ssize_t ctf_get_ctt_size (const ctf_file_t* fp,
 #define LCTF_CHILD	0x0002	/* CTF container is a child */
 #define LCTF_RDWR	0x0004	/* CTF container is writable */
 #define LCTF_DIRTY	0x0008	/* CTF container has been modified */
+#define LCTF_TXMAPPED	0x0010	/* ctf_txlate and ctf_ptrtab are in the index */
+#define LCTF_REBUILD	0x0020	/* Next ctf_update() must rewrite every type */
+
+/* The name hashes of a container opened with CTF_OPEN_LAZY_HASH are built by
+   whichever thread first needs them: ctf_hashstate is only accessed
+   atomically.  */
+
+#define LCTF_HASH_NONE	0	/* Name hashes not built yet.  */
+#define LCTF_HASH_BUSY	1	/* Name hashes being built.  */
+#define LCTF_HASH_READY	2	/* Name hashes ready for use.  */
 
 extern const ctf_type_t *ctf_lookup_by_id (ctf_file_t **, ctf_id_t);
 
 extern int ctf_hash_create (ctf_hash_t *, unsigned long);
 extern int ctf_hash_insert (ctf_hash_t *, ctf_file_t *, uint32_t, uint32_t);
 extern int ctf_hash_define (ctf_hash_t *, ctf_file_t *, uint32_t, uint32_t);
+extern int ctf_hash_insert_hashed (ctf_hash_t *, ctf_file_t *, uint32_t,
+				   uint32_t, uint32_t);
+extern int ctf_hash_define_hashed (ctf_hash_t *, ctf_file_t *, uint32_t,
+				   uint32_t, uint32_t);
 extern ctf_helem_t *ctf_hash_lookup (ctf_hash_t *, ctf_file_t *,
 				     const char *, size_t);
 extern uint32_t ctf_hash_size (const ctf_hash_t *);
+extern int ctf_hash_rehash (ctf_hash_t *, const ctf_hash_t *, ctf_file_t *,
+			    uint64_t);
+extern int ctf_hash_map (ctf_hash_t *, const char *, size_t, uint32_t,
+			 const ctf_idxhash_t *, uint64_t);
 extern unsigned long ctf_hash_compute (const char *key, size_t len);
+extern void ctf_hash_seed (void);
 extern void ctf_hash_destroy (ctf_hash_t *);
 
+extern ctf_dynhash_t *ctf_dynhash_create (ctf_hash_fun, ctf_hash_eq_fun);
+extern int ctf_dynhash_insert (ctf_dynhash_t *, void *, void *);
+extern int ctf_dynhash_insert_new (ctf_dynhash_t *, void *, void *);
+extern int ctf_dynhash_reserve (ctf_dynhash_t *, size_t);
+extern void ctf_dynhash_remove (ctf_dynhash_t *, const void *);
+extern void *ctf_dynhash_lookup (ctf_dynhash_t *, const void *);
+extern void ctf_dynhash_destroy (ctf_dynhash_t *);
+
+extern unsigned int ctf_hash_integer (const void *);
+extern int ctf_hash_eq_integer (const void *, const void *);
+extern unsigned int ctf_hash_string (const void *);
+extern int ctf_hash_eq_string (const void *, const void *);
+
+/* A ctf_work_f processes the items from START up to END of a larger job for
+   ctf_parallel(), returning zero or an error code.  */
+
+typedef int ctf_work_f (void *arg, unsigned long start, unsigned long end);
+
+extern int ctf_parallel (unsigned long, unsigned long, ctf_work_f *, void *);
+
+/* A compression codec.  The compress and decompress functions take the size
+   of the destination buffer in *DSTLEN and replace it with the number of bytes
+   written, returning zero or an error such as ECTF_COMPRESS or
+   ECTF_DECOMPRESS.  */
+
+typedef struct ctf_codec
+{
+  const char *cc_name;		/* Name, for debugging.  */
+  int cc_id;			/* CTF_COMPRESS_* value.  */
+  int cc_flags;			/* CTF_F_COMPRESS and codec header flags.  */
+  size_t (*cc_bound) (size_t);	/* Worst-case compressed size.  */
+  int (*cc_compress) (void *, size_t *, const void *, size_t);
+  int (*cc_decompress) (void *, size_t *, const void *, size_t);
+} ctf_codec_t;
+
+extern const ctf_codec_t *ctf_codec (int);
+extern const ctf_codec_t *ctf_codec_flags (int);
+extern int ctf_compress (const void *, size_t, int *, void **, size_t *,
+			 size_t *);
+extern int ctf_write_compressed (ctf_file_t *, int, const void *, size_t, int);
+
+/* A sink for ctf_serialize(), which is passed each successive piece of the
+   container written out, and returns zero or an error.  */
+
+typedef int ctf_sink_f (const void *, size_t, void *);
+
+extern int ctf_serialize (ctf_file_t *, int, ctf_sink_f *, void *);
+
+/* The chunks of a container compressed with CTF_F_CHUNKED, each inflated into
+   its place in the CTF data buffer the first time anything in it is used.  */
+
+#define LCTF_CHUNK_SIZE (64 * 1024)	/* Chunk size for new containers.  */
+
+typedef struct ctf_chunks
+{
+  const ctf_codec_t *ck_codec;	/* Codec the chunks were compressed with.  */
+  const unsigned char *ck_data;	/* Compressed chunks.  */
+  const uint32_t *ck_offs;	/* Offsets of chunks in ck_data.  */
+  unsigned char *ck_buf;	/* CTF data buffer to inflate into.  */
+  size_t ck_len;		/* Length of the CTF data buffer.  */
+  size_t ck_size;		/* Uncompressed size of each chunk.  */
+  size_t ck_nchunks;		/* Number of chunks.  */
+  unsigned char *ck_state;	/* LCTF_CHUNK_* state of each chunk.  */
+} ctf_chunks_t;
+
+#define LCTF_CHUNK_NONE 0	/* Chunk not inflated.  */
+#define LCTF_CHUNK_BUSY 1	/* Chunk being inflated by another thread.  */
+#define LCTF_CHUNK_READY 2	/* Chunk inflated (or zeroed if corrupt).  */
+
+extern int ctf_chunk_open (const ctf_codec_t *, const void *, size_t,
+			   void *, size_t, ctf_chunks_t **);
+extern void ctf_chunk_close (ctf_chunks_t *);
+extern void ctf_chunk_ptr (const ctf_file_t *, const void *, size_t);
+extern void ctf_chunk_str (const ctf_file_t *, const char *);
+extern ctf_type_t *ctf_chunk_type (const ctf_file_t *, unsigned long);
+
 #define	ctf_list_prev(elem)	((void *)(((ctf_list_t *)(elem))->l_prev))
 #define	ctf_list_next(elem)	((void *)(((ctf_list_t *)(elem))->l_next))
 
@@ -331,14 +535,22 @@ extern void ctf_list_append (ctf_list_t *, void *);
 extern void ctf_list_prepend (ctf_list_t *, void *);
 extern void ctf_list_delete (ctf_list_t *, void *);
 
-extern void ctf_dtd_insert (ctf_file_t *, ctf_dtdef_t *);
+extern int ctf_dtd_insert (ctf_file_t *, ctf_dtdef_t *);
 extern void ctf_dtd_delete (ctf_file_t *, ctf_dtdef_t *);
 extern ctf_dtdef_t *ctf_dtd_lookup (ctf_file_t *, ctf_id_t);
+extern ctf_dtdef_t *ctf_dtd_lookup_name (ctf_file_t *, int, const char *);
+extern int ctf_name_space (uint32_t, uint32_t);
+extern int ctf_add_member_raw (ctf_file_t *, ctf_id_t, const char *, ctf_id_t,
+			       unsigned long);
+
+extern void ctf_srcmap_clear (ctf_file_t *);
 
-extern void ctf_dvd_insert (ctf_file_t *, ctf_dvdef_t *);
+extern int ctf_dvd_insert (ctf_file_t *, ctf_dvdef_t *);
 extern void ctf_dvd_delete (ctf_file_t *, ctf_dvdef_t *);
 extern ctf_dvdef_t *ctf_dvd_lookup (ctf_file_t *, const char *);
 
+extern int ctf_refresh_index (ctf_file_t *);
+
 extern void ctf_decl_init (ctf_decl_t *, char *, size_t);
 extern void ctf_decl_fini (ctf_decl_t *);
 extern void ctf_decl_push (ctf_decl_t *, ctf_file_t *, ctf_id_t);
@@ -349,6 +561,10 @@ extern void ctf_decl_sprintf (ctf_decl_t *, const char *, ...);
 extern const char *ctf_strraw (ctf_file_t *, uint32_t);
 extern const char *ctf_strptr (ctf_file_t *, uint32_t);
 
+extern void ctf_set_base (ctf_file_t *, const ctf_header_t *, void *);
+extern int ctf_init_hashes (ctf_file_t *);
+extern int ctf_init_appended (ctf_file_t *, unsigned long);
+
 extern ctf_file_t *ctf_set_open_errno (int *, int);
 extern long ctf_set_errno (ctf_file_t *, int);
 
@@ -360,9 +576,26 @@ extern void ctf_data_free (void *, size_t);
 extern void ctf_data_protect (void *, size_t);
 
 extern void *ctf_alloc (size_t);
+extern void *ctf_realloc (void *, size_t);
 extern void ctf_free (void *, size_t);
 
 extern char *ctf_strdup (const char *);
+extern uint64_t ctf_serial_next (void);
+extern void *ctf_arena_alloc (ctf_arena_t *, size_t);
+extern char *ctf_arena_strdup (ctf_arena_t *, const char *);
+extern size_t ctf_arena_mark (const ctf_arena_t *);
+extern void ctf_arena_release (ctf_arena_t *, size_t);
+extern void ctf_arena_destroy (ctf_arena_t *);
+
+extern int ctf_strset_init (ctf_strset_t *, uint32_t);
+extern int ctf_strset_add (ctf_strset_t *, const char *);
+extern int ctf_strset_layout (ctf_strset_t *, uint32_t *);
+extern uint32_t ctf_strset_offset (ctf_strset_t *, const char *);
+extern void ctf_strset_write (const ctf_strset_t *, unsigned char *);
+extern int ctf_strset_stream (const ctf_strset_t *, ctf_sink_f *, void *);
+extern void ctf_strset_commit (ctf_strset_t *);
+extern void ctf_strset_abort (ctf_strset_t *);
+extern void ctf_strset_destroy (ctf_strset_t *);
 extern const char *ctf_strerror (int);
 
 _libctf_printflike_ (1, 2)
@@ -375,6 +608,10 @@ extern const char _CTF_NULLSTR[];	/* empty string */
 
 extern int _libctf_version;	/* library client version */
 extern int _libctf_debug;	/* debugging messages enabled */
+extern int _libctf_open_flags;	/* flags for newly-opened containers */
+extern int _libctf_nthreads;	/* maximum threads per operation */
+extern int _libctf_compression;	/* codec for compressed writes */
+extern uint64_t _libctf_hash_seed;	/* string hash seed */
 
 #ifdef	__cplusplus
 }
@@ -20,6 +20,7 @@ extract_label_info (ctf_file_t *fp, const ctf_lblent_t **ctl,
 
   *ctl = (const ctf_lblent_t *) (fp->ctf_buf + h->cth_lbloff);
   *num_labels = (h->cth_objtoff - h->cth_lbloff) / sizeof (ctf_lblent_t);
+  LCTF_CHUNK (fp, *ctl, *num_labels * sizeof (ctf_lblent_t));
 
   return 0;
 }
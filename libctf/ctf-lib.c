@@ -30,6 +30,8 @@ static void _libctf_init (void)
 
   _PAGESIZE = getpagesize ();
   _PAGEMASK = ~(_PAGESIZE - 1);
+
+  ctf_hash_seed ();
 }
 
 /* Convert a 32-bit ELF file header into GElf.  */
@@ -372,9 +374,18 @@ ctf_open (const char *filename, int *errp)
 int
 ctf_gzwrite (ctf_file_t *fp, gzFile fd)
 {
-  const unsigned char *buf = fp->ctf_base;
-  ssize_t resid = fp->ctf_size;
+  const unsigned char *buf;
+  ssize_t resid;
   ssize_t len;
+  int err;
+
+  if ((err = ctf_refresh_index (fp)) != 0)
+    return (ctf_set_errno (fp, err));
+
+  LCTF_CHUNK (fp, fp->ctf_buf, fp->ctf_size - sizeof (ctf_header_t));
+
+  buf = fp->ctf_base;
+  resid = fp->ctf_size;
 
   while (resid != 0)
     {
@@ -387,64 +398,70 @@ ctf_gzwrite (ctf_file_t *fp, gzFile fd)
   return 0;
 }
 
-/* Compress the specified CTF data stream and write it to the specified file
-   descriptor.  */
+/* Write the header of the specified CTF container, with the compression
+   flags FLAGS, followed by LEN bytes of compressed data at BUF, to the
+   specified file descriptor.  */
 int
-ctf_compress_write (ctf_file_t *fp, int fd)
+ctf_write_compressed (ctf_file_t *fp, int fd, const void *buf, size_t len,
+		      int flags)
 {
-  unsigned char *buf;
-  unsigned char *bp;
+  const unsigned char *bp = buf;
   ctf_header_t h;
-  ctf_header_t *hp = &h;
+  unsigned char *hp = (unsigned char *) &h;
   ssize_t header_len = sizeof (ctf_header_t);
-  ssize_t compress_len;
-  size_t max_compress_len = compressBound (fp->ctf_size - header_len);
-  ssize_t len;
-  int rc;
-  int err = 0;
-
-  memcpy (hp, fp->ctf_base, header_len);
-  hp->cth_flags |= CTF_F_COMPRESS;
+  ssize_t wlen;
 
-  if ((buf = ctf_data_alloc (max_compress_len)) == MAP_FAILED)
-    return (ctf_set_errno (fp, ECTF_ZALLOC));
-
-  compress_len = max_compress_len;
-  if ((rc = compress (buf, (uLongf *) & compress_len,
-		      fp->ctf_base + header_len,
-		      fp->ctf_size - header_len)) != Z_OK)
-    {
-      ctf_dprintf ("zlib deflate err: %s\n", zError (rc));
-      err = ctf_set_errno (fp, ECTF_COMPRESS);
-      goto ret;
-    }
+  memcpy (&h, fp->ctf_base, header_len);
+  h.cth_flags &= ~(CTF_F_COMPRESS | CTF_F_CODEC | CTF_F_CHUNKED);
+  h.cth_flags |= flags;
 
   while (header_len > 0)
     {
-      if ((len = write (fd, hp, header_len)) < 0)
-	{
-	  err = ctf_set_errno (fp, errno);
-	  goto ret;
-	}
-      header_len -= len;
-      hp += len;
+      if ((wlen = write (fd, hp, header_len)) < 0)
+	return errno;
+      header_len -= wlen;
+      hp += wlen;
     }
 
-  bp = buf;
-  while (compress_len > 0)
+  while (len > 0)
     {
-      if ((len = write (fd, bp, compress_len)) < 0)
-	{
-	  err = ctf_set_errno (fp, errno);
-	  goto ret;
-	}
-      compress_len -= len;
-      bp += len;
+      if ((wlen = write (fd, bp, len)) < 0)
+	return errno;
+      len -= wlen;
+      bp += wlen;
     }
 
-ret:
+  return 0;
+}
+
+/* Compress the specified CTF data stream with the codec selected by
+   ctf_compression() and write it to the specified file descriptor.  */
+int
+ctf_compress_write (ctf_file_t *fp, int fd)
+{
+  void *buf;
+  size_t header_len = sizeof (ctf_header_t);
+  size_t compress_len;
+  size_t max_compress_len;
+  int flags = 0;
+  int err;
+
+  if ((err = ctf_refresh_index (fp)) != 0)
+    return (ctf_set_errno (fp, err));
+
+  LCTF_CHUNK (fp, fp->ctf_buf, fp->ctf_size - header_len);
+
+  if ((err = ctf_compress (fp->ctf_base + header_len,
+			   fp->ctf_size - header_len, &flags, &buf,
+			   &max_compress_len, &compress_len)) != 0)
+    return (ctf_set_errno (fp, err));
+
+  err = ctf_write_compressed (fp, fd, buf, compress_len, flags);
   ctf_data_free (buf, max_compress_len);
-  return err;
+
+  if (err != 0)
+    return (ctf_set_errno (fp, err));
+  return 0;
 }
 
 /* Write the uncompressed CTF data stream to the specified file descriptor.
@@ -452,9 +469,18 @@ ret:
 int
 ctf_write (ctf_file_t *fp, int fd)
 {
-  const unsigned char *buf = fp->ctf_base;
-  ssize_t resid = fp->ctf_size;
+  const unsigned char *buf;
+  ssize_t resid;
   ssize_t len;
+  int err;
+
+  if ((err = ctf_refresh_index (fp)) != 0)
+    return (ctf_set_errno (fp, err));
+
+  LCTF_CHUNK (fp, fp->ctf_buf, fp->ctf_size - sizeof (ctf_header_t));
+
+  buf = fp->ctf_base;
+  resid = fp->ctf_size;
 
   while (resid != 0)
     {
@@ -467,6 +493,167 @@ ctf_write (ctf_file_t *fp, int fd)
   return 0;
 }
 
+/* The ctf_*_dynamic() functions below write out the type and variable
+   definitions of a dynamic container as ctf_update() would commit them, but
+   straight to a file without ever laying the container out in memory, so that
+   containers too large to update comfortably can still be saved.  */
+
+static int
+ctf_fd_sink (const void *buf, size_t len, void *arg)
+{
+  const unsigned char *bp = buf;
+  int fd = *(int *) arg;
+  ssize_t wlen;
+
+  while (len > 0)
+    {
+      if ((wlen = write (fd, bp, len)) < 0)
+	return errno;
+      len -= wlen;
+      bp += wlen;
+    }
+
+  return 0;
+}
+
+static int
+ctf_gz_sink (const void *buf, size_t len, void *arg)
+{
+  const unsigned char *bp = buf;
+  gzFile fd = arg;
+  int wlen;
+
+  while (len > 0)
+    {
+      if ((wlen = gzwrite (fd, bp, len)) <= 0)
+	return errno;
+      len -= wlen;
+      bp += wlen;
+    }
+
+  return 0;
+}
+
+/* ctf_compress_write_dynamic() passes the header through to the file as it is
+   and deflates everything after it.  */
+
+typedef struct ctf_deflate_sink
+{
+  int cds_fd;			/* File written to.  */
+  size_t cds_hdrleft;		/* Bytes of header still to be written.  */
+  z_stream cds_zs;		/* Deflate state.  */
+  unsigned char cds_out[64 * 1024]; /* Deflated output.  */
+} ctf_deflate_sink_t;
+
+static int
+ctf_deflate (ctf_deflate_sink_t *cds, const void *buf, size_t len, int flush)
+{
+  int rc, err;
+
+  cds->cds_zs.next_in = (unsigned char *) buf;
+  cds->cds_zs.avail_in = len;
+
+  do
+    {
+      cds->cds_zs.next_out = cds->cds_out;
+      cds->cds_zs.avail_out = sizeof (cds->cds_out);
+
+      if ((rc = deflate (&cds->cds_zs, flush)) == Z_STREAM_ERROR)
+	{
+	  ctf_dprintf ("zlib deflate err: %s\n", zError (rc));
+	  return ECTF_COMPRESS;
+	}
+
+      if ((err = ctf_fd_sink (cds->cds_out,
+			      sizeof (cds->cds_out) - cds->cds_zs.avail_out,
+			      &cds->cds_fd)) != 0)
+	return err;
+    }
+  while (cds->cds_zs.avail_out == 0);
+
+  return 0;
+}
+
+static int
+ctf_deflate_sink (const void *buf, size_t len, void *arg)
+{
+  ctf_deflate_sink_t *cds = arg;
+  size_t hlen = len < cds->cds_hdrleft ? len : cds->cds_hdrleft;
+  int err;
+
+  if (hlen > 0)
+    {
+      if ((err = ctf_fd_sink (buf, hlen, &cds->cds_fd)) != 0)
+	return err;
+      cds->cds_hdrleft -= hlen;
+    }
+
+  if (len == hlen)
+    return 0;
+
+  return ctf_deflate (cds, (const unsigned char *) buf + hlen, len - hlen,
+		      Z_NO_FLUSH);
+}
+
+/* Write the type and variable definitions of the specified dynamic CTF
+   container, uncompressed, to the specified file descriptor.  */
+int
+ctf_write_dynamic (ctf_file_t *fp, int fd)
+{
+  int err;
+
+  if ((err = ctf_serialize (fp, 0, ctf_fd_sink, &fd)) != 0)
+    return (ctf_set_errno (fp, err));
+
+  return 0;
+}
+
+/* Write them to the specified gzFile descriptor.  */
+int
+ctf_gzwrite_dynamic (ctf_file_t *fp, gzFile fd)
+{
+  int err;
+
+  if ((err = ctf_serialize (fp, 0, ctf_gz_sink, fd)) != 0)
+    return (ctf_set_errno (fp, err));
+
+  return 0;
+}
+
+/* Write them to the specified file descriptor, deflating them as they go.
+   Only zlib can compress a stream like this, so it is used whatever codec
+   ctf_compression() has selected.  */
+int
+ctf_compress_write_dynamic (ctf_file_t *fp, int fd)
+{
+  ctf_deflate_sink_t *cds;
+  int rc, err;
+
+  if ((cds = ctf_alloc (sizeof (ctf_deflate_sink_t))) == NULL)
+    return (ctf_set_errno (fp, EAGAIN));
+
+  memset (&cds->cds_zs, 0, sizeof (z_stream));
+  cds->cds_fd = fd;
+  cds->cds_hdrleft = sizeof (ctf_header_t);
+
+  if ((rc = deflateInit (&cds->cds_zs, Z_DEFAULT_COMPRESSION)) != Z_OK)
+    {
+      ctf_dprintf ("zlib deflate err: %s\n", zError (rc));
+      ctf_free (cds, sizeof (ctf_deflate_sink_t));
+      return (ctf_set_errno (fp, ECTF_COMPRESS));
+    }
+
+  if ((err = ctf_serialize (fp, CTF_F_COMPRESS, ctf_deflate_sink, cds)) == 0)
+    err = ctf_deflate (cds, NULL, 0, Z_FINISH);
+
+  deflateEnd (&cds->cds_zs);
+  ctf_free (cds, sizeof (ctf_deflate_sink_t));
+
+  if (err != 0)
+    return (ctf_set_errno (fp, err));
+  return 0;
+}
+
 /* Set the CTF library client version to the specified version.  If version is
    zero, we just return the default library version number.  */
 int
@@ -492,3 +679,22 @@ ctf_version (int version)
 
   return _libctf_version;
 }
+
+/* Set the flags (CTF_OPEN_*) applied to containers opened from now on, and
+   return the previous flags.  */
+int
+ctf_open_flags (int flags)
+{
+  int oflags = _libctf_open_flags;
+
+  if (flags & ~CTF_OPEN_LAZY_HASH)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  ctf_dprintf ("ctf_open_flags: flags %x\n", flags);
+  _libctf_open_flags = flags;
+
+  return oflags;
+}
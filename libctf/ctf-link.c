@@ -0,0 +1,1795 @@
+/* CTF type deduplication and linking.
+   Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+
+   Licensed under the Universal Permissive License v 1.0 as shown at
+   http://oss.oracle.com/licenses/upl.
+
+   Licensed under the GNU General Public License (GPL), version 2. See the file
+   COPYING in the top level of this tree.  */
+
+#include <ctf-impl.h>
+#include <string.h>
+
+/* The linker turns a set of standalone CTF containers, typically one per
+   module, into one parent container holding the types they can share, and one
+   child per input holding the rest, which refers into the parent for the
+   shared types.
+
+   Types are matched across inputs by a hash of their structure.  References to
+   named structs, unions and enums, and forwards to them, are hashed by kind and
+   name alone: this is what breaks the cycles C types can contain, so that the
+   pointer in a list node hashes the same however the node is defined.  That
+   is only sound if every input defines the tag the same way, so a tag with
+   more than one distinct definition is ambiguous, and neither its definitions
+   nor any type referring to them, however indirectly, can be shared.  Those
+   stay in the children, where each input's references resolve to its own
+   definitions.  Root-visible types in the ordinary namespace are treated the
+   same way, so that the parent never has two root types of the same name.
+
+   Of the types that can be shared, those found in more than one input go into
+   the parent, together with everything they refer to; the rest go into the
+   child of each input that has them.  Types are emitted in input order, and in
+   order of type ID within each input, so the output depends only on the inputs
+   and the order they were added in.
+
+   Inputs are hashed in parallel, and so are children filled in.  In between,
+   the classes and names are gathered into tables split into shards by hash,
+   one thread filling each shard; the shards are then merged back into the
+   order a single thread would have found them in, so that the number of
+   threads makes no difference to the output.  */
+
+typedef struct ctf_link_class ctf_link_class_t;
+typedef struct ctf_link_name ctf_link_name_t;
+
+/* An entry in a list of the classes that refer to a class or name.  */
+
+typedef struct ctf_link_user
+{
+  struct ctf_link_user *lu_next;	/* Next entry, or NULL.  */
+  ctf_link_class_t *lu_class;		/* Class referring to the target.  */
+} ctf_link_user_t;
+
+/* A class of structurally identical types, found in one or more inputs.  */
+
+struct ctf_link_class
+{
+  uint64_t lc_hash[2];		/* Structural hash, identifying the class.  */
+  uint32_t lc_input;		/* Input holding the class's first type.  */
+  uint32_t lc_index;		/* Index of that type in its input.  */
+  uint32_t lc_kind;		/* Kind of the types in the class.  */
+  uint32_t lc_flags;		/* LC_* flags, below.  */
+  uint32_t lc_ninputs;		/* Number of inputs with types in the class.  */
+  uint32_t lc_lastinput;	/* Last of those inputs counted, plus one.  */
+  ctf_link_name_t *lc_name;	/* Name the class defines, if any.  */
+  ctf_link_user_t *lc_users;	/* Classes referring to this one.  */
+  ctf_id_t lc_parent_id;	/* Type ID in the parent, if LC_PARENT.  */
+};
+
+#define	LC_UNSHARED 0x1		/* Class must not go in the parent.  */
+#define	LC_PARENT 0x2		/* Class goes in the parent.  */
+
+/* A struct, union or enum tag, or the name of a root type in the ordinary
+   namespace, with the classes defining it and those referring to it.  */
+
+struct ctf_link_name
+{
+  const char *ln_name;		/* Name, in the string table of some input.  */
+  int ln_ns;			/* CTF_INDEX_* namespace of the name.  */
+  uint32_t ln_flags;		/* LN_* flags, below.  */
+  uint32_t ln_input;		/* Input of the first type with the name.  */
+  uint32_t ln_index;		/* Index of that type in its input.  */
+  ctf_link_class_t *ln_def;	/* First class defining the name, if any.  */
+  ctf_link_user_t *ln_users;	/* Classes referring to the tag by name.  */
+  ctf_id_t ln_parent_fwd;	/* Forward in the parent, if LN_PARENT_FWD.  */
+};
+
+#define	LN_AMBIGUOUS 0x1	/* Name is defined by more than one class.  */
+#define	LN_UNSHARED 0x2		/* Definition must not go in the parent.  */
+#define	LN_PARENT_FWD 0x4	/* Parent needs a forward to the tag.  */
+
+/* The number of shards of the class and name tables.  */
+
+#define	LK_NSHARDS 64
+
+/* An input container, and what the linker knows about each of its types.  The
+   arrays are indexed by type index, and only live during ctf_link().  */
+
+typedef struct ctf_link_input
+{
+  ctf_file_t *li_fp;		/* Input container.  */
+  char *li_name;		/* Name of the input, and of its child.  */
+  uint64_t *li_hash;		/* Structural hash of each type, two words.  */
+  unsigned char *li_state;	/* LI_* state of each type.  */
+  ctf_link_class_t **li_class;	/* Class of each type.  */
+  ctf_link_name_t **li_tag;	/* Tag of each named SUE type or forward.  */
+  ctf_id_t *li_out;		/* ID of each type in the output.  */
+  ctf_file_t *li_child;		/* Child container output for this input.  */
+
+  /* Type indexes grouped by the shard of their class, and of their name, in
+     order of type index within each shard, with the start of each shard.  */
+  uint32_t *li_cperm;
+  uint32_t *li_nperm;
+  uint32_t li_cstart[LK_NSHARDS + 1];
+  uint32_t li_nstart[LK_NSHARDS + 1];
+} ctf_link_input_t;
+
+#define	LI_BUSY 0x1		/* Type is being hashed.  */
+#define	LI_DONE 0x2		/* Type has been hashed.  */
+#define	LI_CYCLIC 0x4		/* Hash depends on where a cycle is entered.  */
+
+/* A shard of the class and name tables, only touched by one thread at once.  */
+
+typedef struct ctf_link_shard
+{
+  ctf_arena_t ls_arena;		/* Classes and names in the shard.  */
+  ctf_dynhash_t *ls_classes;	/* Classes, by structural hash.  */
+  ctf_dynhash_t *ls_names;	/* Names, by namespace and name.  */
+  ctf_link_class_t **ls_classv;	/* Classes, in order of discovery.  */
+  size_t ls_nclasses;		/* Number of classes.  */
+  size_t ls_aclasses;		/* Number of classes allocated.  */
+  ctf_link_name_t **ls_namev;	/* Names, in order of discovery.  */
+  size_t ls_nnames;		/* Number of names.  */
+  size_t ls_anames;		/* Number of names allocated.  */
+} ctf_link_shard_t;
+
+struct ctf_link
+{
+  ctf_link_input_t *lk_inputs;	/* Inputs, in the order they were added.  */
+  size_t lk_ninputs;		/* Number of inputs.  */
+  size_t lk_ainputs;		/* Number of inputs allocated.  */
+  ctf_file_t *lk_parent;	/* Parent container output, once linked.  */
+  char *lk_parname;		/* Name of the parent.  */
+
+  /* Working state of ctf_link(), released before it returns.  */
+  ctf_link_shard_t *lk_shards;	/* Shards of the class and name tables.  */
+  ctf_arena_t lk_arena;		/* User lists.  */
+  ctf_link_class_t **lk_classv;	/* All classes, in order of discovery.  */
+  size_t lk_nclasses;		/* Number of classes.  */
+  ctf_link_name_t **lk_namev;	/* All names, in order of discovery.  */
+  size_t lk_nnames;		/* Number of names.  */
+};
+
+/* Markers distinguishing the things folded into a structural hash.  */
+
+#define	LH_VOID	0x566f6964ULL		/* A reference to type zero.  */
+#define	LH_CYCLE 0x4379636cULL		/* A reference back into a cycle.  */
+#define	LH_TAG	(0x546167ULL << 32)	/* A tag reference, ORed with kind.  */
+#define	LH_DEF	(0x446566ULL << 32)	/* A type, ORed with its kind.  */
+
+/* The kinds of tag in each of the first three CTF_INDEX_* namespaces.  */
+
+static const uint32_t ctf_link_tag_kinds[] =
+  { CTF_K_STRUCT, CTF_K_UNION, CTF_K_ENUM };
+
+/* Structural hashes are 128 bits wide, in two lanes, so that two distinct types
+   colliding is not a practical concern: nothing else is compared.  */
+
+static void
+ctf_link_hash_init (uint64_t *h)
+{
+  h[0] = 0x9e3779b97f4a7c15ULL;
+  h[1] = 0x6a09e667f3bcc909ULL;
+}
+
+static void
+ctf_link_hash_word (uint64_t *h, uint64_t w)
+{
+  h[0] = (h[0] ^ w) * 0x9fb21c651e98df25ULL;
+  h[0] ^= h[0] >> 29;
+  h[1] = (h[1] + w) * 0xc4ceb9fe1a85ec53ULL;
+  h[1] ^= h[1] >> 31;
+}
+
+static void
+ctf_link_hash_str (uint64_t *h, const char *s)
+{
+  size_t len = strlen (s);
+  uint64_t w;
+
+  ctf_link_hash_word (h, len);
+
+  for (; len >= sizeof (w); s += sizeof (w), len -= sizeof (w))
+    {
+      memcpy (&w, s, sizeof (w));
+      ctf_link_hash_word (h, w);
+    }
+
+  if (len > 0)
+    {
+      w = 0;
+      memcpy (&w, s, len);
+      ctf_link_hash_word (h, w);
+    }
+}
+
+static unsigned int
+ctf_link_class_hash (const void *key)
+{
+  const ctf_link_class_t *lc = key;
+
+  return (unsigned int) (lc->lc_hash[0] ^ (lc->lc_hash[0] >> 32));
+}
+
+static int
+ctf_link_class_eq (const void *a, const void *b)
+{
+  const ctf_link_class_t *lca = a;
+  const ctf_link_class_t *lcb = b;
+
+  return (lca->lc_hash[0] == lcb->lc_hash[0]
+	  && lca->lc_hash[1] == lcb->lc_hash[1]);
+}
+
+static unsigned int
+ctf_link_name_hash (const void *key)
+{
+  const ctf_link_name_t *ln = key;
+
+  return ctf_hash_string (ln->ln_name) ^ (unsigned int) ln->ln_ns;
+}
+
+static int
+ctf_link_name_eq (const void *a, const void *b)
+{
+  const ctf_link_name_t *lna = a;
+  const ctf_link_name_t *lnb = b;
+
+  return (lna->ln_ns == lnb->ln_ns && strcmp (lna->ln_name, lnb->ln_name) == 0);
+}
+
+/* Make room for element N of the array *VP of *AP elements of size ELSIZE.  */
+
+static int
+ctf_link_grow (void **vp, size_t n, size_t *ap, size_t elsize)
+{
+  size_t a = (*ap != 0 ? *ap * 2 : 64);
+  void *v;
+
+  if (n < *ap)
+    return 0;
+
+  if ((v = ctf_realloc (*vp, a * elsize)) == NULL)
+    return EAGAIN;
+
+  *vp = v;
+  *ap = a;
+  return 0;
+}
+
+/* If the type at TP is a struct, union or enum with a name, or a forward,
+   return the kind of tag it defines or refers to and set *NAMEP to its name.
+   Otherwise, return zero.  */
+
+static uint32_t
+ctf_link_tag (ctf_file_t *fp, const ctf_type_t *tp, const char **namep)
+{
+  uint32_t kind = LCTF_INFO_KIND (fp, tp->ctt_info);
+  const char *name = ctf_strptr (fp, tp->ctt_name);
+
+  switch (kind)
+    {
+    case CTF_K_FORWARD:
+      kind = ctf_link_tag_kinds[ctf_name_space (kind, tp->ctt_type)];
+      break;
+    case CTF_K_STRUCT:
+    case CTF_K_UNION:
+    case CTF_K_ENUM:
+      if (name[0] == '\0')
+	return 0;
+      break;
+    default:
+      return 0;
+    }
+
+  *namep = name;
+  return kind;
+}
+
+/* If the type at TP has a name the linker keeps track of, return it and set
+   *NSP to its namespace.  These are the tags of structs, unions, enums and
+   forwards, and the names of root types in the ordinary namespace.  */
+
+static const char *
+ctf_link_type_name (ctf_file_t *fp, const ctf_type_t *tp, int *nsp)
+{
+  const char *name;
+  uint32_t tagkind;
+
+  if ((tagkind = ctf_link_tag (fp, tp, &name)) != 0)
+    {
+      *nsp = ctf_name_space (tagkind, 0);
+      return name;
+    }
+
+  if (LCTF_INFO_ISROOT (fp, tp->ctt_info)
+      && (name = ctf_strptr (fp, tp->ctt_name))[0] != '\0')
+    {
+      *nsp = CTF_INDEX_NAMES;
+      return name;
+    }
+
+  return NULL;
+}
+
+/* Get the name, type and bit offset of member N of the struct or union at TP,
+   whose size and increment are SIZE and INCREMENT.  */
+
+static void
+ctf_link_member (ctf_file_t *fp, const ctf_type_t *tp, ssize_t size,
+		 ssize_t increment, uint32_t n, const char **namep,
+		 uint32_t *typep, unsigned long *offsetp)
+{
+  if (size < CTF_LSTRUCT_THRESH)
+    {
+      const ctf_member_t *mp = (const ctf_member_t *) ((uintptr_t) tp +
+						       increment) + n;
+      *namep = ctf_strptr (fp, mp->ctm_name);
+      *typep = mp->ctm_type;
+      *offsetp = mp->ctm_offset;
+    }
+  else
+    {
+      const ctf_lmember_t *lmp = (const ctf_lmember_t *) ((uintptr_t) tp +
+							  increment) + n;
+      *namep = ctf_strptr (fp, lmp->ctlm_name);
+      *typep = lmp->ctlm_type;
+      *offsetp = (unsigned long) CTF_LMEM_OFFSET (lmp);
+    }
+}
+
+/* Call FUNC on each nonzero type ID referred to by the type with index IDX in
+   LI, stopping at the first nonzero return.  */
+
+typedef int ctf_link_ref_f (ctf_link_input_t *, uint32_t, void *);
+
+static int
+ctf_link_refs (ctf_link_input_t *li, uint32_t idx, ctf_link_ref_f *func,
+	       void *arg)
+{
+  ctf_file_t *fp = li->li_fp;
+  const ctf_type_t *tp = LCTF_INDEX_TO_TYPEPTR (fp, idx);
+  uint32_t kind = LCTF_INFO_KIND (fp, tp->ctt_info);
+  uint32_t vlen = LCTF_INFO_VLEN (fp, tp->ctt_info);
+  ssize_t size, increment;
+  const ctf_array_t *ap;
+  const uint32_t *args;
+  const char *name;
+  unsigned long offset;
+  uint32_t n, ref;
+  int err;
+
+  (void) ctf_get_ctt_size (fp, tp, &size, &increment);
+
+  switch (kind)
+    {
+    case CTF_K_POINTER:
+    case CTF_K_TYPEDEF:
+    case CTF_K_VOLATILE:
+    case CTF_K_CONST:
+    case CTF_K_RESTRICT:
+      if (tp->ctt_type != 0)
+	return func (li, tp->ctt_type, arg);
+      break;
+
+    case CTF_K_ARRAY:
+      ap = (const ctf_array_t *) ((uintptr_t) tp + increment);
+      if (ap->cta_contents != 0
+	  && (err = func (li, ap->cta_contents, arg)) != 0)
+	return err;
+      if (ap->cta_index != 0)
+	return func (li, ap->cta_index, arg);
+      break;
+
+    case CTF_K_FUNCTION:
+      if (tp->ctt_type != 0 && (err = func (li, tp->ctt_type, arg)) != 0)
+	return err;
+      args = (const uint32_t *) ((uintptr_t) tp + increment);
+      for (n = 0; n < vlen; n++)
+	if (args[n] != 0 && (err = func (li, args[n], arg)) != 0)
+	  return err;
+      break;
+
+    case CTF_K_STRUCT:
+    case CTF_K_UNION:
+      for (n = 0; n < vlen; n++)
+	{
+	  ctf_link_member (fp, tp, size, increment, n, &name, &ref, &offset);
+	  if (ref != 0 && (err = func (li, ref, arg)) != 0)
+	    return err;
+	}
+      break;
+    }
+
+  return 0;
+}
+
+static int ctf_link_hash_type (ctf_link_input_t *, uint32_t);
+
+/* Fold the hash of a reference to the type REF of LI into H.  If the result
+   depends on where a cycle was entered, set LI_CYCLIC in *STATEP.  */
+
+static int
+ctf_link_hash_ref (ctf_link_input_t *li, uint64_t *h, uint32_t ref,
+		   unsigned char *statep)
+{
+  ctf_file_t *fp = li->li_fp;
+  const char *name;
+  uint32_t kind;
+  int err;
+
+  if (ref == 0)
+    {
+      ctf_link_hash_word (h, LH_VOID);
+      return 0;
+    }
+
+  if (ref > fp->ctf_typemax)
+    return ECTF_BADID;
+
+  if ((kind = ctf_link_tag (fp, LCTF_INDEX_TO_TYPEPTR (fp, ref), &name)) != 0)
+    {
+      ctf_link_hash_word (h, LH_TAG | kind);
+      ctf_link_hash_str (h, name);
+      return 0;
+    }
+
+  /* Every cycle in C passes through a tag, so this only happens with odd or
+     corrupt input.  The hash is then not a function of the type alone, so the
+     types involved are kept out of the parent.  */
+
+  if (li->li_state[ref] & LI_BUSY)
+    {
+      ctf_link_hash_word (h, LH_CYCLE);
+      *statep |= LI_CYCLIC;
+      return 0;
+    }
+
+  if (!(li->li_state[ref] & LI_DONE)
+      && (err = ctf_link_hash_type (li, ref)) != 0)
+    return err;
+
+  *statep |= li->li_state[ref] & LI_CYCLIC;
+  ctf_link_hash_word (h, li->li_hash[ref * 2]);
+  ctf_link_hash_word (h, li->li_hash[ref * 2 + 1]);
+  return 0;
+}
+
+/* Compute the structural hash of the type with index IDX in LI.  Forwards hash
+   like references to their tag.  */
+
+static int
+ctf_link_hash_type (ctf_link_input_t *li, uint32_t idx)
+{
+  ctf_file_t *fp = li->li_fp;
+  const ctf_type_t *tp = LCTF_INDEX_TO_TYPEPTR (fp, idx);
+  uint32_t kind = LCTF_INFO_KIND (fp, tp->ctt_info);
+  uint32_t vlen = LCTF_INFO_VLEN (fp, tp->ctt_info);
+  unsigned char state = 0;
+  ssize_t size, increment;
+  const ctf_array_t *ap;
+  const ctf_enum_t *ep;
+  const uint32_t *args;
+  const char *name;
+  unsigned long offset;
+  uint32_t n, ref;
+  uint64_t h[2];
+  int err = 0;
+
+  (void) ctf_get_ctt_size (fp, tp, &size, &increment);
+  li->li_state[idx] |= LI_BUSY;
+  ctf_link_hash_init (h);
+
+  if (kind == CTF_K_FORWARD)
+    {
+      ctf_link_hash_word (h, LH_TAG | ctf_link_tag (fp, tp, &name));
+      ctf_link_hash_str (h, name);
+      goto done;
+    }
+
+  ctf_link_hash_word (h, LH_DEF | kind);
+  ctf_link_hash_word (h, LCTF_INFO_ISROOT (fp, tp->ctt_info));
+  ctf_link_hash_str (h, ctf_strptr (fp, tp->ctt_name));
+
+  switch (kind)
+    {
+    case CTF_K_INTEGER:
+    case CTF_K_FLOAT:
+      ctf_link_hash_word (h, size);
+      ctf_link_hash_word (h, *(const uint32_t *) ((uintptr_t) tp + increment));
+      break;
+
+    case CTF_K_POINTER:
+    case CTF_K_TYPEDEF:
+    case CTF_K_VOLATILE:
+    case CTF_K_CONST:
+    case CTF_K_RESTRICT:
+      err = ctf_link_hash_ref (li, h, tp->ctt_type, &state);
+      break;
+
+    case CTF_K_ARRAY:
+      ap = (const ctf_array_t *) ((uintptr_t) tp + increment);
+      ctf_link_hash_word (h, size);
+      ctf_link_hash_word (h, ap->cta_nelems);
+      if ((err = ctf_link_hash_ref (li, h, ap->cta_contents, &state)) == 0)
+	err = ctf_link_hash_ref (li, h, ap->cta_index, &state);
+      break;
+
+    case CTF_K_FUNCTION:
+      args = (const uint32_t *) ((uintptr_t) tp + increment);
+      ctf_link_hash_word (h, vlen);
+      err = ctf_link_hash_ref (li, h, tp->ctt_type, &state);
+      for (n = 0; err == 0 && n < vlen; n++)
+	err = ctf_link_hash_ref (li, h, args[n], &state);
+      break;
+
+    case CTF_K_STRUCT:
+    case CTF_K_UNION:
+      ctf_link_hash_word (h, size);
+      ctf_link_hash_word (h, vlen);
+      for (n = 0; err == 0 && n < vlen; n++)
+	{
+	  ctf_link_member (fp, tp, size, increment, n, &name, &ref, &offset);
+	  ctf_link_hash_str (h, name);
+	  ctf_link_hash_word (h, offset);
+	  err = ctf_link_hash_ref (li, h, ref, &state);
+	}
+      break;
+
+    case CTF_K_ENUM:
+      ep = (const ctf_enum_t *) ((uintptr_t) tp + increment);
+      ctf_link_hash_word (h, size);
+      ctf_link_hash_word (h, vlen);
+      for (n = 0; n < vlen; n++, ep++)
+	{
+	  ctf_link_hash_str (h, ctf_strptr (fp, ep->cte_name));
+	  ctf_link_hash_word (h, (uint32_t) ep->cte_value);
+	}
+      break;
+
+    default:
+      ctf_link_hash_word (h, size);
+    }
+
+ done:
+  li->li_hash[idx * 2] = h[0];
+  li->li_hash[idx * 2 + 1] = h[1];
+  li->li_state[idx] = (li->li_state[idx] & ~LI_BUSY) | LI_DONE | state;
+  return err;
+}
+
+/* Return the shard of the class with structural hash HASH.  */
+
+static unsigned int
+ctf_link_class_shard (const uint64_t *hash)
+{
+  return (unsigned int) (hash[1] % LK_NSHARDS);
+}
+
+/* Return the shard of NAME in namespace NS.  The low bits of the hash pick
+   slots in the shard's own table, so use others.  */
+
+static unsigned int
+ctf_link_name_shard (int ns, const char *name)
+{
+  ctf_link_name_t key;
+
+  key.ln_ns = ns;
+  key.ln_name = name;
+  return (ctf_link_name_hash (&key) >> 24) % LK_NSHARDS;
+}
+
+/* Group the NTYPES - 1 types in SHARDS by shard into PERM, with the start of
+   each group in START, leaving out types in shard LK_NSHARDS.  */
+
+static void
+ctf_link_group (const unsigned char *shards, unsigned long ntypes,
+		uint32_t *perm, uint32_t *start)
+{
+  uint32_t count[LK_NSHARDS + 1];
+  unsigned long idx;
+  unsigned int i;
+
+  memset (count, 0, sizeof (count));
+  for (idx = 1; idx < ntypes; idx++)
+    count[shards[idx]]++;
+
+  start[0] = 0;
+  for (i = 0; i < LK_NSHARDS; i++)
+    {
+      start[i + 1] = start[i] + count[i];
+      count[i] = start[i];
+    }
+
+  for (idx = 1; idx < ntypes; idx++)
+    if (shards[idx] < LK_NSHARDS)
+      perm[count[shards[idx]]++] = idx;
+}
+
+/* Allocate the per-type arrays of LI, hash all its types, and group them by the
+   shards of their classes and names.  */
+
+static int
+ctf_link_hash_input (ctf_link_input_t *li)
+{
+  ctf_file_t *fp = li->li_fp;
+  unsigned long ntypes = fp->ctf_typemax + 1;
+  unsigned char *shards;
+  unsigned long idx;
+  int err;
+
+  if ((li->li_hash = ctf_alloc (ntypes * sizeof (uint64_t) * 2)) == NULL
+      || (li->li_state = ctf_alloc (ntypes)) == NULL
+      || (li->li_class = ctf_alloc (ntypes * sizeof (ctf_link_class_t *)))
+	 == NULL
+      || (li->li_tag = ctf_alloc (ntypes * sizeof (ctf_link_name_t *))) == NULL
+      || (li->li_out = ctf_alloc (ntypes * sizeof (ctf_id_t))) == NULL
+      || (li->li_cperm = ctf_alloc (ntypes * sizeof (uint32_t))) == NULL
+      || (li->li_nperm = ctf_alloc (ntypes * sizeof (uint32_t))) == NULL)
+    return EAGAIN;
+
+  memset (li->li_state, 0, ntypes);
+  memset (li->li_tag, 0, ntypes * sizeof (ctf_link_name_t *));
+
+  for (idx = 1; idx < ntypes; idx++)
+    if (!(li->li_state[idx] & LI_DONE)
+	&& (err = ctf_link_hash_type (li, idx)) != 0)
+      return err;
+
+  if ((shards = ctf_alloc (ntypes)) == NULL)
+    return EAGAIN;
+
+  for (idx = 1; idx < ntypes; idx++)
+    shards[idx] = ctf_link_class_shard (&li->li_hash[idx * 2]);
+  ctf_link_group (shards, ntypes, li->li_cperm, li->li_cstart);
+
+  for (idx = 1; idx < ntypes; idx++)
+    {
+      const char *name;
+      int ns;
+
+      if ((name = ctf_link_type_name (fp, LCTF_INDEX_TO_TYPEPTR (fp, idx),
+				      &ns)) != NULL)
+	shards[idx] = ctf_link_name_shard (ns, name);
+      else
+	shards[idx] = LK_NSHARDS;
+    }
+  ctf_link_group (shards, ntypes, li->li_nperm, li->li_nstart);
+
+  ctf_free (shards, ntypes);
+  return 0;
+}
+
+static int
+ctf_link_hash_work (void *arg, unsigned long start, unsigned long end)
+{
+  ctf_link_t *lk = arg;
+  unsigned long i;
+  int err;
+
+  for (i = start; i < end; i++)
+    if ((err = ctf_link_hash_input (&lk->lk_inputs[i])) != 0)
+      return err;
+
+  return 0;
+}
+
+/* Return the class in shard LS with the structural hash HASH, creating it from
+   the type with index IDX of input INPUT if there is none yet.  */
+
+static ctf_link_class_t *
+ctf_link_class (ctf_link_shard_t *ls, const uint64_t *hash, uint32_t input,
+		uint32_t idx, uint32_t kind)
+{
+  ctf_link_class_t key, *lc;
+
+  key.lc_hash[0] = hash[0];
+  key.lc_hash[1] = hash[1];
+
+  if ((lc = ctf_dynhash_lookup (ls->ls_classes, &key)) != NULL)
+    return lc;
+
+  if (ctf_link_grow ((void **) &ls->ls_classv, ls->ls_nclasses,
+		     &ls->ls_aclasses, sizeof (ctf_link_class_t *)) != 0
+      || (lc = ctf_arena_alloc (&ls->ls_arena,
+				sizeof (ctf_link_class_t))) == NULL)
+    return NULL;
+
+  memset (lc, 0, sizeof (ctf_link_class_t));
+  lc->lc_hash[0] = hash[0];
+  lc->lc_hash[1] = hash[1];
+  lc->lc_input = input;
+  lc->lc_index = idx;
+  lc->lc_kind = kind;
+
+  if (ctf_dynhash_insert (ls->ls_classes, lc, lc) != 0)
+    return NULL;
+
+  ls->ls_classv[ls->ls_nclasses++] = lc;
+  return lc;
+}
+
+/* Return the entry in shard LS for NAME in namespace NS, creating it for the
+   type with index IDX of input INPUT if need be.  */
+
+static ctf_link_name_t *
+ctf_link_name (ctf_link_shard_t *ls, int ns, const char *name, uint32_t input,
+	       uint32_t idx)
+{
+  ctf_link_name_t key, *ln;
+
+  key.ln_ns = ns;
+  key.ln_name = name;
+
+  if ((ln = ctf_dynhash_lookup (ls->ls_names, &key)) != NULL)
+    return ln;
+
+  if (ctf_link_grow ((void **) &ls->ls_namev, ls->ls_nnames,
+		     &ls->ls_anames, sizeof (ctf_link_name_t *)) != 0
+      || (ln = ctf_arena_alloc (&ls->ls_arena,
+				sizeof (ctf_link_name_t))) == NULL)
+    return NULL;
+
+  memset (ln, 0, sizeof (ctf_link_name_t));
+  ln->ln_ns = ns;
+  ln->ln_name = name;
+  ln->ln_input = input;
+  ln->ln_index = idx;
+
+  if (ctf_dynhash_insert (ls->ls_names, ln, ln) != 0)
+    return NULL;
+
+  ls->ls_namev[ls->ls_nnames++] = ln;
+  return ln;
+}
+
+/* Note that LC defines the name LN.  */
+
+static void
+ctf_link_define (ctf_link_name_t *ln, ctf_link_class_t *lc)
+{
+  if (ln->ln_def == NULL)
+    ln->ln_def = lc;
+  else if (ln->ln_def != lc)
+    ln->ln_flags |= LN_AMBIGUOUS;
+
+  lc->lc_name = ln;
+}
+
+/* Sort the types in shards START to END into classes.  Each shard goes through
+   the inputs in order, so finds its classes in the same order whatever
+   thread it is on.  */
+
+static int
+ctf_link_class_work (void *arg, unsigned long start, unsigned long end)
+{
+  ctf_link_t *lk = arg;
+  unsigned long s;
+  uint32_t input, k;
+
+  for (s = start; s < end; s++)
+    {
+      ctf_link_shard_t *ls = &lk->lk_shards[s];
+
+      for (input = 0; input < lk->lk_ninputs; input++)
+	{
+	  ctf_link_input_t *li = &lk->lk_inputs[input];
+	  ctf_file_t *fp = li->li_fp;
+
+	  for (k = li->li_cstart[s]; k < li->li_cstart[s + 1]; k++)
+	    {
+	      uint32_t idx = li->li_cperm[k];
+	      const ctf_type_t *tp = LCTF_INDEX_TO_TYPEPTR (fp, idx);
+	      ctf_link_class_t *lc;
+
+	      if ((lc = ctf_link_class (ls, &li->li_hash[idx * 2], input, idx,
+					LCTF_INFO_KIND (fp, tp->ctt_info)))
+		  == NULL)
+		return EAGAIN;
+
+	      li->li_class[idx] = lc;
+
+	      if (lc->lc_lastinput != input + 1)
+		{
+		  lc->lc_lastinput = input + 1;
+		  lc->lc_ninputs++;
+		}
+
+	      if (li->li_state[idx] & LI_CYCLIC)
+		lc->lc_flags |= LC_UNSHARED;
+	    }
+	}
+    }
+
+  return 0;
+}
+
+/* Note the names of the types in shards START to END, the tags they are, and
+   the classes defining them.  This needs the classes of all types.  */
+
+static int
+ctf_link_name_work (void *arg, unsigned long start, unsigned long end)
+{
+  ctf_link_t *lk = arg;
+  unsigned long s;
+  uint32_t input, k;
+
+  for (s = start; s < end; s++)
+    {
+      ctf_link_shard_t *ls = &lk->lk_shards[s];
+
+      for (input = 0; input < lk->lk_ninputs; input++)
+	{
+	  ctf_link_input_t *li = &lk->lk_inputs[input];
+	  ctf_file_t *fp = li->li_fp;
+
+	  for (k = li->li_nstart[s]; k < li->li_nstart[s + 1]; k++)
+	    {
+	      uint32_t idx = li->li_nperm[k];
+	      const ctf_type_t *tp = LCTF_INDEX_TO_TYPEPTR (fp, idx);
+	      ctf_link_name_t *ln;
+	      const char *name;
+	      int ns;
+
+	      name = ctf_link_type_name (fp, tp, &ns);
+	      if ((ln = ctf_link_name (ls, ns, name, input, idx)) == NULL)
+		return EAGAIN;
+
+	      if (ns != CTF_INDEX_NAMES)
+		{
+		  li->li_tag[idx] = ln;
+		  if (LCTF_INFO_KIND (fp, tp->ctt_info) == CTF_K_FORWARD)
+		    continue;
+		}
+
+	      ctf_link_define (ln, li->li_class[idx]);
+	    }
+	}
+    }
+
+  return 0;
+}
+
+static int
+ctf_link_class_cmp (const void *a, const void *b)
+{
+  const ctf_link_class_t *lca = *(const ctf_link_class_t **) a;
+  const ctf_link_class_t *lcb = *(const ctf_link_class_t **) b;
+
+  if (lca->lc_input != lcb->lc_input)
+    return (lca->lc_input < lcb->lc_input ? -1 : 1);
+
+  return ((lca->lc_index > lcb->lc_index) - (lca->lc_index < lcb->lc_index));
+}
+
+static int
+ctf_link_name_cmp (const void *a, const void *b)
+{
+  const ctf_link_name_t *lna = *(const ctf_link_name_t **) a;
+  const ctf_link_name_t *lnb = *(const ctf_link_name_t **) b;
+
+  if (lna->ln_input != lnb->ln_input)
+    return (lna->ln_input < lnb->ln_input ? -1 : 1);
+
+  return ((lna->ln_index > lnb->ln_index) - (lna->ln_index < lnb->ln_index));
+}
+
+/* Merge the classes and names of all shards into lk_classv and lk_namev, in
+   the order of the types that first had them.  */
+
+static int
+ctf_link_merge (ctf_link_t *lk)
+{
+  size_t nclasses = 0, nnames = 0;
+  unsigned int s;
+
+  for (s = 0; s < LK_NSHARDS; s++)
+    {
+      nclasses += lk->lk_shards[s].ls_nclasses;
+      nnames += lk->lk_shards[s].ls_nnames;
+    }
+
+  /* One more of each, so that nothing is allocated with size zero.  */
+
+  if ((lk->lk_classv = ctf_alloc ((nclasses + 1)
+				  * sizeof (ctf_link_class_t *))) == NULL
+      || (lk->lk_namev = ctf_alloc ((nnames + 1)
+				    * sizeof (ctf_link_name_t *))) == NULL)
+    return EAGAIN;
+
+  for (s = 0; s < LK_NSHARDS; s++)
+    {
+      ctf_link_shard_t *ls = &lk->lk_shards[s];
+
+      if (ls->ls_nclasses > 0)
+	memcpy (lk->lk_classv + lk->lk_nclasses, ls->ls_classv,
+		ls->ls_nclasses * sizeof (ctf_link_class_t *));
+      if (ls->ls_nnames > 0)
+	memcpy (lk->lk_namev + lk->lk_nnames, ls->ls_namev,
+		ls->ls_nnames * sizeof (ctf_link_name_t *));
+      lk->lk_nclasses += ls->ls_nclasses;
+      lk->lk_nnames += ls->ls_nnames;
+    }
+
+  qsort (lk->lk_classv, lk->lk_nclasses, sizeof (ctf_link_class_t *),
+	 ctf_link_class_cmp);
+  qsort (lk->lk_namev, lk->lk_nnames, sizeof (ctf_link_name_t *),
+	 ctf_link_name_cmp);
+  return 0;
+}
+
+/* The class whose references ctf_link_add_user() is noting.  */
+
+typedef struct ctf_link_user_arg
+{
+  ctf_link_t *lua_link;
+  ctf_link_class_t *lua_class;
+} ctf_link_user_arg_t;
+
+/* Add a class to the list of users of the type REF of LI, or of its tag.  */
+
+static int
+ctf_link_add_user (ctf_link_input_t *li, uint32_t ref, void *arg)
+{
+  ctf_link_user_arg_t *lua = arg;
+  ctf_link_user_t *lu;
+
+  if ((lu = ctf_arena_alloc (&lua->lua_link->lk_arena,
+			     sizeof (ctf_link_user_t))) == NULL)
+    return EAGAIN;
+
+  lu->lu_class = lua->lua_class;
+
+  if (li->li_tag[ref] != NULL)
+    {
+      lu->lu_next = li->li_tag[ref]->ln_users;
+      li->li_tag[ref]->ln_users = lu;
+    }
+  else
+    {
+      lu->lu_next = li->li_class[ref]->lc_users;
+      li->li_class[ref]->lc_users = lu;
+    }
+
+  return 0;
+}
+
+/* Mark LC as unshareable, pushing it on STACK if it was not already.  */
+
+static void
+ctf_link_unshare (ctf_link_class_t *lc, ctf_link_class_t **stack, size_t *np)
+{
+  if (!(lc->lc_flags & LC_UNSHARED))
+    {
+      lc->lc_flags |= LC_UNSHARED;
+      stack[(*np)++] = lc;
+    }
+}
+
+/* Work out which classes cannot be shared: those defining ambiguous names,
+   those whose hash depends on a cycle, and everything referring to them.  */
+
+static int
+ctf_link_find_unshared (ctf_link_t *lk)
+{
+  ctf_link_user_arg_t lua;
+  ctf_link_class_t **stack;
+  ctf_link_user_t *lu;
+  size_t i, n = 0;
+  int err;
+
+  /* First, find who refers to whom.  */
+
+  lua.lua_link = lk;
+  for (i = 0; i < lk->lk_nclasses; i++)
+    {
+      ctf_link_class_t *lc = lk->lk_classv[i];
+
+      lua.lua_class = lc;
+      if ((err = ctf_link_refs (&lk->lk_inputs[lc->lc_input], lc->lc_index,
+				ctf_link_add_user, &lua)) != 0)
+	return err;
+    }
+
+  if ((stack = ctf_alloc (lk->lk_nclasses * sizeof (ctf_link_class_t *)
+			  + 1)) == NULL)
+    return EAGAIN;
+
+  for (i = 0; i < lk->lk_nclasses; i++)
+    {
+      ctf_link_class_t *lc = lk->lk_classv[i];
+
+      if ((lc->lc_flags & LC_UNSHARED)
+	  || (lc->lc_name != NULL && (lc->lc_name->ln_flags & LN_AMBIGUOUS)))
+	{
+	  lc->lc_flags &= ~LC_UNSHARED;
+	  ctf_link_unshare (lc, stack, &n);
+	}
+    }
+
+  while (n > 0)
+    {
+      ctf_link_class_t *lc = stack[--n];
+      ctf_link_name_t *ln = lc->lc_name;
+
+      for (lu = lc->lc_users; lu != NULL; lu = lu->lu_next)
+	ctf_link_unshare (lu->lu_class, stack, &n);
+
+      if (ln != NULL && !(ln->ln_flags & LN_UNSHARED))
+	{
+	  ln->ln_flags |= LN_UNSHARED;
+	  for (lu = ln->ln_users; lu != NULL; lu = lu->lu_next)
+	    ctf_link_unshare (lu->lu_class, stack, &n);
+	}
+    }
+
+  ctf_free (stack, lk->lk_nclasses * sizeof (ctf_link_class_t *) + 1);
+  return 0;
+}
+
+/* A stack of classes to visit.  */
+
+typedef struct ctf_link_stack
+{
+  ctf_link_class_t **ls_classes;
+  size_t ls_n;
+} ctf_link_stack_t;
+
+/* Put the class of the type REF of LI in the parent, or arrange for there to
+   be a forward to it there if it is a tag nobody defines.  */
+
+static int
+ctf_link_parent_ref (ctf_link_input_t *li, uint32_t ref, void *arg)
+{
+  ctf_link_stack_t *ls = arg;
+  ctf_link_name_t *ln = li->li_tag[ref];
+  ctf_link_class_t *lc = li->li_class[ref];
+
+  if (ln != NULL && (lc = ln->ln_def) == NULL)
+    {
+      ln->ln_flags |= LN_PARENT_FWD;
+      return 0;
+    }
+
+  if (!(lc->lc_flags & LC_PARENT))
+    {
+      lc->lc_flags |= LC_PARENT;
+      ls->ls_classes[ls->ls_n++] = lc;
+    }
+
+  return 0;
+}
+
+/* Work out which classes go in the parent: the shareable ones found in more
+   than one input, and everything they refer to.  */
+
+static int
+ctf_link_find_parent (ctf_link_t *lk)
+{
+  ctf_link_stack_t ls;
+  size_t i;
+  int err = 0;
+
+  if ((ls.ls_classes = ctf_alloc (lk->lk_nclasses
+				  * sizeof (ctf_link_class_t *) + 1)) == NULL)
+    return EAGAIN;
+
+  ls.ls_n = 0;
+
+  for (i = 0; i < lk->lk_nclasses; i++)
+    {
+      ctf_link_class_t *lc = lk->lk_classv[i];
+
+      if (lc->lc_ninputs > 1 && lc->lc_kind != CTF_K_FORWARD
+	  && !(lc->lc_flags & (LC_UNSHARED | LC_PARENT)))
+	{
+	  lc->lc_flags |= LC_PARENT;
+	  ls.ls_classes[ls.ls_n++] = lc;
+	}
+    }
+
+  while (ls.ls_n > 0 && err == 0)
+    {
+      ctf_link_class_t *lc = ls.ls_classes[--ls.ls_n];
+
+      err = ctf_link_refs (&lk->lk_inputs[lc->lc_input], lc->lc_index,
+			   ctf_link_parent_ref, &ls);
+    }
+
+  ctf_free (ls.ls_classes, lk->lk_nclasses * sizeof (ctf_link_class_t *) + 1);
+  return err;
+}
+
+/* Return the ID in the output of the type REF of LI: in the parent if CHILD is
+   zero, or else in LI's child.  */
+
+static ctf_id_t
+ctf_link_xlate (const ctf_link_input_t *li, uint32_t ref, int child)
+{
+  const ctf_link_name_t *ln;
+
+  if (ref == 0)
+    return 0;
+
+  if (child)
+    return li->li_out[ref];
+
+  if ((ln = li->li_tag[ref]) != NULL)
+    return (ln->ln_def != NULL ? ln->ln_def->lc_parent_id : ln->ln_parent_fwd);
+
+  return li->li_class[ref]->lc_parent_id;
+}
+
+/* Copy the type with index IDX of LI into DST, which is LI's child if CHILD is
+   nonzero and the parent otherwise.  It must get the ID EXPECT.  */
+
+static int
+ctf_link_emit (ctf_file_t *dst, ctf_link_input_t *li, uint32_t idx,
+	       int child, ctf_id_t expect)
+{
+  ctf_file_t *fp = li->li_fp;
+  const ctf_type_t *tp = LCTF_INDEX_TO_TYPEPTR (fp, idx);
+  uint32_t kind = LCTF_INFO_KIND (fp, tp->ctt_info);
+  uint32_t vlen = LCTF_INFO_VLEN (fp, tp->ctt_info);
+  uint32_t flag = LCTF_INFO_ISROOT (fp, tp->ctt_info);
+  const char *name = ctf_strptr (fp, tp->ctt_name);
+  ssize_t size, increment;
+  ctf_encoding_t en;
+  ctf_arinfo_t ar;
+  ctf_funcinfo_t fi;
+  ctf_id_t *argv;
+  const uint32_t *args;
+  const ctf_enum_t *ep;
+  const char *mname;
+  unsigned long offset;
+  uint32_t n, ref;
+  ctf_id_t type;
+
+  (void) ctf_get_ctt_size (fp, tp, &size, &increment);
+  if (name[0] == '\0')
+    name = NULL;
+
+  switch (kind)
+    {
+    case CTF_K_INTEGER:
+    case CTF_K_FLOAT:
+      if (ctf_type_encoding (fp, idx, &en) == CTF_ERR)
+	return ctf_errno (fp);
+      if (kind == CTF_K_INTEGER)
+	type = ctf_add_integer (dst, flag, name, &en);
+      else
+	type = ctf_add_float (dst, flag, name, &en);
+      break;
+
+    case CTF_K_POINTER:
+      type = ctf_add_pointer (dst, flag, ctf_link_xlate (li, tp->ctt_type,
+							 child));
+      break;
+    case CTF_K_VOLATILE:
+      type = ctf_add_volatile (dst, flag, ctf_link_xlate (li, tp->ctt_type,
+							  child));
+      break;
+    case CTF_K_CONST:
+      type = ctf_add_const (dst, flag, ctf_link_xlate (li, tp->ctt_type,
+						       child));
+      break;
+    case CTF_K_RESTRICT:
+      type = ctf_add_restrict (dst, flag, ctf_link_xlate (li, tp->ctt_type,
+							  child));
+      break;
+    case CTF_K_TYPEDEF:
+      type = ctf_add_typedef (dst, flag, name,
+			      ctf_link_xlate (li, tp->ctt_type, child));
+      break;
+
+    case CTF_K_ARRAY:
+      if (ctf_array_info (fp, idx, &ar) == CTF_ERR)
+	return ctf_errno (fp);
+      ar.ctr_contents = ctf_link_xlate (li, ar.ctr_contents, child);
+      ar.ctr_index = ctf_link_xlate (li, ar.ctr_index, child);
+      type = ctf_add_array (dst, flag, &ar);
+      break;
+
+    case CTF_K_FUNCTION:
+      args = (const uint32_t *) ((uintptr_t) tp + increment);
+      fi.ctc_return = ctf_link_xlate (li, tp->ctt_type, child);
+      fi.ctc_argc = vlen;
+      fi.ctc_flags = 0;
+
+      if (vlen > 0 && args[vlen - 1] == 0)
+	{
+	  fi.ctc_argc--;
+	  fi.ctc_flags |= CTF_FUNC_VARARG;
+	}
+
+      if ((argv = ctf_alloc (sizeof (ctf_id_t) * vlen + 1)) == NULL)
+	return EAGAIN;
+
+      for (n = 0; n < fi.ctc_argc; n++)
+	argv[n] = ctf_link_xlate (li, args[n], child);
+
+      type = ctf_add_function (dst, flag, &fi, argv);
+      ctf_free (argv, sizeof (ctf_id_t) * vlen + 1);
+      break;
+
+    case CTF_K_STRUCT:
+    case CTF_K_UNION:
+      if (kind == CTF_K_STRUCT)
+	type = ctf_add_struct_sized (dst, flag, name, size);
+      else
+	type = ctf_add_union_sized (dst, flag, name, size);
+
+      for (n = 0; type != CTF_ERR && n < vlen; n++)
+	{
+	  ctf_link_member (fp, tp, size, increment, n, &mname, &ref, &offset);
+	  if (ctf_add_member_raw (dst, type, mname[0] != '\0' ? mname : NULL,
+				  ctf_link_xlate (li, ref, child),
+				  offset) != 0)
+	    type = CTF_ERR;
+	}
+      break;
+
+    case CTF_K_ENUM:
+      type = ctf_add_enum (dst, flag, name);
+      ep = (const ctf_enum_t *) ((uintptr_t) tp + increment);
+
+      for (n = 0; type != CTF_ERR && n < vlen; n++, ep++)
+	if (ctf_add_enumerator (dst, type, ctf_strptr (fp, ep->cte_name),
+				ep->cte_value) != 0)
+	  type = CTF_ERR;
+      break;
+
+    case CTF_K_FORWARD:
+      type = ctf_add_forward (dst, flag, name, ctf_link_tag (fp, tp, &mname));
+      break;
+
+    default:
+      return ECTF_CORRUPT;
+    }
+
+  if (type == CTF_ERR)
+    return ctf_errno (dst);
+
+  if (type != expect)
+    return ECTF_CORRUPT;
+
+  return 0;
+}
+
+/* Create the parent, and fill it with the classes chosen for it.  */
+
+static int
+ctf_link_emit_parent (ctf_link_t *lk, int model)
+{
+  ctf_file_t *pfp;
+  unsigned long next;
+  size_t i;
+  int err;
+
+  if ((pfp = ctf_create (&err)) == NULL)
+    return err;
+
+  lk->lk_parent = pfp;
+  if (ctf_setmodel (pfp, model) < 0)
+    return ctf_errno (pfp);
+
+  next = pfp->ctf_dtnextid;
+
+  for (i = 0; i < lk->lk_nclasses; i++)
+    if (lk->lk_classv[i]->lc_flags & LC_PARENT)
+      lk->lk_classv[i]->lc_parent_id = LCTF_INDEX_TO_TYPE (pfp, next++, 0);
+
+  for (i = 0; i < lk->lk_nnames; i++)
+    if (lk->lk_namev[i]->ln_flags & LN_PARENT_FWD)
+      lk->lk_namev[i]->ln_parent_fwd = LCTF_INDEX_TO_TYPE (pfp, next++, 0);
+
+  for (i = 0; i < lk->lk_nclasses; i++)
+    {
+      ctf_link_class_t *lc = lk->lk_classv[i];
+
+      if ((lc->lc_flags & LC_PARENT)
+	  && (err = ctf_link_emit (pfp, &lk->lk_inputs[lc->lc_input],
+				   lc->lc_index, 0, lc->lc_parent_id)) != 0)
+	return err;
+    }
+
+  for (i = 0; i < lk->lk_nnames; i++)
+    {
+      ctf_link_name_t *ln = lk->lk_namev[i];
+
+      if ((ln->ln_flags & LN_PARENT_FWD)
+	  && (ctf_add_forward (pfp, CTF_ADD_ROOT, ln->ln_name,
+			       ctf_link_tag_kinds[ln->ln_ns])
+	      != ln->ln_parent_fwd))
+	return ctf_errno (pfp) != 0 ? ctf_errno (pfp) : ECTF_CORRUPT;
+    }
+
+  if (ctf_update (pfp) < 0)
+    return ctf_errno (pfp);
+
+  return 0;
+}
+
+static int
+ctf_link_variable (const char *name, ctf_id_t type, void *arg)
+{
+  ctf_link_input_t *li = arg;
+
+  if (type <= 0 || (unsigned long) type > li->li_fp->ctf_typemax)
+    return ECTF_BADID;
+
+  if (ctf_add_variable (li->li_child, name, li->li_out[type]) < 0)
+    return ctf_errno (li->li_child);
+
+  return 0;
+}
+
+/* Per-child state of ctf_link_fill_child(), mapping classes and names to the
+   IDs they have in the child.  */
+
+typedef struct ctf_link_child
+{
+  ctf_dynhash_t *lch_copies;	/* Class -> ID of its one shareable copy.  */
+  ctf_dynhash_t *lch_defs;	/* Name -> ID of its first definition.  */
+  ctf_dynhash_t *lch_fwds;	/* Name -> ID of its forward.  */
+} ctf_link_child_t;
+
+static ctf_id_t
+ctf_link_child_get (ctf_dynhash_t *h, const void *key)
+{
+  return (ctf_id_t) (uintptr_t) ctf_dynhash_lookup (h, key);
+}
+
+static int
+ctf_link_child_set (ctf_dynhash_t *h, const void *key, ctf_id_t id)
+{
+  return ctf_dynhash_insert (h, (void *) key, (void *) (uintptr_t) id);
+}
+
+/* Fill the child of input INPUT with the types of the input that are not in
+   the parent.  Types that could have been shared are only copied once per
+   child; the others are copied one for one, since their references to tags
+   must resolve to the same definitions as in the input.  Only the child and
+   the state of the input are changed, so the children of different inputs can
+   be filled at the same time.  */
+
+static int
+ctf_link_fill_child (ctf_link_t *lk, uint32_t input, ctf_link_child_t *lch)
+{
+  ctf_link_input_t *li = &lk->lk_inputs[input];
+  ctf_file_t *fp = li->li_fp;
+  ctf_file_t *cfp = li->li_child;
+  uint32_t *order;
+  unsigned long idx, next, norder = 0, i;
+  ctf_id_t id;
+  int err = 0;
+
+  if ((order = ctf_alloc ((fp->ctf_typemax + 1) * sizeof (uint32_t))) == NULL)
+    return EAGAIN;
+
+  /* Assign IDs to everything but forwards, which resolve to definitions if
+     there are any, and so must wait until all of those are known.  */
+
+  next = cfp->ctf_dtnextid;
+
+  for (idx = 1; idx <= fp->ctf_typemax && err == 0; idx++)
+    {
+      ctf_link_class_t *lc = li->li_class[idx];
+      ctf_link_name_t *ln = li->li_tag[idx];
+
+      if (lc->lc_kind == CTF_K_FORWARD)
+	continue;
+
+      if (lc->lc_flags & LC_PARENT)
+	li->li_out[idx] = lc->lc_parent_id;
+      else if (!(lc->lc_flags & LC_UNSHARED)
+	       && (id = ctf_link_child_get (lch->lch_copies, lc)) != 0)
+	li->li_out[idx] = id;
+      else
+	{
+	  li->li_out[idx] = LCTF_INDEX_TO_TYPE (cfp, next++, 1);
+	  order[norder++] = idx;
+	  err = ctf_link_child_set (lch->lch_copies, lc, li->li_out[idx]);
+	}
+
+      if (err == 0 && ln != NULL
+	  && ctf_link_child_get (lch->lch_defs, ln) == 0)
+	err = ctf_link_child_set (lch->lch_defs, ln, li->li_out[idx]);
+    }
+
+  for (idx = 1; idx <= fp->ctf_typemax && err == 0; idx++)
+    {
+      ctf_link_name_t *ln = li->li_tag[idx];
+
+      if (li->li_class[idx]->lc_kind != CTF_K_FORWARD)
+	continue;
+
+      if (ln->ln_def != NULL && (ln->ln_def->lc_flags & LC_PARENT))
+	li->li_out[idx] = ln->ln_def->lc_parent_id;
+      else if ((id = ctf_link_child_get (lch->lch_defs, ln)) != 0)
+	li->li_out[idx] = id;
+      else if (ln->ln_flags & LN_PARENT_FWD)
+	li->li_out[idx] = ln->ln_parent_fwd;
+      else if ((id = ctf_link_child_get (lch->lch_fwds, ln)) != 0)
+	li->li_out[idx] = id;
+      else
+	{
+	  li->li_out[idx] = LCTF_INDEX_TO_TYPE (cfp, next++, 1);
+	  order[norder++] = idx;
+	  err = ctf_link_child_set (lch->lch_fwds, ln, li->li_out[idx]);
+	}
+    }
+
+  for (i = 0; i < norder && err == 0; i++)
+    err = ctf_link_emit (cfp, li, order[i], 1, li->li_out[order[i]]);
+
+  ctf_free (order, (fp->ctf_typemax + 1) * sizeof (uint32_t));
+
+  if (err == 0)
+    err = ctf_variable_iter (fp, ctf_link_variable, li);
+
+  if (err == 0 && ctf_update (cfp) < 0)
+    err = ctf_errno (cfp);
+
+  return err;
+}
+
+static int
+ctf_link_child_work (void *arg, unsigned long start, unsigned long end)
+{
+  ctf_link_t *lk = arg;
+  ctf_link_child_t lch;
+  unsigned long i;
+  int err = 0;
+
+  for (i = start; i < end && err == 0; i++)
+    {
+      lch.lch_copies = ctf_dynhash_create (ctf_hash_integer,
+					   ctf_hash_eq_integer);
+      lch.lch_defs = ctf_dynhash_create (ctf_hash_integer, ctf_hash_eq_integer);
+      lch.lch_fwds = ctf_dynhash_create (ctf_hash_integer, ctf_hash_eq_integer);
+
+      if (lch.lch_copies == NULL || lch.lch_defs == NULL
+	  || lch.lch_fwds == NULL)
+	err = EAGAIN;
+      else
+	err = ctf_link_fill_child (lk, i, &lch);
+
+      if (lch.lch_copies != NULL)
+	ctf_dynhash_destroy (lch.lch_copies);
+      if (lch.lch_defs != NULL)
+	ctf_dynhash_destroy (lch.lch_defs);
+      if (lch.lch_fwds != NULL)
+	ctf_dynhash_destroy (lch.lch_fwds);
+    }
+
+  return err;
+}
+
+/* Create the children of all inputs, importing the parent, and fill them.  */
+
+static int
+ctf_link_emit_children (ctf_link_t *lk, int model)
+{
+  size_t i;
+  int err;
+
+  for (i = 0; i < lk->lk_ninputs; i++)
+    {
+      ctf_file_t *cfp;
+
+      if ((cfp = ctf_create (&err)) == NULL)
+	return err;
+
+      lk->lk_inputs[i].li_child = cfp;
+      ctf_parent_name_set (cfp, lk->lk_parname);
+      if (ctf_setmodel (cfp, model) < 0 || ctf_import (cfp, lk->lk_parent) < 0)
+	return ctf_errno (cfp);
+    }
+
+  return ctf_parallel (lk->lk_ninputs, 1, ctf_link_child_work, lk);
+}
+
+/* Release the working state of ctf_link().  */
+
+static void
+ctf_link_free_work (ctf_link_t *lk)
+{
+  size_t i;
+
+  for (i = 0; i < lk->lk_ninputs; i++)
+    {
+      ctf_link_input_t *li = &lk->lk_inputs[i];
+      unsigned long ntypes = li->li_fp->ctf_typemax + 1;
+
+      ctf_free (li->li_hash, ntypes * sizeof (uint64_t) * 2);
+      ctf_free (li->li_state, ntypes);
+      ctf_free (li->li_class, ntypes * sizeof (ctf_link_class_t *));
+      ctf_free (li->li_tag, ntypes * sizeof (ctf_link_name_t *));
+      ctf_free (li->li_out, ntypes * sizeof (ctf_id_t));
+      ctf_free (li->li_cperm, ntypes * sizeof (uint32_t));
+      ctf_free (li->li_nperm, ntypes * sizeof (uint32_t));
+      li->li_hash = NULL;
+      li->li_state = NULL;
+      li->li_class = NULL;
+      li->li_tag = NULL;
+      li->li_out = NULL;
+      li->li_cperm = NULL;
+      li->li_nperm = NULL;
+    }
+
+  if (lk->lk_shards != NULL)
+    {
+      for (i = 0; i < LK_NSHARDS; i++)
+	{
+	  ctf_link_shard_t *ls = &lk->lk_shards[i];
+
+	  if (ls->ls_classes != NULL)
+	    ctf_dynhash_destroy (ls->ls_classes);
+	  if (ls->ls_names != NULL)
+	    ctf_dynhash_destroy (ls->ls_names);
+	  ctf_free (ls->ls_classv,
+		    ls->ls_aclasses * sizeof (ctf_link_class_t *));
+	  ctf_free (ls->ls_namev, ls->ls_anames * sizeof (ctf_link_name_t *));
+	  ctf_arena_destroy (&ls->ls_arena);
+	}
+      ctf_free (lk->lk_shards, LK_NSHARDS * sizeof (ctf_link_shard_t));
+    }
+
+  ctf_free (lk->lk_classv, (lk->lk_nclasses + 1) * sizeof (ctf_link_class_t *));
+  ctf_free (lk->lk_namev, (lk->lk_nnames + 1) * sizeof (ctf_link_name_t *));
+  ctf_arena_destroy (&lk->lk_arena);
+
+  lk->lk_shards = NULL;
+  lk->lk_classv = NULL;
+  lk->lk_namev = NULL;
+  lk->lk_nclasses = 0;
+  lk->lk_nnames = 0;
+}
+
+/* Close the output containers, if any.  */
+
+static void
+ctf_link_free_output (ctf_link_t *lk)
+{
+  size_t i;
+
+  for (i = 0; i < lk->lk_ninputs; i++)
+    {
+      ctf_close (lk->lk_inputs[i].li_child);
+      lk->lk_inputs[i].li_child = NULL;
+    }
+
+  ctf_close (lk->lk_parent);
+  lk->lk_parent = NULL;
+
+  if (lk->lk_parname != NULL)
+    ctf_free (lk->lk_parname, strlen (lk->lk_parname) + 1);
+  lk->lk_parname = NULL;
+}
+
+/* Create a new, empty, link.  */
+
+ctf_link_t *
+ctf_link_create (int *errp)
+{
+  ctf_link_t *lk;
+
+  if ((lk = ctf_alloc (sizeof (ctf_link_t))) == NULL)
+    {
+      if (errp != NULL)
+	*errp = EAGAIN;
+      return NULL;
+    }
+
+  memset (lk, 0, sizeof (ctf_link_t));
+  return lk;
+}
+
+/* Add FP to the inputs of the link under the given NAME, which its child will
+   have in the output.  The link holds a reference to FP until it is closed.
+   Only the types FP had at its last ctf_update() are linked.  Returns zero or
+   an error code.  */
+
+int
+ctf_link_add (ctf_link_t *lk, ctf_file_t *fp, const char *name)
+{
+  ctf_link_input_t *li;
+  size_t i;
+
+  if (fp == NULL || name == NULL || lk->lk_parent != NULL)
+    return EINVAL;
+
+  /* Child containers would need their parents linked along with them.  */
+
+  if (fp->ctf_flags & LCTF_CHILD)
+    return ECTF_NOTSUP;
+
+  for (i = 0; i < lk->lk_ninputs; i++)
+    if (strcmp (lk->lk_inputs[i].li_name, name) == 0)
+      return ECTF_DUPLICATE;
+
+  if (ctf_link_grow ((void **) &lk->lk_inputs, lk->lk_ninputs,
+		     &lk->lk_ainputs, sizeof (ctf_link_input_t)) != 0)
+    return EAGAIN;
+
+  li = &lk->lk_inputs[lk->lk_ninputs];
+  memset (li, 0, sizeof (ctf_link_input_t));
+
+  if ((li->li_name = ctf_strdup (name)) == NULL)
+    return EAGAIN;
+
+  li->li_fp = fp;
+  __atomic_add_fetch (&fp->ctf_refcnt, 1, __ATOMIC_RELAXED);
+  lk->lk_ninputs++;
+  return 0;
+}
+
+/* Link the inputs, creating a parent container named PARNAME and a child for
+   each input.  Returns zero or an error code; on error, there is no output, and
+   the link may be tried again.  */
+
+int
+ctf_link (ctf_link_t *lk, const char *parname)
+{
+  int model = CTF_MODEL_NATIVE;
+  size_t i;
+  int err = 0;
+
+  if (parname == NULL || lk->lk_parent != NULL)
+    return EINVAL;
+
+  if (lk->lk_ninputs > 0)
+    model = ctf_getmodel (lk->lk_inputs[0].li_fp);
+
+  for (i = 0; i < lk->lk_ninputs; i++)
+    if (ctf_getmodel (lk->lk_inputs[i].li_fp) != model)
+      return ECTF_DMODEL;
+
+  if ((lk->lk_parname = ctf_strdup (parname)) == NULL
+      || (lk->lk_shards = ctf_alloc (LK_NSHARDS
+				     * sizeof (ctf_link_shard_t))) == NULL)
+    {
+      err = EAGAIN;
+      goto out;
+    }
+
+  memset (lk->lk_shards, 0, LK_NSHARDS * sizeof (ctf_link_shard_t));
+  for (i = 0; i < LK_NSHARDS; i++)
+    {
+      ctf_link_shard_t *ls = &lk->lk_shards[i];
+
+      if ((ls->ls_classes = ctf_dynhash_create (ctf_link_class_hash,
+						ctf_link_class_eq)) == NULL
+	  || (ls->ls_names = ctf_dynhash_create (ctf_link_name_hash,
+						 ctf_link_name_eq)) == NULL)
+	{
+	  err = EAGAIN;
+	  goto out;
+	}
+    }
+
+  /* Names are only noted once every type has its class, since definitions
+     are recorded against classes.  */
+
+  err = ctf_parallel (lk->lk_ninputs, 1, ctf_link_hash_work, lk);
+
+  if (err == 0)
+    err = ctf_parallel (LK_NSHARDS, 1, ctf_link_class_work, lk);
+
+  if (err == 0)
+    err = ctf_parallel (LK_NSHARDS, 1, ctf_link_name_work, lk);
+
+  if (err == 0)
+    err = ctf_link_merge (lk);
+
+  if (err == 0)
+    err = ctf_link_find_unshared (lk);
+
+  if (err == 0)
+    err = ctf_link_find_parent (lk);
+
+  if (err == 0)
+    err = ctf_link_emit_parent (lk, model);
+
+  if (err == 0)
+    err = ctf_link_emit_children (lk, model);
+
+ out:
+  ctf_link_free_work (lk);
+  if (err != 0)
+    ctf_link_free_output (lk);
+
+  ctf_dprintf ("ctf_link(): linked %zu inputs: %s\n", lk->lk_ninputs,
+	       err == 0 ? "ok" : ctf_errmsg (err));
+  return err;
+}
+
+/* Return the parent container output by ctf_link(), which lives as long as the
+   link does.  */
+
+ctf_file_t *
+ctf_link_parent (ctf_link_t *lk)
+{
+  return lk->lk_parent;
+}
+
+/* Return the child container output by ctf_link() for the input of the given
+   NAME, which lives as long as the link does.  */
+
+ctf_file_t *
+ctf_link_child (ctf_link_t *lk, const char *name)
+{
+  size_t i;
+
+  for (i = 0; i < lk->lk_ninputs; i++)
+    if (strcmp (lk->lk_inputs[i].li_name, name) == 0)
+      return lk->lk_inputs[i].li_child;
+
+  return NULL;
+}
+
+/* Write the output of ctf_link() to an archive in FILE, the parent first, then
+   the children in the order their inputs were added.  THRESHOLD is passed to
+   ctf_arc_write().  Returns zero or an error code.  */
+
+int
+ctf_link_write (ctf_link_t *lk, const char *file, size_t threshold)
+{
+  ctf_file_t **files;
+  const char **names;
+  size_t i;
+  int err;
+
+  if (lk->lk_parent == NULL)
+    return EINVAL;
+
+  files = ctf_alloc ((lk->lk_ninputs + 1) * sizeof (ctf_file_t *));
+  names = ctf_alloc ((lk->lk_ninputs + 1) * sizeof (const char *));
+
+  if (files == NULL || names == NULL)
+    {
+      err = EAGAIN;
+      goto out;
+    }
+
+  files[0] = lk->lk_parent;
+  names[0] = lk->lk_parname;
+
+  for (i = 0; i < lk->lk_ninputs; i++)
+    {
+      files[i + 1] = lk->lk_inputs[i].li_child;
+      names[i + 1] = lk->lk_inputs[i].li_name;
+    }
+
+  err = ctf_arc_write (file, files, lk->lk_ninputs + 1, names, threshold);
+
+ out:
+  if (files != NULL)
+    ctf_free (files, (lk->lk_ninputs + 1) * sizeof (ctf_file_t *));
+  if (names != NULL)
+    ctf_free (names, (lk->lk_ninputs + 1) * sizeof (const char *));
+  return err;
+}
+
+/* Close a link, its outputs, and its references to its inputs.  */
+
+void
+ctf_link_close (ctf_link_t *lk)
+{
+  size_t i;
+
+  if (lk == NULL)
+    return;
+
+  ctf_link_free_output (lk);
+
+  for (i = 0; i < lk->lk_ninputs; i++)
+    {
+      ctf_close (lk->lk_inputs[i].li_fp);
+      ctf_free (lk->lk_inputs[i].li_name,
+		strlen (lk->lk_inputs[i].li_name) + 1);
+    }
+
+  ctf_free (lk->lk_inputs, lk->lk_ainputs * sizeof (ctf_link_input_t));
+  ctf_free (lk, sizeof (ctf_link_t));
+}
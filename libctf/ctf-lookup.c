@@ -49,6 +49,46 @@ isqualifier (const char *s, size_t len)
 	  strncmp (qp->q_name, s, qp->q_len) == 0);
 }
 
+/* Look up the type named by the LEN bytes at NAME in namespace NS of the types
+   added to writable container FP since the last ctf_update(), returning zero if
+   there is none, or if LEN is zero or too large to copy.  Root-visible types
+   are preferred, and types other than forwards are preferred to forwards, as
+   for committed types.  */
+
+static ctf_id_t
+ctf_lookup_dynamic (ctf_file_t *fp, int ns, const char *name, size_t len)
+{
+  const ctf_dtdef_t *dtd;
+  ctf_id_t type = 0;
+  int best = -1;
+  char *s;
+
+  if (!(fp->ctf_flags & LCTF_RDWR) || len == 0 || len == SIZE_MAX
+      || (s = ctf_alloc (len + 1)) == NULL)
+    return 0;
+
+  memcpy (s, name, len);
+  s[len] = '\0';
+
+  for (dtd = ctf_dtd_lookup_name (fp, ns, s); dtd != NULL
+	 && LCTF_TYPE_TO_INDEX (fp, dtd->dtd_type) > fp->ctf_dtoldid;
+       dtd = dtd->dtd_nameprev)
+    {
+      uint32_t info = dtd->dtd_data.ctt_info;
+      int rank = ((LCTF_INFO_ISROOT (fp, info) ? 2 : 0)
+		  + (LCTF_INFO_KIND (fp, info) != CTF_K_FORWARD));
+
+      if (rank > best)
+	{
+	  type = dtd->dtd_type;
+	  best = rank;
+	}
+    }
+
+  ctf_free (s, len + 1);
+  return type;
+}
+
 /* Attempt to convert the given C type name into the corresponding CTF type ID.
    It is not possible to do complete and proper conversion of type names
    without implementing a more full-fledged parser, which is necessary to
@@ -56,7 +96,9 @@ isqualifier (const char *s, size_t len)
    have arguments that are function pointers, and fun stuff like that.
    Instead, this function implements a very simple conversion algorithm that
    finds the things that we actually care about: structs, unions, enums,
-   integers, floats, typedefs, and pointers to any of these named types.  */
+   integers, floats, typedefs, and pointers to any of these named types.  The
+   types of writable containers are found whether or not they have been
+   committed by ctf_update(), though pointers to uncommitted types are not.  */
 
 ctf_id_t
 ctf_lookup_by_name (ctf_file_t *fp, const char *name)
@@ -68,10 +110,14 @@ ctf_lookup_by_name (ctf_file_t *fp, const char *name)
   const char *p, *q, *end;
   ctf_id_t type = 0;
   ctf_id_t ntype, ptype;
+  int err;
 
   if (name == NULL)
     return (ctf_set_errno (fp, EINVAL));
 
+  if ((err = ctf_init_hashes (fp)) != 0)
+    return (ctf_set_errno (fp, err));
+
   for (p = name, end = name + strlen (name); *p != '\0'; p = q)
     {
       while (isspace (*p))
@@ -95,7 +141,9 @@ ctf_lookup_by_name (ctf_file_t *fp, const char *name)
 
 	     TODO need to handle parent containers too.  */
 
-	  ntype = fp->ctf_ptrtab[LCTF_TYPE_TO_INDEX (fp, type)];
+	  ntype = 0;
+	  if (LCTF_TYPE_TO_INDEX (fp, type) <= fp->ctf_typemax)
+	    ntype = fp->ctf_ptrtab[LCTF_TYPE_TO_INDEX (fp, type)];
 	  if (ntype == 0)
 	    {
 	      ntype = ctf_type_resolve (fp, type);
@@ -132,14 +180,22 @@ ctf_lookup_by_name (ctf_file_t *fp, const char *name)
 	      while (isspace (q[-1]))
 		q--;		/* Exclude trailing whitespace.  */
 
+	      if (q <= p)
+		{
+		  /* A prefix naming no type, as in "struct *".  */
+		  (void) ctf_set_errno (fp, ECTF_SYNTAX);
+		  goto err;
+		}
+
 	      if ((hp = ctf_hash_lookup (lp->ctl_hash, fp, p,
-					 (size_t) (q - p))) == NULL)
+					 (size_t) (q - p))) != NULL)
+		type = hp->h_type;
+	      else if ((type = ctf_lookup_dynamic (fp, lp - fp->ctf_lookups,
+						   p, (size_t) (q - p))) == 0)
 		{
 		  (void) ctf_set_errno (fp, ECTF_NOTYPE);
 		  goto err;
 		}
-
-	      type = hp->h_type;
 	      break;
 	    }
 	}
@@ -191,6 +247,7 @@ ctf_lookup_variable (ctf_file_t *fp, const char *name)
 
   /* This array is sorted, so we can bsearch for it.  */
 
+  LCTF_CHUNK (fp, fp->ctf_vars, fp->ctf_nvars * sizeof (ctf_varent_t));
   ent = bsearch (&key, fp->ctf_vars, fp->ctf_nvars, sizeof (ctf_varent_t),
 		 ctf_lookup_var);
 
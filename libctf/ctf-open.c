@@ -8,12 +8,12 @@
    COPYING in the top level of this tree.  */
 
 #include <string.h>
+#include <sched.h>
 #include <sys/types.h>
 #include <assert.h>
 #include <gelf.h>
 #include <ctf-impl.h>
 #include <sys/mman.h>
-#include <zlib.h>
 
 static const ctf_dmodel_t _libctf_models[] = {
   {"ILP32", CTF_MODEL_ILP32, 4, 1, 2, 4, 4},
@@ -26,6 +26,7 @@ const char _CTF_NULLSTR[] = "";
 
 int _libctf_version = CTF_VERSION;	      /* Library client version.  */
 int _libctf_debug = 0;			      /* Debugging messages enabled.  */
+int _libctf_open_flags = 0;		      /* Flags for ctf_bufopen().  */
 
 /* Version-sensitive accessors.  (In the !NO_COMPAT case, there are many of
    these, one per version per field and sometimes more.)  */
@@ -252,6 +253,8 @@ init_symtab (ctf_file_t *fp, const ctf_header_t *hp,
   Elf64_Sym sym, *gsp;
   const char *name;
 
+  LCTF_CHUNK (fp, fp->ctf_buf + objtoff, hp->cth_varoff - objtoff);
+
   /* The CTF data object and function type sections are ordered to match
      the relative order of the respective symbol types in the symtab.
      If no type information is available for a symbol table entry, a
@@ -326,7 +329,7 @@ init_symtab (ctf_file_t *fp, const ctf_header_t *hp,
 /* Set the CTF base pointer and derive the buf pointer from it, initializing
    everything in the ctf_file that depends on the base or buf pointers.  */
 
-static void
+void
 ctf_set_base (ctf_file_t *fp, const ctf_header_t *hp, void *base)
 {
   fp->ctf_base = base;
@@ -632,270 +635,530 @@ upgrade_types (ctf_file_t *fp, ctf_header_t *cth)
 }
 #endif /* !NO_COMPAT */
 
-/* Initialize the type ID translation table with the byte offset of each type,
-   and initialize the hash tables of each named type.  Upgrade the type table to
-   the latest supported representation in the process, if needed, and if this
-   recension of libctf supports upgrading.  */
+/* Find the index at the end of the string table, if there is one, and check
+   its header.  The index is left out of the bounds of the string table.  */
+
+static void
+init_index_header (ctf_file_t *fp, const ctf_header_t *cth)
+{
+  const char *strs = fp->ctf_str[CTF_STRTAB_0].cts_strs;
+  const ctf_index_t *cti;
+  size_t len;
+
+  if (!(cth->cth_flags & CTF_F_INDEX) || fp->ctf_version != CTF_VERSION_2
+      || cth->cth_strlen < sizeof (ctf_index_t))
+    return;
+
+  len = cth->cth_strlen - sizeof (ctf_index_t);
+  cti = (const ctf_index_t *) (strs + len);
+
+  /* The buffer may not be suitably aligned if it came straight from a
+     caller.  */
+
+  if (((uintptr_t) cti & 3) != 0)
+    return;
+
+  LCTF_CHUNK (fp, cti, sizeof (ctf_index_t));
+
+  if (cti->cti_magic != CTF_INDEX_MAGIC
+      || cti->cti_version != CTF_INDEX_VERSION)
+    {
+      ctf_dprintf ("Ignoring index, version %u\n", cti->cti_version);
+      return;
+    }
+
+  if (cti->cti_strlen == 0 || cti->cti_strlen > len)
+    return;
+
+  /* All the tables in the index are needed from here on.  */
+
+  LCTF_CHUNK (fp, strs + cti->cti_strlen - 1, len - cti->cti_strlen + 1);
+
+  if (strs[cti->cti_strlen - 1] != '\0')
+    return;
+
+  fp->ctf_index = cti;
+  fp->ctf_str[CTF_STRTAB_0].cts_len = cti->cti_strlen;
+}
+
+/* Use the type offset and pointer tables in the index, if there are any, in
+   place of walking the type section.  Returns zero if they were usable.  */
 
 static int
-init_types (ctf_file_t *fp, ctf_header_t *cth)
+init_type_index (ctf_file_t *fp, const ctf_header_t *cth)
 {
-  const ctf_type_t *tbuf;
-  const ctf_type_t *tend;
+  const ctf_index_t *cti = fp->ctf_index;
+  const char *strs = fp->ctf_str[CTF_STRTAB_0].cts_strs;
+  const uint32_t *txlate, *ptrtab;
+  uint32_t ntypes, id;
+  size_t len;
+  int i;
 
-  unsigned long pop[CTF_K_MAX + 1] = { 0 };
-  const ctf_type_t *tp;
-  ctf_hash_t *hp;
-  uint32_t id, dst;
-  uint32_t *xp;
+  if (cti == NULL || cti->cti_typeoff == 0)
+    return ENOENT;
 
-  /* We determine whether the container is a child or a parent based on
-     the value of cth_parname.  */
+  len = (const char *) cti - strs;
+  ntypes = cti->cti_ntypes;
 
-  int child = cth->cth_parname != 0;
-  int nlstructs = 0, nlunions = 0;
-  int err;
+  if (ntypes > (cth->cth_stroff - cth->cth_typeoff) / sizeof (ctf_stype_t)
+      || (cti->cti_typeoff & 3) != 0 || (cti->cti_ptroff & 3) != 0
+      || (uint64_t) cti->cti_typeoff
+	 + ((uint64_t) ntypes + 1) * sizeof (uint32_t) > len
+      || (uint64_t) cti->cti_ptroff
+	 + ((uint64_t) ntypes + 1) * sizeof (uint32_t) > len)
+    return ECTF_CORRUPT;
 
-#ifndef NO_COMPAT
-  if (_libctf_unlikely_ (fp->ctf_version == CTF_VERSION_1))
+  txlate = (const uint32_t *) (strs + cti->cti_typeoff);
+  ptrtab = (const uint32_t *) (strs + cti->cti_ptroff);
+
+  /* Every type must start in the type section, in order.  The records
+     themselves are trusted just as when walking the section.  */
+
+  if (txlate[0] != 0 || (ntypes > 0 && txlate[1] != cth->cth_typeoff))
+    return ECTF_CORRUPT;
+
+  for (id = 1; id <= ntypes; id++)
     {
-      int err;
-      if ((err = upgrade_types (fp, cth)) != 0)
-	return err;				/* Upgrade failed.  */
+      if ((txlate[id] & 3) != 0
+	  || txlate[id] > cth->cth_stroff - sizeof (ctf_stype_t)
+	  || (id > 1 && txlate[id] <= txlate[id - 1]))
+	return ECTF_CORRUPT;
     }
-#endif /* !NO_COMPAT */
 
-  tbuf = (ctf_type_t *) (fp->ctf_buf + cth->cth_typeoff);
-  tend = (ctf_type_t *) (fp->ctf_buf + cth->cth_stroff);
+  for (id = 0; id <= ntypes; id++)
+    {
+      if (ptrtab[id] > ntypes)
+	return ECTF_CORRUPT;
+    }
 
-  /* We make two passes through the entire type section.  In this first
-     pass, we count the number of each type and the total number of types.  */
+  fp->ctf_txlate = (uint32_t *) txlate;
+  fp->ctf_ptrtab = (uint32_t *) ptrtab;
+  fp->ctf_typemax = ntypes;
+  fp->ctf_flags |= LCTF_TXMAPPED;
 
-  for (tp = tbuf; tp < tend; fp->ctf_typemax++)
+  /* The name hashes in the index tell us how large to make the hashes if they
+     have to be built after all.  */
+
+  for (i = 0; i < CTF_INDEX_MAX; i++)
     {
-      unsigned short kind = LCTF_INFO_KIND (fp, tp->ctt_info);
-      unsigned long vlen = LCTF_INFO_VLEN (fp, tp->ctt_info);
-      ssize_t size, increment, vbytes;
+      fp->ctf_hashsize[i] = cti->cti_hash[i].cih_nelems;
+      if (fp->ctf_hashsize[i] > 0)
+	fp->ctf_hashsize[i]--;
+      if (fp->ctf_hashsize[i] > ntypes)
+	fp->ctf_hashsize[i] = ntypes;
+    }
 
-      (void) ctf_get_ctt_size (fp, tp, &size, &increment);
-      vbytes = LCTF_VBYTES (fp, kind, size, vlen);
+  ctf_dprintf ("%lu types indexed\n", fp->ctf_typemax);
+  return 0;
+}
 
-      if (vbytes < 0)
-	return ECTF_CORRUPT;
+/* Map the name hashes in the index, if there is one, in place of hashing every
+   type name.  Returns zero if the index was usable: anything else just means
+   we fall back to building the hashes.  */
 
-      if (kind == CTF_K_FORWARD)
-	{
-	  /* For forward declarations, ctt_type is the CTF_K_* kind for the tag,
-	     so bump that population count too.  If ctt_type is unknown, treat
-	     the tag as a struct.  */
+static int
+init_index (ctf_file_t *fp)
+{
+  ctf_hash_t *hashes[CTF_INDEX_MAX] = { &fp->ctf_structs, &fp->ctf_unions,
+					&fp->ctf_enums, &fp->ctf_names };
+  const ctf_index_t *cti = fp->ctf_index;
+  const char *strs = fp->ctf_str[CTF_STRTAB_0].cts_strs;
+  uint64_t seed;
+  size_t len;
+  int i, err;
 
-	  if (tp->ctt_type == CTF_K_UNKNOWN || tp->ctt_type >= CTF_K_MAX)
-	    pop[CTF_K_STRUCT]++;
-	  else
-	    pop[tp->ctt_type]++;
+  if (cti == NULL)
+    return ENOENT;
+
+  len = (const char *) cti - strs;
+  seed = ((uint64_t) cti->cti_seedhi << 32) | cti->cti_seedlo;
+
+  for (i = 0; i < CTF_INDEX_MAX; i++)
+    {
+      if ((err = ctf_hash_map (hashes[i], strs, len, cti->cti_strlen,
+			       &cti->cti_hash[i], seed)) != 0)
+	{
+	  ctf_dprintf ("Ignoring corrupt name hashes in index\n");
+	  while (i-- > 0)
+	    ctf_hash_destroy (hashes[i]);
+	  return err;
 	}
-      tp = (ctf_type_t *) ((uintptr_t) tp + increment + vbytes);
-      pop[kind]++;
     }
 
-  if (child)
+  fp->ctf_str[CTF_STRTAB_0].cts_len = cti->cti_strlen;
+
+  ctf_dprintf ("%u enum names indexed\n", ctf_hash_size (&fp->ctf_enums));
+  ctf_dprintf ("%u struct names indexed\n", ctf_hash_size (&fp->ctf_structs));
+  ctf_dprintf ("%u union names indexed\n", ctf_hash_size (&fp->ctf_unions));
+  ctf_dprintf ("%u base type names indexed\n",
+	       ctf_hash_size (&fp->ctf_names));
+  return 0;
+}
+
+/* Threads hashing type names in parallel each take at least this many.  */
+
+#define INIT_HASH_CHUNK 16384
+
+typedef struct init_hash_arg
+{
+  ctf_file_t *iha_fp;		/* Container whose names are being hashed.  */
+  uint32_t *iha_hashes;		/* Hash value of each type's name, by index.  */
+} init_hash_arg_t;
+
+/* Compute the hash values of the names of a range of types.  */
+
+static int
+init_hash_names (void *arg_, unsigned long start, unsigned long end)
+{
+  init_hash_arg_t *arg = arg_;
+  ctf_file_t *fp = arg->iha_fp;
+  unsigned long id;
+
+  for (id = start + 1; id <= end; id++)
     {
-      ctf_dprintf ("CTF container %p is a child\n", (void *) fp);
-      fp->ctf_flags |= LCTF_CHILD;
+      const ctf_type_t *tp = LCTF_INDEX_TO_TYPEPTR (fp, id);
+      const char *name = ctf_strptr (fp, tp->ctt_name);
+
+      arg->iha_hashes[id] = (uint32_t) ctf_hash_compute (name, strlen (name));
     }
+
+  return 0;
+}
+
+/* Add the name of type ID to HP, using its precomputed hash value, if any.
+   Names in a missing string table are silently skipped.  */
+
+static int
+init_hash_add (ctf_file_t *fp, ctf_hash_t *hp, uint32_t id,
+	       const ctf_type_t *tp, const uint32_t *hashes, int define)
+{
+  uint32_t type = LCTF_INDEX_TO_TYPE (fp, id, fp->ctf_flags & LCTF_CHILD);
+  int err;
+
+  if (hashes != NULL)
+    err = (define ? ctf_hash_define_hashed : ctf_hash_insert_hashed)
+      (hp, fp, type, tp->ctt_name, hashes[id]);
   else
-    ctf_dprintf ("CTF container %p is a parent\n", (void *) fp);
+    err = (define ? ctf_hash_define : ctf_hash_insert)
+      (hp, fp, type, tp->ctt_name);
+
+  return (err == ECTF_STRTAB ? 0 : err);
+}
+
+/* Add the name of type ID to the appropriate name hash, if it has one.  */
+
+static int
+init_hash_type (ctf_file_t *fp, uint32_t id, const uint32_t *hashes)
+{
+  const ctf_type_t *tp = LCTF_INDEX_TO_TYPEPTR (fp, id);
+  unsigned short kind = LCTF_INFO_KIND (fp, tp->ctt_info);
+  unsigned short flag = LCTF_INFO_ISROOT (fp, tp->ctt_info);
+  int child = (fp->ctf_flags & LCTF_CHILD) != 0;
+
+  const char *name;
+  ctf_helem_t *hep;
+  ctf_hash_t *hp;
+
+  name = ctf_strptr (fp, tp->ctt_name);
+
+  switch (kind)
+    {
+    case CTF_K_INTEGER:
+    case CTF_K_FLOAT:
+      /* Names are reused by bit-fields, which are differentiated by their
+	 encodings, and so typically we'd record only the first instance of
+	 a given intrinsic.  However, we replace an existing type with a
+	 root-visible version so that we can be sure to find it when
+	 checking for conflicting definitions in ctf_add_type().  */
+
+      if ((hep = ctf_hash_lookup (&fp->ctf_names, fp,
+				  name, strlen (name))) == NULL)
+	return init_hash_add (fp, &fp->ctf_names, id, tp, hashes, 0);
+      else if (flag & CTF_ADD_ROOT)
+	{
+	  hep->h_type = LCTF_INDEX_TO_TYPE (fp, id, child);
+	}
+      return 0;
+
+    case CTF_K_STRUCT:
+      return init_hash_add (fp, &fp->ctf_structs, id, tp, hashes, 1);
+
+    case CTF_K_UNION:
+      return init_hash_add (fp, &fp->ctf_unions, id, tp, hashes, 1);
+
+    case CTF_K_ENUM:
+      return init_hash_add (fp, &fp->ctf_enums, id, tp, hashes, 1);
+
+    case CTF_K_FORWARD:
+      /* Only insert forward tags into the given hash if the type or tag
+	 name is not already present.  */
+      switch (tp->ctt_type)
+	{
+	case CTF_K_STRUCT:
+	  hp = &fp->ctf_structs;
+	  break;
+	case CTF_K_UNION:
+	  hp = &fp->ctf_unions;
+	  break;
+	case CTF_K_ENUM:
+	  hp = &fp->ctf_enums;
+	  break;
+	default:
+	  hp = &fp->ctf_structs;
+	}
+
+      if (ctf_hash_lookup (hp, fp, name, strlen (name)) == NULL)
+	return init_hash_add (fp, hp, id, tp, hashes, 0);
+      return 0;
 
-  /* Now that we've counted up the number of each type, we can allocate
-     the hash tables, type translation table, and pointer table.  */
+    case CTF_K_FUNCTION:
+    case CTF_K_TYPEDEF:
+    case CTF_K_POINTER:
+    case CTF_K_VOLATILE:
+    case CTF_K_CONST:
+    case CTF_K_RESTRICT:
+      return init_hash_add (fp, &fp->ctf_names, id, tp, hashes, 0);
+    }
+
+  return 0;
+}
+
+/* Hash the name of each type.  The names of very large containers are hashed
+   in parallel, if we are allowed more than one thread, and then added to the
+   hashes in type order, so the result is the same however they were hashed.  */
+
+static int
+init_hashes (ctf_file_t *fp)
+{
+  int nlstructs = 0, nlunions = 0;
+  uint32_t *hashes = NULL;
+  uint32_t id;
+  int err;
 
-  if ((err = ctf_hash_create (&fp->ctf_structs, pop[CTF_K_STRUCT])) != 0)
+  if ((err = ctf_hash_create (&fp->ctf_structs,
+			      fp->ctf_hashsize[CTF_INDEX_STRUCTS])) != 0)
     return err;
 
-  if ((err = ctf_hash_create (&fp->ctf_unions, pop[CTF_K_UNION])) != 0)
+  if ((err = ctf_hash_create (&fp->ctf_unions,
+			      fp->ctf_hashsize[CTF_INDEX_UNIONS])) != 0)
     return err;
 
-  if ((err = ctf_hash_create (&fp->ctf_enums, pop[CTF_K_ENUM])) != 0)
+  if ((err = ctf_hash_create (&fp->ctf_enums,
+			      fp->ctf_hashsize[CTF_INDEX_ENUMS])) != 0)
     return err;
 
   if ((err = ctf_hash_create (&fp->ctf_names,
-			      pop[CTF_K_INTEGER] + pop[CTF_K_FLOAT] +
-			      pop[CTF_K_FUNCTION] + pop[CTF_K_TYPEDEF] +
-			      pop[CTF_K_POINTER] + pop[CTF_K_VOLATILE] +
-			      pop[CTF_K_CONST] + pop[CTF_K_RESTRICT])) != 0)
+			      fp->ctf_hashsize[CTF_INDEX_NAMES])) != 0)
     return err;
 
-  fp->ctf_txlate = ctf_alloc (sizeof (uint32_t) * (fp->ctf_typemax + 1));
-  fp->ctf_ptrtab = ctf_alloc (sizeof (uint32_t) * (fp->ctf_typemax + 1));
+  /* If the hash values cannot be precomputed, they are just computed as we
+     go.  */
 
-  if (fp->ctf_txlate == NULL || fp->ctf_ptrtab == NULL)
-    return ENOMEM;		/* Memory allocation failed.  */
-
-  xp = fp->ctf_txlate;
-  *xp++ = 0;			/* Type id 0 is used as a sentinel value.  */
-
-  memset (fp->ctf_txlate, 0, sizeof (uint32_t) * (fp->ctf_typemax + 1));
-  memset (fp->ctf_ptrtab, 0, sizeof (uint32_t) * (fp->ctf_typemax + 1));
+  if (_libctf_nthreads > 1 && fp->ctf_typemax >= 2 * INIT_HASH_CHUNK
+      && (hashes = ctf_alloc (sizeof (uint32_t)
+			      * (fp->ctf_typemax + 1))) != NULL)
+    {
+      init_hash_arg_t arg = { fp, hashes };
 
-  /* In the second pass through the types, we fill in each entry of the
-     type and pointer tables and add names to the appropriate hashes.  */
+      (void) ctf_parallel (fp->ctf_typemax, INIT_HASH_CHUNK, init_hash_names,
+			   &arg);
+    }
 
-  for (id = 1, tp = tbuf; tp < tend; xp++, id++)
+  for (id = 1; id <= fp->ctf_typemax && err == 0; id++)
     {
+      const ctf_type_t *tp = LCTF_INDEX_TO_TYPEPTR (fp, id);
       unsigned short kind = LCTF_INFO_KIND (fp, tp->ctt_info);
-      unsigned short flag = LCTF_INFO_ISROOT (fp, tp->ctt_info);
-      unsigned long vlen = LCTF_INFO_VLEN (fp, tp->ctt_info);
-      ssize_t size, increment, vbytes;
-
-      const char *name;
-      ctf_helem_t *hep;
+      ssize_t size, increment;
 
       (void) ctf_get_ctt_size (fp, tp, &size, &increment);
-      name = ctf_strptr (fp, tp->ctt_name);
-      vbytes = LCTF_VBYTES (fp, kind, size, vlen);
 
-      switch (kind)
+      if (kind == CTF_K_STRUCT && size >= CTF_LSTRUCT_THRESH)
+	nlstructs++;
+      else if (kind == CTF_K_UNION && size >= CTF_LSTRUCT_THRESH)
+	nlunions++;
+
+      err = init_hash_type (fp, id, hashes);
+    }
+
+  if (hashes != NULL)
+    ctf_free (hashes, sizeof (uint32_t) * (fp->ctf_typemax + 1));
+
+  if (err != 0)
+    return err;
+
+  ctf_dprintf ("%u enum names hashed\n", ctf_hash_size (&fp->ctf_enums));
+  ctf_dprintf ("%u struct names hashed (%d long)\n",
+	       ctf_hash_size (&fp->ctf_structs), nlstructs);
+  ctf_dprintf ("%u union names hashed (%d long)\n",
+	       ctf_hash_size (&fp->ctf_unions), nlunions);
+  ctf_dprintf ("%u base type names hashed\n", ctf_hash_size (&fp->ctf_names));
+
+  return 0;
+}
+
+/* Make sure the name hashes of FP are ready for use, building them if they
+   were deferred by CTF_OPEN_LAZY_HASH.  Only one thread builds them: any others
+   wait for it to finish.  */
+
+int
+ctf_init_hashes (ctf_file_t *fp)
+{
+  int state;
+  int err;
+
+  while ((state = __atomic_load_n (&fp->ctf_hashstate, __ATOMIC_ACQUIRE))
+	 != LCTF_HASH_READY)
+    {
+      if (state == LCTF_HASH_NONE
+	  && __atomic_compare_exchange_n (&fp->ctf_hashstate, &state,
+					  LCTF_HASH_BUSY, 0, __ATOMIC_ACQUIRE,
+					  __ATOMIC_RELAXED))
 	{
-	case CTF_K_INTEGER:
-	case CTF_K_FLOAT:
-	  /* Names are reused by bit-fields, which are differentiated by their
-	     encodings, and so typically we'd record only the first instance of
-	     a given intrinsic.  However, we replace an existing type with a
-	     root-visible version so that we can be sure to find it when
-	     checking for conflicting definitions in ctf_add_type().  */
-
-	  if ((hep = ctf_hash_lookup (&fp->ctf_names, fp,
-				      name, strlen (name))) == NULL)
-	    {
-	      err = ctf_hash_insert (&fp->ctf_names, fp,
-				     LCTF_INDEX_TO_TYPE (fp, id, child),
-				     tp->ctt_name);
-	      if (err != 0 && err != ECTF_STRTAB)
-		return err;
-	    }
-	  else if (flag & CTF_ADD_ROOT)
+	  if (init_index (fp) != 0 && (err = init_hashes (fp)) != 0)
 	    {
-	      hep->h_type = LCTF_INDEX_TO_TYPE (fp, id, child);
+	      ctf_hash_destroy (&fp->ctf_structs);
+	      ctf_hash_destroy (&fp->ctf_unions);
+	      ctf_hash_destroy (&fp->ctf_enums);
+	      ctf_hash_destroy (&fp->ctf_names);
+	      __atomic_store_n (&fp->ctf_hashstate, LCTF_HASH_NONE,
+				__ATOMIC_RELEASE);
+	      return err;
 	    }
-	  break;
 
-	case CTF_K_ARRAY:
-	  break;
+	  __atomic_store_n (&fp->ctf_hashstate, LCTF_HASH_READY,
+			    __ATOMIC_RELEASE);
+	  return 0;
+	}
 
-	case CTF_K_FUNCTION:
-	  err = ctf_hash_insert (&fp->ctf_names, fp,
-				 LCTF_INDEX_TO_TYPE (fp, id, child),
-				 tp->ctt_name);
-	  if (err != 0 && err != ECTF_STRTAB)
-	    return err;
-	  break;
+      sched_yield ();
+    }
 
-	case CTF_K_STRUCT:
-	  err = ctf_hash_define (&fp->ctf_structs, fp,
-				 LCTF_INDEX_TO_TYPE (fp, id, child),
-				 tp->ctt_name);
+  return 0;
+}
 
-	  if (err != 0 && err != ECTF_STRTAB)
-	    return err;
+/* Fill in the type ID translation table with the byte offset of each type, and
+   the pointer table, by walking the type section, and count the names that
+   will be hashed.  */
 
-	  if (size >= CTF_LSTRUCT_THRESH)
-	    nlstructs++;
-	  break;
+static int
+init_txlate (ctf_file_t *fp, const ctf_header_t *cth)
+{
+  const ctf_type_t *tbuf;
+  const ctf_type_t *tend;
 
-	case CTF_K_UNION:
-	  err = ctf_hash_define (&fp->ctf_unions, fp,
-				 LCTF_INDEX_TO_TYPE (fp, id, child),
-				 tp->ctt_name);
+  unsigned long pop[CTF_K_MAX + 1] = { 0 };
+  const ctf_type_t *tp;
+  unsigned long maxtypes;
+  uint32_t id;
 
-	  if (err != 0 && err != ECTF_STRTAB)
-	    return err;
+  int child = (fp->ctf_flags & LCTF_CHILD) != 0;
 
-	  if (size >= CTF_LSTRUCT_THRESH)
-	    nlunions++;
-	  break;
+  tbuf = (ctf_type_t *) (fp->ctf_buf + cth->cth_typeoff);
+  tend = (ctf_type_t *) (fp->ctf_buf + cth->cth_stroff);
 
-	case CTF_K_ENUM:
-	  err = ctf_hash_define (&fp->ctf_enums, fp,
-				 LCTF_INDEX_TO_TYPE (fp, id, child),
-				 tp->ctt_name);
+  LCTF_CHUNK (fp, tbuf, cth->cth_stroff - cth->cth_typeoff);
 
-	  if (err != 0 && err != ECTF_STRTAB)
-	    return err;
-	  break;
+  /* Every type record is at least as large as a ctf_stype_t, which bounds the
+     number of types, so we can allocate the type translation table and pointer
+     table up front, and fill them in a single pass through the type section,
+     shrinking them to fit afterwards.  */
 
-	case CTF_K_TYPEDEF:
-	  err = ctf_hash_insert (&fp->ctf_names, fp,
-				 LCTF_INDEX_TO_TYPE (fp, id, child),
-				 tp->ctt_name);
-	  if (err != 0 && err != ECTF_STRTAB)
-	    return err;
-	  break;
+  maxtypes = (cth->cth_stroff - cth->cth_typeoff) / sizeof (ctf_stype_t);
 
-	case CTF_K_FORWARD:
-	  /* Only insert forward tags into the given hash if the type or tag
-	     name is not already present.  */
-	  switch (tp->ctt_type)
-	    {
-	    case CTF_K_STRUCT:
-	      hp = &fp->ctf_structs;
-	      break;
-	    case CTF_K_UNION:
-	      hp = &fp->ctf_unions;
-	      break;
-	    case CTF_K_ENUM:
-	      hp = &fp->ctf_enums;
-	      break;
-	    default:
-	      hp = &fp->ctf_structs;
-	    }
+  fp->ctf_txlate = ctf_alloc (sizeof (uint32_t) * (maxtypes + 1));
+  fp->ctf_ptrtab = ctf_alloc (sizeof (uint32_t) * (maxtypes + 1));
 
-	  if (ctf_hash_lookup (hp, fp, name, strlen (name)) == NULL)
-	    {
-	      err = ctf_hash_insert (hp, fp,
-				     LCTF_INDEX_TO_TYPE (fp, id, child),
-				     tp->ctt_name);
-	      if (err != 0 && err != ECTF_STRTAB)
-		return err;
-	    }
-	  break;
+  if (fp->ctf_txlate == NULL || fp->ctf_ptrtab == NULL)
+    return ENOMEM;		/* Memory allocation failed.  */
 
-	case CTF_K_POINTER:
-	  /* If the type referenced by the pointer is in this CTF container,
-	     then store the index of the pointer type in
-	     fp->ctf_ptrtab[ index of referenced type ].  */
+  fp->ctf_txlate[0] = 0;	/* Type id 0 is used as a sentinel value.  */
+  memset (fp->ctf_ptrtab, 0, sizeof (uint32_t) * (maxtypes + 1));
 
-	  if (LCTF_TYPE_ISCHILD (fp, tp->ctt_type) == child
-	      && LCTF_TYPE_TO_INDEX (fp, tp->ctt_type) <= fp->ctf_typemax)
-	    fp->ctf_ptrtab[LCTF_TYPE_TO_INDEX (fp, tp->ctt_type)] = id;
-	 /*FALLTHRU*/
+  /* In this pass, we count the number of each type and fill in each entry of
+     the type and pointer tables.  */
 
-	case CTF_K_VOLATILE:
-	case CTF_K_CONST:
-	case CTF_K_RESTRICT:
-	  err = ctf_hash_insert (&fp->ctf_names, fp,
-				 LCTF_INDEX_TO_TYPE (fp, id, child),
-				 tp->ctt_name);
-	  if (err != 0 && err != ECTF_STRTAB)
-	    return err;
-	  break;
+  for (id = 1, tp = tbuf; tp < tend; id++)
+    {
+      unsigned short kind = LCTF_INFO_KIND (fp, tp->ctt_info);
+      unsigned long vlen = LCTF_INFO_VLEN (fp, tp->ctt_info);
+      ssize_t size, increment, vbytes;
+
+      (void) ctf_get_ctt_size (fp, tp, &size, &increment);
+      vbytes = LCTF_VBYTES (fp, kind, size, vlen);
+
+      if (vbytes < 0)
+	return ECTF_CORRUPT;
+
+      if (kind == CTF_K_FORWARD)
+	{
+	  /* For forward declarations, ctt_type is the CTF_K_* kind for the tag,
+	     so bump that population count too.  If ctt_type is unknown, treat
+	     the tag as a struct.  */
+
+	  if (tp->ctt_type == CTF_K_UNKNOWN || tp->ctt_type >= CTF_K_MAX)
+	    pop[CTF_K_STRUCT]++;
+	  else
+	    pop[tp->ctt_type]++;
 	}
 
-      *xp = (uint32_t) ((uintptr_t) tp - (uintptr_t) fp->ctf_buf);
+      /* If the type referenced by a pointer is in this CTF container, then
+	 store the index of the pointer type in
+	 fp->ctf_ptrtab[ index of referenced type ].  References past the last
+	 type are dropped when the table is trimmed.  */
+
+      if (kind == CTF_K_POINTER
+	  && LCTF_TYPE_ISCHILD (fp, tp->ctt_type) == child
+	  && LCTF_TYPE_TO_INDEX (fp, tp->ctt_type) <= maxtypes)
+	fp->ctf_ptrtab[LCTF_TYPE_TO_INDEX (fp, tp->ctt_type)] = id;
+
+      fp->ctf_txlate[id] = (uint32_t) ((uintptr_t) tp
+				       - (uintptr_t) fp->ctf_buf);
       tp = (ctf_type_t *) ((uintptr_t) tp + increment + vbytes);
+      pop[kind]++;
     }
 
+  fp->ctf_typemax = id - 1;
+
+  if (fp->ctf_typemax < maxtypes)
+    {
+      uint32_t *txlate, *ptrtab;
+
+      txlate = ctf_realloc (fp->ctf_txlate,
+			    sizeof (uint32_t) * (fp->ctf_typemax + 1));
+      if (txlate != NULL)
+	fp->ctf_txlate = txlate;
+
+      ptrtab = ctf_realloc (fp->ctf_ptrtab,
+			    sizeof (uint32_t) * (fp->ctf_typemax + 1));
+      if (ptrtab != NULL)
+	fp->ctf_ptrtab = ptrtab;
+    }
+
+  /* Now that we've counted up the number of each type, we can size the name
+     hashes.  */
+
+  fp->ctf_hashsize[CTF_INDEX_STRUCTS] = pop[CTF_K_STRUCT];
+  fp->ctf_hashsize[CTF_INDEX_UNIONS] = pop[CTF_K_UNION];
+  fp->ctf_hashsize[CTF_INDEX_ENUMS] = pop[CTF_K_ENUM];
+  fp->ctf_hashsize[CTF_INDEX_NAMES] = pop[CTF_K_INTEGER] + pop[CTF_K_FLOAT]
+    + pop[CTF_K_FUNCTION] + pop[CTF_K_TYPEDEF] + pop[CTF_K_POINTER]
+    + pop[CTF_K_VOLATILE] + pop[CTF_K_CONST] + pop[CTF_K_RESTRICT];
+
   ctf_dprintf ("%lu total types processed\n", fp->ctf_typemax);
-  ctf_dprintf ("%u enum names hashed\n", ctf_hash_size (&fp->ctf_enums));
-  ctf_dprintf ("%u struct names hashed (%d long)\n",
-	       ctf_hash_size (&fp->ctf_structs), nlstructs);
-  ctf_dprintf ("%u union names hashed (%d long)\n",
-	       ctf_hash_size (&fp->ctf_unions), nlunions);
-  ctf_dprintf ("%u base type names hashed\n", ctf_hash_size (&fp->ctf_names));
+  return 0;
+}
+
+/* Make a pass through the pointer table to find pointers that point to
+   anonymous typedef nodes.  If we find one, modify the pointer table so that
+   the pointer is also known to point to the node that is referenced by the
+   anonymous typedef node.  */
 
-  /* Make an additional pass through the pointer table to find pointers that
-     point to anonymous typedef nodes.  If we find one, modify the pointer table
-     so that the pointer is also known to point to the node that is referenced
-     by the anonymous typedef node.  */
+static void
+init_ptrtab_anon (ctf_file_t *fp)
+{
+  int child = (fp->ctf_flags & LCTF_CHILD) != 0;
+  const ctf_type_t *tp;
+  uint32_t id, dst;
 
   for (id = 1; id <= fp->ctf_typemax; id++)
     {
@@ -910,6 +1173,88 @@ init_types (ctf_file_t *fp, ctf_header_t *cth)
 	    fp->ctf_ptrtab[LCTF_TYPE_TO_INDEX (fp, tp->ctt_type)] = dst;
 	}
     }
+}
+
+/* Initialize the type ID translation table with the byte offset of each type,
+   and initialize the hash tables of each named type, unless that is to be
+   deferred, using the index if there is one.  Upgrade the type table to the
+   latest supported representation in the process, if needed, and if this
+   recension of libctf supports upgrading.  */
+
+static int
+init_types (ctf_file_t *fp, ctf_header_t *cth)
+{
+  /* We determine whether the container is a child or a parent based on
+     the value of cth_parname.  */
+
+  int child = cth->cth_parname != 0;
+  int err;
+
+#ifndef NO_COMPAT
+  if (_libctf_unlikely_ (fp->ctf_version == CTF_VERSION_1))
+    {
+      int err;
+      if ((err = upgrade_types (fp, cth)) != 0)
+	return err;				/* Upgrade failed.  */
+    }
+#endif /* !NO_COMPAT */
+
+  if (child)
+    {
+      ctf_dprintf ("CTF container %p is a child\n", (void *) fp);
+      fp->ctf_flags |= LCTF_CHILD;
+    }
+  else
+    ctf_dprintf ("CTF container %p is a parent\n", (void *) fp);
+
+  init_index_header (fp, cth);
+
+  if (init_type_index (fp, cth) != 0 && (err = init_txlate (fp, cth)) != 0)
+    return err;
+
+  if (!(_libctf_open_flags & CTF_OPEN_LAZY_HASH)
+      && (err = ctf_init_hashes (fp)) != 0)
+    return err;
+
+  /* A pointer table from the index has had pointers to anonymous typedefs
+     accounted for already.  */
+
+  if (!(fp->ctf_flags & LCTF_TXMAPPED))
+    init_ptrtab_anon (fp);
+
+  return 0;
+}
+
+/* Add the types after OLDMAX, just appended to the type section of writable
+   container FP by ctf_update(), to its pointer table and name hashes, just as
+   if FP had been opened afresh.  The type ID translation table must already
+   cover them, and the pointer table be large enough for them and zeroed past
+   OLDMAX.  */
+
+int
+ctf_init_appended (ctf_file_t *fp, unsigned long oldmax)
+{
+  int child = (fp->ctf_flags & LCTF_CHILD) != 0;
+  uint32_t id;
+  int err;
+
+  for (id = oldmax + 1; id <= fp->ctf_typemax; id++)
+    {
+      const ctf_type_t *tp = LCTF_INDEX_TO_TYPEPTR (fp, id);
+
+      if (LCTF_INFO_KIND (fp, tp->ctt_info) == CTF_K_POINTER
+	  && LCTF_TYPE_ISCHILD (fp, tp->ctt_type) == child
+	  && LCTF_TYPE_TO_INDEX (fp, tp->ctt_type) <= fp->ctf_typemax)
+	fp->ctf_ptrtab[LCTF_TYPE_TO_INDEX (fp, tp->ctt_type)] = id;
+    }
+
+  init_ptrtab_anon (fp);
+
+  for (id = oldmax + 1; id <= fp->ctf_typemax; id++)
+    {
+      if ((err = init_hash_type (fp, id, NULL)) != 0)
+	return err;
+    }
 
   return 0;
 }
@@ -926,6 +1271,7 @@ ctf_bufopen (const ctf_sect_t *ctfsect, const ctf_sect_t *symsect,
   const ctf_preamble_t *pp;
   ctf_header_t hp;
   ctf_file_t *fp;
+  ctf_chunks_t *chunks = NULL;
   void *buf, *base;
   size_t size, hdrsz;
   int err;
@@ -1014,38 +1360,62 @@ ctf_bufopen (const ctf_sect_t *ctfsect, const ctf_sect_t *symsect,
      init_types().  */
 #endif /* !NO_COMPAT */
 
+  if ((hp.cth_flags & (CTF_F_CODEC | CTF_F_CHUNKED))
+      && !(hp.cth_flags & CTF_F_COMPRESS))
+    return (ctf_set_open_errno (errp, ECTF_CORRUPT));
+
+  /* Chunks are inflated in place, so the buffer cannot be upgraded.  */
+
+  if ((hp.cth_flags & CTF_F_CHUNKED) && hp.cth_version != CTF_VERSION_2)
+    return (ctf_set_open_errno (errp, ECTF_CORRUPT));
+
   if (hp.cth_flags & CTF_F_COMPRESS)
     {
+      const ctf_codec_t *codec;
       size_t srclen, dstlen;
       const void *src;
-      int rc = Z_OK;
+
+      if ((codec = ctf_codec_flags (hp.cth_flags)) == NULL)
+	{
+	  ctf_dprintf ("ctf_bufopen: compression flags %x not supported\n",
+		       hp.cth_flags & (CTF_F_COMPRESS | CTF_F_CODEC));
+	  return (ctf_set_open_errno (errp, ECTF_NOTSUP));
+	}
 
       if ((base = ctf_data_alloc (size + hdrsz)) == MAP_FAILED)
 	return (ctf_set_open_errno (errp, ECTF_ZALLOC));
 
       memcpy (base, ctfsect->cts_data, hdrsz);
-      ((ctf_preamble_t *) base)->ctp_flags &= ~CTF_F_COMPRESS;
+      ((ctf_preamble_t *) base)->ctp_flags &= ~(CTF_F_COMPRESS | CTF_F_CODEC
+						| CTF_F_CHUNKED);
       buf = (unsigned char *) base + hdrsz;
 
       src = (unsigned char *) ctfsect->cts_data + hdrsz;
       srclen = ctfsect->cts_size - hdrsz;
       dstlen = size;
 
-      if ((rc = uncompress (buf, &dstlen, src, srclen)) != Z_OK)
+      /* Chunked data is left compressed in the section, and inflated a chunk
+	 at a time as it is used.  */
+
+      if (hp.cth_flags & CTF_F_CHUNKED)
+	err = ctf_chunk_open (codec, src, srclen, buf, size, &chunks);
+      else
+	err = codec->cc_decompress (buf, &dstlen, src, srclen);
+
+      if (err != 0)
 	{
-	  ctf_dprintf ("zlib inflate err: %s\n", zError (rc));
 	  ctf_data_free (base, size + hdrsz);
-	  return (ctf_set_open_errno (errp, ECTF_DECOMPRESS));
+	  return (ctf_set_open_errno (errp, err));
 	}
 
       if (dstlen != size)
 	{
-	  ctf_dprintf ("zlib inflate short -- got %lu of %lu "
-		       "bytes\n", (unsigned long) dstlen, (unsigned long) size);
+	  ctf_dprintf ("%s inflate short -- got %lu of %lu bytes\n",
+		       codec->cc_name, (unsigned long) dstlen,
+		       (unsigned long) size);
 	  ctf_data_free (base, size + hdrsz);
 	  return (ctf_set_open_errno (errp, ECTF_CORRUPT));
 	}
-
     }
   else
     {
@@ -1062,9 +1432,14 @@ ctf_bufopen (const ctf_sect_t *ctfsect, const ctf_sect_t *symsect,
      ctf_set_base() and ctf_realloc_base().  */
 
   if ((fp = ctf_alloc (sizeof (ctf_file_t))) == NULL)
-    return (ctf_set_open_errno (errp, ENOMEM));
+    {
+      ctf_chunk_close (chunks);
+      return (ctf_set_open_errno (errp, ENOMEM));
+    }
 
   memset (fp, 0, sizeof (ctf_file_t));
+  fp->ctf_chunks = chunks;
+  fp->ctf_serial = ctf_serial_next ();
   ctf_set_version (fp, &hp, hp.cth_version);
 
 #ifndef NO_COMPAT
@@ -1116,9 +1491,9 @@ ctf_bufopen (const ctf_sect_t *ctfsect, const ctf_sect_t *symsect,
   /* The ctf region may have been reallocated by init_types(), but now
      that is done, it will not move again, so we can protect it, as long
      as it didn't come from the ctfsect, wihcih might have been allocated
-     with malloc().  */
+     with malloc(), and is not still being inflated.  */
 
-  if (fp->ctf_base != (void *) ctfsect->cts_data)
+  if (fp->ctf_base != (void *) ctfsect->cts_data && fp->ctf_chunks == NULL)
     ctf_data_protect ((void *) fp->ctf_base, fp->ctf_size);
 
   /* If we have a symbol table section, allocate and initialize
@@ -1187,19 +1562,19 @@ bad:
 void
 ctf_close (ctf_file_t *fp)
 {
-  ctf_dtdef_t *dtd, *ntd;
-  ctf_dvdef_t *dvd, *nvd;
+  int i;
 
   if (fp == NULL)
     return;		   /* Allow ctf_close(NULL) to simplify caller code.  */
 
   ctf_dprintf ("ctf_close(%p) refcnt=%u\n", (void *) fp, fp->ctf_refcnt);
 
-  if (fp->ctf_refcnt > 1)
-    {
-      fp->ctf_refcnt--;
-      return;
-    }
+  /* Children being updated in parallel, as by ctf_link(), can drop their
+     references to a shared parent at the same time.  */
+
+  if (__atomic_load_n (&fp->ctf_refcnt, __ATOMIC_ACQUIRE) > 1
+      && __atomic_sub_fetch (&fp->ctf_refcnt, 1, __ATOMIC_ACQ_REL) > 0)
+    return;
 
   if (fp->ctf_dynparname != NULL)
     ctf_free (fp->ctf_dynparname, strlen (fp->ctf_dynparname) + 1);
@@ -1207,21 +1582,18 @@ ctf_close (ctf_file_t *fp)
   if (fp->ctf_parent != NULL)
     ctf_close (fp->ctf_parent);
 
-  for (dtd = ctf_list_next (&fp->ctf_dtdefs); dtd != NULL; dtd = ntd)
-    {
-      ntd = ctf_list_next (dtd);
-      ctf_dtd_delete (fp, dtd);
-    }
-
-  ctf_free (fp->ctf_dthash, fp->ctf_dthashlen * sizeof (ctf_dtdef_t *));
-
-  for (dvd = ctf_list_next (&fp->ctf_dvdefs); dvd != NULL; dvd = nvd)
-    {
-      nvd = ctf_list_next (dvd);
-      ctf_dvd_delete (fp, dvd);
-    }
+  /* The dynamic definitions all live in the arena.  */
 
-  ctf_free (fp->ctf_dvhash, fp->ctf_dvhashlen * sizeof (ctf_dvdef_t *));
+  ctf_arena_destroy (&fp->ctf_arena);
+  ctf_free (fp->ctf_marks, fp->ctf_markslen * sizeof (ctf_arena_mark_t));
+  ctf_free (fp->ctf_dtdtab, fp->ctf_dtdtablen * sizeof (ctf_dtdef_t *));
+  ctf_dynhash_destroy (fp->ctf_dvhash);
+  ctf_dynhash_destroy (fp->ctf_dmhash);
+  ctf_dynhash_destroy (fp->ctf_refhash);
+  ctf_srcmap_clear (fp);
+  for (i = 0; i < CTF_INDEX_MAX; i++)
+    ctf_dynhash_destroy (fp->ctf_dtnames[i]);
+  ctf_strset_destroy (&fp->ctf_strset);
 
   if (fp->ctf_flags & LCTF_MMAP)
     {
@@ -1248,14 +1620,15 @@ ctf_close (ctf_file_t *fp)
 		strlen (fp->ctf_strtab.cts_name) + 1);
 
   ctf_free_base (fp, NULL, 0);
+  ctf_chunk_close (fp->ctf_chunks);
 
   if (fp->ctf_sxlate != NULL)
     ctf_free (fp->ctf_sxlate, sizeof (uint32_t) * fp->ctf_nsyms);
 
-  if (fp->ctf_txlate != NULL)
+  if (fp->ctf_txlate != NULL && !(fp->ctf_flags & LCTF_TXMAPPED))
       ctf_free (fp->ctf_txlate, sizeof (uint32_t) * (fp->ctf_typemax + 1));
 
-  if (fp->ctf_ptrtab != NULL)
+  if (fp->ctf_ptrtab != NULL && !(fp->ctf_flags & LCTF_TXMAPPED))
       ctf_free (fp->ctf_ptrtab, sizeof (uint32_t) * (fp->ctf_typemax + 1));
 
   ctf_hash_destroy (&fp->ctf_structs);
@@ -1323,12 +1696,13 @@ ctf_import (ctf_file_t *fp, ctf_file_t *pfp)
   if (pfp != NULL)
     {
       fp->ctf_flags |= LCTF_CHILD;
-      pfp->ctf_refcnt++;
+      __atomic_add_fetch (&pfp->ctf_refcnt, 1, __ATOMIC_RELAXED);
 
       if (fp->ctf_parname == NULL)
 	ctf_parent_name_set (fp, "PARENT");
     }
   fp->ctf_parent = pfp;
+  fp->ctf_serial = ctf_serial_next ();	/* Parent types may have changed.  */
   return 0;
 }
 
@@ -0,0 +1,250 @@
+/* String table construction.
+   Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+
+   Licensed under the Universal Permissive License v 1.0 as shown at
+   http://oss.oracle.com/licenses/upl.
+
+   Licensed under the GNU General Public License (GPL), version 2. See the file
+   COPYING in the top level of this tree.  */
+
+#include <sys/param.h>
+#include <assert.h>
+#include <ctf-impl.h>
+#include <errno.h>
+#include <string.h>
+
+/* The atoms of a ctf_strset map each interned string to its offset, which is
+   never zero, because the empty string (at offset zero) is never interned.
+   Pending strings map to CTF_STR_PENDING until they are laid out.  */
+
+#define CTF_STR_PENDING ((void *) (uintptr_t) UINT32_MAX)
+
+/* Initialize CSS for a string table whose first LEN bytes are already
+   taken.  */
+
+int
+ctf_strset_init (ctf_strset_t *css, uint32_t len)
+{
+  memset (css, 0, sizeof (ctf_strset_t));
+
+  if ((css->css_atoms = ctf_dynhash_create (ctf_hash_string,
+					    ctf_hash_eq_string)) == NULL)
+    return EAGAIN;
+
+  css->css_len = len;
+  return 0;
+}
+
+/* Intern STR, which must live as long as CSS does, unless already there.  */
+
+int
+ctf_strset_add (ctf_strset_t *css, const char *str)
+{
+  ctf_strent_t *cse;
+  size_t len;
+  int err;
+
+  if (str == NULL || str[0] == '\0'
+      || ctf_dynhash_lookup (css->css_atoms, str) != NULL)
+    return 0;
+
+  if (css->css_npending == css->css_pendinglen)
+    {
+      size_t n = css->css_pendinglen == 0 ? 256 : css->css_pendinglen * 2;
+
+      if ((cse = ctf_realloc (css->css_pending,
+			      n * sizeof (ctf_strent_t))) == NULL)
+	return EAGAIN;
+
+      css->css_pending = cse;
+      css->css_pendinglen = n;
+    }
+
+  if ((len = strlen (str)) > UINT32_MAX - 1)
+    return EOVERFLOW;
+
+  if ((err = ctf_dynhash_insert (css->css_atoms, (void *) str,
+				 CTF_STR_PENDING)) != 0)
+    return err;
+
+  cse = &css->css_pending[css->css_npending++];
+  cse->cse_str = str;
+  cse->cse_len = (uint32_t) len;
+  cse->cse_off = 0;
+
+  return 0;
+}
+
+/* Order strings by their reversed bytes, so that each string sorts just before
+   the strings it is a tail of, if there are any.  */
+
+static int
+ctf_strent_tail_cmp (const void *one_, const void *two_)
+{
+  const ctf_strent_t *one = one_;
+  const ctf_strent_t *two = two_;
+  const unsigned char *a = (const unsigned char *) one->cse_str + one->cse_len;
+  const unsigned char *b = (const unsigned char *) two->cse_str + two->cse_len;
+  uint32_t n = MIN (one->cse_len, two->cse_len);
+
+  while (n-- > 0)
+    {
+      a--;
+      b--;
+      if (*a != *b)
+	return (*a < *b ? -1 : 1);
+    }
+
+  if (one->cse_len != two->cse_len)
+    return (one->cse_len < two->cse_len ? -1 : 1);
+
+  return 0;
+}
+
+/* Assign offsets to the pending strings, placing them after the strings
+   already in the table, and return the length of the table with them in it in
+   *LENP.  A string that is the tail of another is given the offset of that
+   tail rather than space of its own.  */
+
+int
+ctf_strset_layout (ctf_strset_t *css, uint32_t *lenp)
+{
+  uint64_t len = css->css_len;
+  size_t i, n = css->css_npending;
+
+  if (n == 0)
+    {
+      *lenp = css->css_len;
+      return 0;
+    }
+
+  qsort (css->css_pending, n, sizeof (ctf_strent_t), ctf_strent_tail_cmp);
+
+  for (i = n; i-- > 0;)
+    {
+      ctf_strent_t *cse = &css->css_pending[i];
+      const ctf_strent_t *next = &css->css_pending[i + 1];
+
+      if (i + 1 < n && next->cse_len > cse->cse_len
+	  && memcmp (next->cse_str + next->cse_len - cse->cse_len,
+		     cse->cse_str, cse->cse_len) == 0)
+	cse->cse_off = next->cse_off + next->cse_len - cse->cse_len;
+      else
+	{
+	  cse->cse_off = (uint32_t) len;
+	  len += cse->cse_len + 1;
+	}
+    }
+
+  if (len > UINT32_MAX)
+    return EOVERFLOW;
+
+  for (i = 0; i < n; i++)
+    {
+      const ctf_strent_t *cse = &css->css_pending[i];
+
+      (void) ctf_dynhash_insert (css->css_atoms, (void *) cse->cse_str,
+				 (void *) (uintptr_t) cse->cse_off);
+    }
+
+  *lenp = (uint32_t) len;
+  return 0;
+}
+
+/* Return the offset of STR, which must have been interned and laid out.  */
+
+uint32_t
+ctf_strset_offset (ctf_strset_t *css, const char *str)
+{
+  uintptr_t off;
+
+  if (str == NULL || str[0] == '\0')
+    return 0;
+
+  off = (uintptr_t) ctf_dynhash_lookup (css->css_atoms, str);
+  assert (off != 0 && off != (uintptr_t) CTF_STR_PENDING);
+
+  return (uint32_t) off;
+}
+
+/* Write the pending strings to the string table at S0.  Strings sharing a tail
+   just write the same bytes twice.  */
+
+void
+ctf_strset_write (const ctf_strset_t *css, unsigned char *s0)
+{
+  size_t i;
+
+  for (i = 0; i < css->css_npending; i++)
+    {
+      const ctf_strent_t *cse = &css->css_pending[i];
+
+      memcpy (s0 + cse->cse_off, cse->cse_str, cse->cse_len + 1);
+    }
+}
+
+/* Pass the pending strings to SINK in the order of their offsets, as they
+   would be laid out by ctf_strset_write(), so that the table can be written
+   out without a buffer to hold it.  ctf_strset_layout() gave the strings that
+   have space of their own rising offsets from the last of them down, so the
+   others, which are tails of strings before them, are just skipped.  */
+
+int
+ctf_strset_stream (const ctf_strset_t *css, ctf_sink_f *sink, void *arg)
+{
+  uint64_t off = css->css_len;
+  size_t i;
+  int err;
+
+  for (i = css->css_npending; i-- > 0;)
+    {
+      const ctf_strent_t *cse = &css->css_pending[i];
+
+      if (cse->cse_off != off)
+	continue;
+
+      if ((err = sink (cse->cse_str, cse->cse_len + 1, arg)) != 0)
+	return err;
+      off += cse->cse_len + 1;
+    }
+
+  return 0;
+}
+
+/* The pending strings have been written out: they are committed.  */
+
+void
+ctf_strset_commit (ctf_strset_t *css)
+{
+  size_t i;
+
+  for (i = 0; i < css->css_npending; i++)
+    {
+      const ctf_strent_t *cse = &css->css_pending[i];
+
+      css->css_len = MAX (css->css_len, cse->cse_off + cse->cse_len + 1);
+    }
+
+  css->css_npending = 0;
+}
+
+/* The pending strings will not be written out after all: forget them.  */
+
+void
+ctf_strset_abort (ctf_strset_t *css)
+{
+  size_t i;
+
+  for (i = 0; i < css->css_npending; i++)
+    ctf_dynhash_remove (css->css_atoms, css->css_pending[i].cse_str);
+
+  css->css_npending = 0;
+}
+
+void
+ctf_strset_destroy (ctf_strset_t *css)
+{
+  ctf_dynhash_destroy (css->css_atoms);
+  ctf_free (css->css_pending, css->css_pendinglen * sizeof (ctf_strent_t));
+  memset (css, 0, sizeof (ctf_strset_t));
+}
@@ -37,6 +37,12 @@ ctf_alloc (size_t size)
   return (malloc (size));
 }
 
+void *
+ctf_realloc (void *buf, size_t size)
+{
+  return (realloc (buf, size));
+}
+
 void
 ctf_free (void *buf, size_t size _libctf_unused_)
 {
@@ -0,0 +1,141 @@
+/* Parallel execution of large jobs.
+   Copyright (c) 2019, Oracle and/or its affiliates. All rights reserved.
+
+   Licensed under the Universal Permissive License v 1.0 as shown at
+   http://oss.oracle.com/licenses/upl.
+
+   Licensed under the GNU General Public License (GPL), version 2. See the file
+   COPYING in the top level of this tree.  */
+
+#include <ctf-impl.h>
+#include <errno.h>
+#include <pthread.h>
+
+int _libctf_nthreads = 1;		/* Maximum threads per operation.  */
+
+/* Nonzero in threads running part of a ctf_parallel() job.  */
+
+static __thread int ctf_parallel_nested;
+
+typedef struct ctf_job
+{
+  ctf_work_f *cj_fn;		/* Function to call.  */
+  void *cj_arg;			/* Argument to pass it.  */
+  unsigned long cj_n;		/* Number of items.  */
+  unsigned long cj_chunk;	/* Number of items handed out at a time.  */
+  unsigned long cj_next;	/* First item not yet handed out.  */
+  pthread_mutex_t cj_lock;	/* Protects the error fields.  */
+  unsigned long cj_errstart;	/* Start of the earliest range that failed.  */
+  int cj_err;			/* Its error.  */
+} ctf_job_t;
+
+/* Process ranges of a job until there are none left.  */
+
+static void *
+ctf_job_run (void *data)
+{
+  ctf_job_t *cj = data;
+  unsigned long start, end;
+  int err;
+
+  ctf_parallel_nested = 1;
+
+  while ((start = __atomic_fetch_add (&cj->cj_next, cj->cj_chunk,
+				      __ATOMIC_RELAXED)) < cj->cj_n)
+    {
+      end = cj->cj_n - start < cj->cj_chunk ? cj->cj_n : start + cj->cj_chunk;
+
+      if ((err = cj->cj_fn (cj->cj_arg, start, end)) != 0)
+	{
+	  pthread_mutex_lock (&cj->cj_lock);
+	  if (cj->cj_err == 0 || start < cj->cj_errstart)
+	    {
+	      cj->cj_err = err;
+	      cj->cj_errstart = start;
+	    }
+	  pthread_mutex_unlock (&cj->cj_lock);
+	}
+    }
+
+  return NULL;
+}
+
+/* Split the N items of a job into consecutive ranges of MINCHUNK items, and
+   call FN on each, using up to the ctf_threads() limit of threads, each of
+   which takes the next range whenever it finishes one.  The calling thread
+   works on ranges too, and finishes the job alone if no threads could be
+   created.  A ctf_parallel() call from within FN runs FN serially, so nested
+   jobs do not multiply the number of threads.  Returns the error, if any, of
+   the earliest range that failed.  */
+
+int
+ctf_parallel (unsigned long n, unsigned long minchunk, ctf_work_f *fn,
+	      void *arg)
+{
+  unsigned long nthreads = _libctf_nthreads;
+  pthread_t *threads;
+  int *started;
+  ctf_job_t job;
+  unsigned long i;
+
+  if (minchunk == 0)
+    minchunk = 1;
+
+  if (nthreads > (n + minchunk - 1) / minchunk)
+    nthreads = (n + minchunk - 1) / minchunk;
+
+  if (nthreads <= 1 || ctf_parallel_nested
+      || (threads = ctf_alloc (sizeof (pthread_t) * nthreads)) == NULL)
+    return fn (arg, 0, n);
+
+  if ((started = ctf_alloc (sizeof (int) * nthreads)) == NULL)
+    {
+      ctf_free (threads, sizeof (pthread_t) * nthreads);
+      return fn (arg, 0, n);
+    }
+
+  job.cj_fn = fn;
+  job.cj_arg = arg;
+  job.cj_n = n;
+  job.cj_chunk = minchunk;
+  job.cj_next = 0;
+  job.cj_errstart = 0;
+  job.cj_err = 0;
+  pthread_mutex_init (&job.cj_lock, NULL);
+
+  for (i = 1; i < nthreads; i++)
+    started[i] = pthread_create (&threads[i], NULL, ctf_job_run, &job) == 0;
+
+  ctf_job_run (&job);
+  ctf_parallel_nested = 0;
+
+  for (i = 1; i < nthreads; i++)
+    if (started[i])
+      pthread_join (threads[i], NULL);
+
+  pthread_mutex_destroy (&job.cj_lock);
+  ctf_free (started, sizeof (int) * nthreads);
+  ctf_free (threads, sizeof (pthread_t) * nthreads);
+  return job.cj_err;
+}
+
+/* Set the maximum number of threads an operation may use, or, if NTHREADS is
+   zero, just return the current maximum.  */
+
+int
+ctf_threads (int nthreads)
+{
+  if (nthreads < 0)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  if (nthreads > 0)
+    {
+      ctf_dprintf ("ctf_threads: using up to %d threads\n", nthreads);
+      _libctf_nthreads = nthreads;
+    }
+
+  return _libctf_nthreads;
+}
@@ -146,6 +146,7 @@ ctf_variable_iter (ctf_file_t *fp, ctf_variable_f *func, void *arg)
   if ((fp->ctf_flags & LCTF_CHILD) && (fp->ctf_parent == NULL))
     return ECTF_NOPARENT;
 
+  LCTF_CHUNK (fp, fp->ctf_vars, fp->ctf_nvars * sizeof (ctf_varent_t));
   for (i = 0; i < fp->ctf_nvars; i++)
     if ((rc = func (ctf_strptr (fp, fp->ctf_vars[i].ctv_name),
 		    fp->ctf_vars[i].ctv_typeidx, arg)) != 0)
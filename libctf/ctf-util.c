@@ -79,7 +79,10 @@ ctf_strraw (ctf_file_t *fp, uint32_t name)
   ctf_strs_t *ctsp = &fp->ctf_str[CTF_NAME_STID (name)];
 
   if (ctsp->cts_strs != NULL && CTF_NAME_OFFSET (name) < ctsp->cts_len)
-    return (ctsp->cts_strs + CTF_NAME_OFFSET (name));
+    {
+      LCTF_CHUNK_STR (fp, ctsp->cts_strs + CTF_NAME_OFFSET (name));
+      return (ctsp->cts_strs + CTF_NAME_OFFSET (name));
+    }
 
   /* String table not loaded or corrupt offset.  */
   return NULL;
@@ -105,6 +108,100 @@ ctf_strdup (const char *s1)
   return s2;
 }
 
+/* Allocate SIZE bytes from the specified arena, starting a new block if the
+   current one has no room.  Everything allocated from an arena lives until it
+   is released or destroyed.  */
+
+void *
+ctf_arena_alloc (ctf_arena_t *ap, size_t size)
+{
+  ctf_arena_block_t *b = ap->ca_block;
+  void *p;
+
+  size = (size + sizeof (uint64_t) - 1) & ~(sizeof (uint64_t) - 1);
+
+  if (b == NULL || b->cab_size - b->cab_used < size)
+    {
+      size_t bsize = size > LCTF_ARENA_BLOCK ? size : LCTF_ARENA_BLOCK;
+      ctf_arena_block_t *nb;
+
+      if ((nb = ctf_alloc (sizeof (ctf_arena_block_t) + bsize)) == NULL)
+	return NULL;
+
+      nb->cab_prev = b;
+      nb->cab_start = (b != NULL ? b->cab_start + b->cab_used : 0);
+      nb->cab_size = bsize;
+      nb->cab_used = 0;
+      ap->ca_block = b = nb;
+    }
+
+  p = (char *) (b + 1) + b->cab_used;
+  b->cab_used += size;
+
+  return p;
+}
+
+/* Same as ctf_strdup(), but allocate from the specified arena.  */
+
+char *
+ctf_arena_strdup (ctf_arena_t *ap, const char *s1)
+{
+  size_t len = strlen (s1) + 1;
+  char *s2 = ctf_arena_alloc (ap, len);
+
+  if (s2 != NULL)
+    memcpy (s2, s1, len);
+
+  return s2;
+}
+
+/* Return the position of the next allocation from the specified arena.  */
+
+size_t
+ctf_arena_mark (const ctf_arena_t *ap)
+{
+  const ctf_arena_block_t *b = ap->ca_block;
+
+  return (b != NULL ? b->cab_start + b->cab_used : 0);
+}
+
+/* Release everything allocated from the specified arena from position POS on,
+   as returned by ctf_arena_mark().  */
+
+void
+ctf_arena_release (ctf_arena_t *ap, size_t pos)
+{
+  ctf_arena_block_t *b;
+
+  while ((b = ap->ca_block) != NULL && b->cab_start >= pos)
+    {
+      ap->ca_block = b->cab_prev;
+      ctf_free (b, sizeof (ctf_arena_block_t) + b->cab_size);
+    }
+
+  if (b != NULL && b->cab_start + b->cab_used > pos)
+    b->cab_used = pos - b->cab_start;
+}
+
+/* Free everything ever allocated from the specified arena.  */
+
+void
+ctf_arena_destroy (ctf_arena_t *ap)
+{
+  ctf_arena_release (ap, 0);
+}
+
+/* Return a new container serial number.  Serial numbers are never reused, so
+   unlike addresses they identify a container's types for good.  */
+
+uint64_t
+ctf_serial_next (void)
+{
+  static uint64_t serial;
+
+  return __atomic_add_fetch (&serial, 1, __ATOMIC_RELAXED);
+}
+
 /* Store the specified error code into errp if it is non-NULL, and then
    return NULL for the benefit of the caller.  */
 